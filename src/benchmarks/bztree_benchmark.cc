@@ -0,0 +1,213 @@
+#define NOMINMAX
+
+#include <string>
+#include <sstream>
+#include <inttypes.h>
+
+#include "gflags/gflags.h"
+#include "glog/logging.h"
+#include "glog/raw_logging.h"
+
+#include "benchmarks/benchmark.h"
+#ifdef WIN32
+#include "environment/environment_windows.h"
+#else
+#include "environment/environment_linux.h"
+#endif
+#include "include/pmwcas.h"
+
+#include "bztree/bztree.h"
+#include "util/random_number_generator.h"
+
+using namespace pmwcas::benchmark;
+
+// runs the same workload once per node size, so the node size sweep can be read off one run
+DEFINE_string(node_sizes, "256,1024,4096,16384", "comma-separated list of node sizes in bytes to run"
+    " the benchmark with, in order");
+DEFINE_uint64(min_free_space, BZTREE_MIN_FREE_SPACE, "minimum free space before a node is split");
+DEFINE_uint64(max_deleted_space, BZTREE_MAX_DELETED_SPACE, "maximum deleted space before a node is compacted");
+DEFINE_bool(dram_inner, false, "keep the inner nodes in dram, so only the leaves and the metadata are in the pool");
+DEFINE_uint64(smo_workers, 0, "number of background SMO threads, 0 to do every SMO inline");
+DEFINE_uint64(seed, 1234, "base random number generator seed, the thread index"
+    "is added to this number to form the full seed");
+DEFINE_uint64(initial_size, 100000, "number of keys inserted before the timed run");
+DEFINE_int32(insert_pct, 20, "percentage of insert");
+DEFINE_int32(lookup_pct, 80, "percentage of lookup");
+DEFINE_uint64(threads, 2, "number of threads to use for multi-threaded tests");
+DEFINE_uint64(seconds, 10, "default time to run a benchmark");
+DEFINE_uint64(metrics_dump_interval, 0, "if greater than 0, the benchmark "
+    "driver dumps metrics at this fixed interval (in seconds)");
+DEFINE_int32(affinity, 1, "affinity to use in scheduling threads");
+#ifdef PMEM
+// emulated nvram costs on top of the flushes the build does anyway, see NVRAM::InitializeEmulation
+DEFINE_uint64(write_delay_ns, 0, "NVRAM delay (ns) per cache line written back");
+DEFINE_uint64(fence_delay_ns, 0, "NVRAM delay (ns) of a fence that waits for write backs");
+DEFINE_uint64(write_bw_mbps, 0, "NVRAM write back bandwidth (MB/s) shared by all threads, 0 for unlimited");
+DEFINE_uint64(read_delay_ns, 0, "NVRAM delay (ns) of reading a line that isn't in the emulated cache");
+#endif
+#ifdef PMDK
+DEFINE_string(pmdk_pool, "/mnt/pmem0/bztree_benchmark_pool", "path to pmdk pool");
+DEFINE_uint64(pmdk_pool_size_mb, 4096, "size of the pmdk pool in MB, every node size gets its own tree");
+#endif
+
+namespace pmwcas {
+
+/// Dumps args in a format that can be extracted by an experiment script
+void DumpArgs() {
+  std::cout << "> Args node_sizes " << FLAGS_node_sizes << std::endl;
+  std::cout << "> Args min_free_space " << FLAGS_min_free_space << std::endl;
+  std::cout << "> Args max_deleted_space " << FLAGS_max_deleted_space << std::endl;
+  std::cout << "> Args dram_inner " << FLAGS_dram_inner << std::endl;
+  std::cout << "> Args initial_size " << FLAGS_initial_size << std::endl;
+  printf("> Args insert %d%%\n", FLAGS_insert_pct);
+  printf("> Args lookup %d%%\n", FLAGS_lookup_pct);
+  std::cout << "> Args threads " << FLAGS_threads << std::endl;
+  std::cout << "> Args seconds " << FLAGS_seconds << std::endl;
+  std::cout << "> Args affinity " << FLAGS_affinity << std::endl;
+#ifdef PMEM
+  std::cout << "> Args write_delay_ns " << FLAGS_write_delay_ns << std::endl;
+  std::cout << "> Args fence_delay_ns " << FLAGS_fence_delay_ns << std::endl;
+  std::cout << "> Args write_bw_mbps " << FLAGS_write_bw_mbps << std::endl;
+  std::cout << "> Args read_delay_ns " << FLAGS_read_delay_ns << std::endl;
+#endif
+#ifdef PMDK
+  std::cout << "> Args pmdk_pool " << FLAGS_pmdk_pool << std::endl;
+#endif
+
+  if(FLAGS_insert_pct + FLAGS_lookup_pct != 100) {
+    LOG(FATAL) << "wrong operation mix";
+  }
+}
+
+/// Key for the i-th inserted record. The multiplier is odd so this is a
+/// bijection on uint64_t, it spreads consecutive ids all over the key space
+/// instead of always appending to the rightmost leaf.
+std::string BenchmarkKey(uint64_t i) {
+  char buf[17];
+  snprintf(buf, sizeof(buf), "%016" PRIx64, (uint64_t)(i * 0x9E3779B97F4A7C15ull));
+  return std::string(buf);
+}
+
+struct BzTreeBench : public Benchmark {
+  BzTreeBench(uint32_t node_size)
+    : Benchmark{}
+    , node_size(node_size)
+    , tree(nullptr) {
+    total_insert = 0;
+    total_lookup = 0;
+    total_found = 0;
+  }
+
+  uint32_t node_size;
+  BzTree *tree;
+  std::atomic<uint64_t> total_insert;
+  std::atomic<uint64_t> total_lookup;
+  std::atomic<uint64_t> total_found;
+
+  void Setup(size_t thread_count) {
+    MARK_UNREFERENCED(thread_count);
+    MwCASMetrics::ThreadInitialize();
+    tree = new BzTree(node_size, FLAGS_min_free_space, FLAGS_max_deleted_space, FLAGS_dram_inner);
+    for(uint64_t i = 0; i < FLAGS_initial_size; ++i) {
+      RAW_CHECK(tree->insert(BenchmarkKey(i), BenchmarkKey(i).substr(0, 8)), "loading failed");
+      if((i + 1) % 100000 == 0) {
+        LOG(INFO) << "Inserted " << i + 1;
+      }
+    }
+    if(FLAGS_smo_workers > 0) {
+      tree->start_smo_workers(FLAGS_smo_workers);
+    }
+  }
+
+  void Teardown() {
+    tree->destroy();
+    delete tree;
+    tree = nullptr;
+  }
+
+  void Main(size_t thread_index) {
+    RandomNumberGenerator rng(FLAGS_seed + thread_index, 0, 100);
+    auto s = MwCASMetrics::ThreadInitialize();
+    RAW_CHECK(s.ok(), "Error initializing thread");
+
+    // new keys are striped across the threads so they never collide
+    uint64_t next_insert = FLAGS_initial_size + thread_index;
+    uint64_t n_insert = 0, n_lookup = 0, n_found = 0;
+    WaitForStart();
+    while(!IsShutdown()) {
+      uint32_t op = rng.Generate(100);
+      if(op < (uint32_t)FLAGS_insert_pct) {
+        std::string key = BenchmarkKey(next_insert);
+        tree->insert(key, key.substr(0, 8));
+        next_insert += FLAGS_threads;
+        ++n_insert;
+      } else {
+        uint64_t i = rng.Generate(FLAGS_initial_size);
+        n_found += tree->lookup_view(BenchmarkKey(i)).found();
+        ++n_lookup;
+      }
+    }
+    total_insert += n_insert;
+    total_lookup += n_lookup;
+    total_found += n_found;
+  }
+
+  uint64_t GetOperationCount() {
+    return total_insert.load() + total_lookup.load();
+  }
+};
+
+Status RunBzTree(uint32_t node_size) {
+  BzTreeBench test{node_size};
+  std::cout << "Starting benchmark with node size " << node_size << "..." << std::endl;
+  test.Run(FLAGS_threads, FLAGS_seconds,
+      static_cast<AffinityPattern>(FLAGS_affinity),
+      FLAGS_metrics_dump_interval);
+
+  if(test.total_found.load() != test.total_lookup.load()) {
+    return Status::Corruption("lookup missed a preloaded key");
+  }
+  printf("> NodeSize %u OpsPerSecond %.2f\n", node_size,
+      (double)test.GetOperationCount() / test.GetRunSeconds());
+  printf("> NodeSize %u InsertPerSecond %.2f\n", node_size,
+      (double)test.total_insert.load() / test.GetRunSeconds());
+  printf("> NodeSize %u LookupPerSecond %.2f\n", node_size,
+      (double)test.total_lookup.load() / test.GetRunSeconds());
+  return Status::OK();
+}
+
+void RunBenchmark() {
+  std::string node_size{};
+  std::stringstream node_size_stream(FLAGS_node_sizes);
+  DumpArgs();
+#ifdef PMEM
+  NVRAM::InitializeEmulation(FLAGS_write_delay_ns, FLAGS_fence_delay_ns, FLAGS_write_bw_mbps, FLAGS_read_delay_ns);
+#endif
+
+  while(std::getline(node_size_stream, node_size, ',')) {
+    Status s = RunBzTree(std::stoul(node_size));
+    ALWAYS_ASSERT(s.ok());
+  }
+}
+
+}  // namespace pmwcas
+
+int main(int argc, char* argv[]) {
+  google::InitGoogleLogging(argv[0]);
+  google::ParseCommandLineFlags(&argc, &argv, true);
+#ifdef PMDK
+  pmwcas::InitLibrary(pmwcas::PMDKAllocator::Create(FLAGS_pmdk_pool.c_str(),
+                                                    "bztree_layout",
+                                                    FLAGS_pmdk_pool_size_mb * 1024 * 1024),
+                      pmwcas::PMDKAllocator::Destroy,
+                      pmwcas::LinuxEnvironment::Create,
+                      pmwcas::LinuxEnvironment::Destroy);
+#else
+  pmwcas::InitLibrary(pmwcas::TlsAllocator::Create,
+                      pmwcas::TlsAllocator::Destroy,
+                      pmwcas::LinuxEnvironment::Create,
+                      pmwcas::LinuxEnvironment::Destroy);
+#endif  // PMDK
+  pmwcas::RunBenchmark();
+  return 0;
+}
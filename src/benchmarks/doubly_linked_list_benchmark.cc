@@ -48,6 +48,12 @@ DEFINE_uint64(write_delay_ns, 0, "NVRAM write delay (ns)");
 DEFINE_bool(emulate_write_bw, false, "Emulate write bandwidth");
 DEFINE_bool(clflush, false, "Use CLFLUSH, instead of spinning delays."
   "write_dealy_ns and emulate_write_bw will be ignored.");
+DEFINE_uint64(fence_delay_ns, 0, "NVRAM delay (ns) of a fence that waits for"
+  " write backs");
+DEFINE_uint64(write_bw_mbps, 0, "NVRAM write back bandwidth (MB/s) shared by"
+  " all threads, 0 for unlimited, replaces emulate_write_bw");
+DEFINE_uint64(read_delay_ns, 0, "NVRAM delay (ns) of reading a line that isn't"
+  " in the emulated cache");
 #ifdef PMDK
 DEFINE_string(pmdk_pool, "/mnt/pmem0/doubly_linked_list_benchmark_pool", "path to pmdk pool");
 #endif
@@ -80,6 +86,9 @@ void DumpArgs() {
     std::cout << "> Args write_delay_ns " << FLAGS_write_delay_ns << std::endl;
     std::cout << "> Args emulate_write_bw " << FLAGS_emulate_write_bw
         << std::endl;
+    std::cout << "> Args fence_delay_ns " << FLAGS_fence_delay_ns << std::endl;
+    std::cout << "> Args write_bw_mbps " << FLAGS_write_bw_mbps << std::endl;
+    std::cout << "> Args read_delay_ns " << FLAGS_read_delay_ns << std::endl;
   }
 
 #ifdef PMDK
@@ -92,6 +101,21 @@ void DumpArgs() {
   }
 }
 
+#ifdef PMEM
+/// CLFLUSH, or no flush instruction and the emulated NVRAM delays instead
+void InitializeNVRAM() {
+  if(FLAGS_clflush) {
+    NVRAM::InitializeClflush();
+  } else if(FLAGS_fence_delay_ns || FLAGS_write_bw_mbps || FLAGS_read_delay_ns) {
+    NVRAM::InitializeFlush(NVRAM::kFlushNone);
+    NVRAM::InitializeEmulation(FLAGS_write_delay_ns, FLAGS_fence_delay_ns,
+        FLAGS_write_bw_mbps, FLAGS_read_delay_ns);
+  } else {
+    NVRAM::InitializeSpin(FLAGS_write_delay_ns, FLAGS_emulate_write_bw);
+  }
+}
+#endif
+
 struct DllStats {
   uint64_t n_insert;
   uint64_t n_delete;
@@ -145,11 +169,7 @@ struct DListBench : public Benchmark {
       dll = new CASDList;
     } else if(FLAGS_sync == "pcas") {
 #ifdef PMEM
-      if(FLAGS_clflush) {
-        NVRAM::InitializeClflush();
-      } else {
-        NVRAM::InitializeSpin(FLAGS_write_delay_ns, FLAGS_emulate_write_bw);
-      }
+      InitializeNVRAM();
       dll = new CASDList();
 #else
       LOG(FATAL) << "PMEM undefined";
@@ -161,11 +181,7 @@ struct DListBench : public Benchmark {
     } else if(FLAGS_sync == "pmwcas") {
 #ifdef PMEM
       Descriptor* pool_va = nullptr;
-      if(FLAGS_clflush) {
-        NVRAM::InitializeClflush();
-      } else {
-        NVRAM::InitializeSpin(FLAGS_write_delay_ns, FLAGS_emulate_write_bw);
-      }
+      InitializeNVRAM();
       DescriptorPool* pool = new DescriptorPool(
         FLAGS_mwcas_desc_pool_size, FLAGS_threads);
       dll = new MwCASDList(pool);
@@ -0,0 +1,123 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT license.
+
+// Cost of writing a cache line back with each of the flush instructions
+// NVRAM can use, and of reading the line right after: CLFLUSH and CLFLUSHOPT
+// invalidate the line, so that read misses, CLWB may leave it cached. The
+// emulated NVRAM costs (NVRAM::InitializeEmulation) come on top if set.
+
+#define NOMINMAX
+
+#include <chrono>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <inttypes.h>
+
+#include "gflags/gflags.h"
+#include "glog/logging.h"
+
+#include "common/allocator_internal.h"
+#include "util/nvram.h"
+
+DEFINE_uint64(lines, 4096, "number of cache lines written and flushed per round");
+DEFINE_uint64(rounds, 1000, "number of rounds per flush instruction");
+DEFINE_uint64(batch, 1, "number of lines flushed per fence");
+DEFINE_string(flush, "clwb,clflushopt,clflush,none",
+    "comma-separated list of flush instructions to run, the ones the CPU "
+    "doesn't have are skipped");
+DEFINE_uint64(write_delay_ns, 0, "emulated delay (ns) per cache line written back");
+DEFINE_uint64(fence_delay_ns, 0, "emulated delay (ns) of a fence that waits for write backs");
+DEFINE_uint64(write_bw_mbps, 0, "emulated write back bandwidth (MB/s), 0 for unlimited");
+DEFINE_uint64(read_delay_ns, 0, "emulated delay (ns) of reading a line that isn't cached");
+
+namespace pmwcas {
+
+#ifdef PMEM
+struct FlushResult {
+  double flush_ns;
+  double read_ns;
+};
+
+FlushResult RunFlush(NVRAM::FlushKind kind, char* buffer) {
+  uint64_t bytes = FLAGS_lines * kCacheLineSize;
+  std::chrono::nanoseconds flush_time{0}, read_time{0};
+  volatile uint64_t sum = 0;
+  for(uint64_t round = 0; round < FLAGS_rounds; ++round) {
+    // dirty every line, so there is something to write back
+    for(uint64_t i = 0; i < bytes; i += kCacheLineSize) {
+      *(uint64_t*)&buffer[i] = round + i;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    for(uint64_t i = 0; i < FLAGS_lines; i += FLAGS_batch) {
+      uint64_t n = std::min(FLAGS_batch, FLAGS_lines - i);
+      NVRAM::FlushLines(kind, n * kCacheLineSize, &buffer[i * kCacheLineSize]);
+      NVRAM::Fence(kind);
+    }
+    auto middle = std::chrono::steady_clock::now();
+    for(uint64_t i = 0; i < bytes; i += kCacheLineSize) {
+      NVRAM::Touch(sizeof(uint64_t), &buffer[i]);
+      sum += *(uint64_t*)&buffer[i];
+    }
+    auto end = std::chrono::steady_clock::now();
+
+    flush_time += middle - start;
+    read_time += end - middle;
+  }
+  double lines = (double)FLAGS_lines * FLAGS_rounds;
+  return FlushResult{flush_time.count() / lines, read_time.count() / lines};
+}
+#endif
+
+}  // namespace pmwcas
+
+int main(int argc, char* argv[]) {
+  google::ParseCommandLineFlags(&argc, &argv, true);
+  google::InitGoogleLogging(argv[0]);
+  FLAGS_minloglevel = 2;
+
+#ifdef PMEM
+  using pmwcas::NVRAM;
+  RAW_CHECK(FLAGS_lines > 0 && FLAGS_batch > 0, "lines and batch must be > 0");
+  NVRAM::FlushKind detected = NVRAM::DetectFlush();
+  printf("> Detected %s\n", NVRAM::FlushName(detected));
+  NVRAM::InitializeEmulation(FLAGS_write_delay_ns, FLAGS_fence_delay_ns,
+      FLAGS_write_bw_mbps, FLAGS_read_delay_ns);
+
+  char* buffer = nullptr;
+  int ret = posix_memalign((void**)&buffer, pmwcas::kCacheLineSize,
+      FLAGS_lines * pmwcas::kCacheLineSize);
+  RAW_CHECK(ret == 0 && buffer, "out of memory");
+
+  std::stringstream flushes(FLAGS_flush);
+  std::string name;
+  while(std::getline(flushes, name, ',')) {
+    NVRAM::FlushKind kind;
+    if(name == "clwb") {
+      kind = NVRAM::kFlushClwb;
+    } else if(name == "clflushopt") {
+      kind = NVRAM::kFlushClflushopt;
+    } else if(name == "clflush") {
+      kind = NVRAM::kFlushClflush;
+    } else if(name == "none") {
+      kind = NVRAM::kFlushNone;
+    } else {
+      LOG(FATAL) << "unknown flush instruction " << name;
+    }
+    // the detected one is the best the CPU has, and CPUs have the ones below it too
+    if(kind > detected) {
+      printf("> Flush %s not supported\n", NVRAM::FlushName(kind));
+      continue;
+    }
+
+    pmwcas::FlushResult result = pmwcas::RunFlush(kind, buffer);
+    printf("> Flush %s FlushNsPerLine %.2f ReadAfterNsPerLine %.2f\n",
+        NVRAM::FlushName(kind), result.flush_ns, result.read_ns);
+  }
+  free(buffer);
+#else
+  printf("> Flushing needs a persistent build (PMEM_BACKEND PMDK or EMU)\n");
+#endif
+  return 0;
+}
@@ -35,6 +35,12 @@ DEFINE_uint64(write_delay_ns, 0, "NVRAM write delay (ns)");
 DEFINE_bool(emulate_write_bw, false, "Emulate write bandwidth");
 DEFINE_bool(clflush, false, "Use CLFLUSH, instead of spinning delays."
   "write_dealy_ns and emulate_write_bw will be ignored.");
+DEFINE_uint64(fence_delay_ns, 0, "NVRAM delay (ns) of a fence that waits for"
+  " write backs");
+DEFINE_uint64(write_bw_mbps, 0, "NVRAM write back bandwidth (MB/s) shared by"
+  " all threads, 0 for unlimited, replaces emulate_write_bw");
+DEFINE_uint64(read_delay_ns, 0, "NVRAM delay (ns) of reading a line that isn't"
+  " in the emulated cache");
 #ifdef PMDK
 DEFINE_string(pmdk_pool, "/mnt/pmem0/mwcas_benchmark_pool", "path to pmdk pool");
 #endif
@@ -62,6 +68,9 @@ void DumpArgs() {
     std::cout << "> Args write_delay_ns " << FLAGS_write_delay_ns << std::endl;
     std::cout << "> Args emulate_write_bw " <<
         FLAGS_emulate_write_bw << std::endl;
+    std::cout << "> Args fence_delay_ns " << FLAGS_fence_delay_ns << std::endl;
+    std::cout << "> Args write_bw_mbps " << FLAGS_write_bw_mbps << std::endl;
+    std::cout << "> Args read_delay_ns " << FLAGS_read_delay_ns << std::endl;
   }
 
   #ifdef PMDK
@@ -70,6 +79,21 @@ void DumpArgs() {
 #endif
 }
 
+#ifdef PMEM
+/// CLFLUSH, or no flush instruction and the emulated NVRAM delays instead
+void InitializeNVRAM() {
+  if(FLAGS_clflush) {
+    NVRAM::InitializeClflush();
+  } else if(FLAGS_fence_delay_ns || FLAGS_write_bw_mbps || FLAGS_read_delay_ns) {
+    NVRAM::InitializeFlush(NVRAM::kFlushNone);
+    NVRAM::InitializeEmulation(FLAGS_write_delay_ns, FLAGS_fence_delay_ns,
+        FLAGS_write_bw_mbps, FLAGS_read_delay_ns);
+  } else {
+    NVRAM::InitializeSpin(FLAGS_write_delay_ns, FLAGS_emulate_write_bw);
+  }
+}
+#endif
+
 struct PMDKRootObj {
   DescriptorPool *desc_pool_{nullptr};
   CasPtr* test_array_{nullptr};
@@ -284,6 +308,9 @@ void RunBenchmark() {
   std::string benchmark_name{};
   std::stringstream benchmark_stream(FLAGS_benchmarks);
   DumpArgs();
+#ifdef PMEM
+  InitializeNVRAM();
+#endif
 
   while(std::getline(benchmark_stream, benchmark_name, ',')) {
     Status s{};
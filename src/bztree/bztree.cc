@@ -2,33 +2,39 @@
 #include "common/allocator_internal.h"
 
 #define POOL_SIZE 1000
+// descriptor pool partitions, more threads than that get partitions that steal descriptors
 #define POOL_THREADS 10
 
-#define GLOBAL_EPOCH_OFFSET_BIT (1 << 27)
-
 namespace pmwcas {
 
-BzTree::BzTree() {
+BzTree::BzTree(uint32_t node_size, uint32_t min_free_space, uint32_t max_deleted_space, bool dram_inner)
+    : node_size(node_size), min_free_space(min_free_space), max_deleted_space(max_deleted_space),
+      dram_inner(dram_inner), rebuild_us(0) {
+  assert(node_size % 16 == 0 && node_size <= BZTREE_MAX_NODE_SIZE);
+  // a node has to be able to hold at least the largest record, and records are below BZTREE_MAX_RECORD_SIZE
+  assert(min_free_space < BZTREE_MAX_RECORD_SIZE && min_free_space < body_size());
+
   assert(epoch.Initialize().ok());
   assert(garbage.Initialize(&epoch).ok());
 
 #ifdef PMDK
   auto allocator = reinterpret_cast<PMDKAllocator*>(Allocator::Get());
   pop = allocator->GetPool();
+  slab_partitions.reset(new SlabPartition[BZTREE_SLAB_PARTITIONS]);
+  next_slab_partition = 0;
 
   const struct BzPMDKMetadata *metadata = this->get_metadata();
 
   if (metadata == nullptr) {
     if (DEBUG_PRINT_ACTIONS) printf("--- init new\n");
     // new bztree, who this
-    TOID(struct BzPMDKMetadata) newmetadata_oid;
-    POBJ_ZNEW(pop, &newmetadata_oid, struct BzPMDKMetadata);
-    struct BzPMDKMetadata *newmetadata = D_RW(newmetadata_oid);
+    struct BzPMDKMetadata *newmetadata = new_metadata();
 
     // new root node is a leaf node, so we want the entire node
-    POBJ_ZNEW(pop, &newmetadata->root_node, struct Node);
+    newmetadata->root_node = new_node(true);
     newmetadata->height = 1;
     global_epoch = newmetadata->global_epoch = 0;
+    drain();
 
     // we also need a new descriptor pool, this is safe though
     TOID(DescriptorPool) desc_pool_oid;
@@ -36,75 +42,133 @@ BzTree::BzTree() {
     desc_pool = D_RW(desc_pool_oid);
     new(desc_pool) DescriptorPool(POOL_SIZE, POOL_THREADS);
 
-    // install the new root and descriptor pool ptr, also, test pmwcas on init
+    // and an empty SmoLog (zeroed is empty)
+    TOID(struct SmoLog) smo_log_oid;
+    POBJ_ZNEW(pop, &smo_log_oid, struct SmoLog);
+    smo_log = D_RW(smo_log_oid);
+
+    // and an empty UpdateLog, with room for any value that is stored inline
+    // (a record with an inline value is shorter than min_free_space, see value_out_of_line)
+    uint64_t entry_size = (sizeof(struct UpdateLogEntry) + min_free_space + 63) & ~63ull;
+    TOID(struct UpdateLog) update_log_oid;
+    POBJ_ZALLOC(pop, &update_log_oid, struct UpdateLog, sizeof(struct UpdateLog) + BZTREE_UPDATE_LOG_SIZE * entry_size);
+    update_log = D_RW(update_log_oid);
+    update_log->entry_size = entry_size;
+    persist(&update_log->entry_size, sizeof(update_log->entry_size));
+
+    // install the new root and descriptor pool ptr, the metadata goes last, since it's what tells an existing
+    // tree from a new one when the pool is opened again
     struct BzPMDKRootObj *rootobj = D_RW(POBJ_ROOT(pop, struct BzPMDKRootObj));
-    rootobj->metadata = newmetadata_oid;
     rootobj->desc_pool = desc_pool_oid;
+    rootobj->smo_log = smo_log_oid;
+    rootobj->update_log = update_log_oid;
+    persist(rootobj, sizeof(*rootobj));
+    TOID_ASSIGN(rootobj->metadata, pmemobj_oid(newmetadata));
+    persist(&rootobj->metadata, sizeof(rootobj->metadata));
   } else {
     if (DEBUG_PRINT_ACTIONS) printf("--- init existing\n");
-    // grab the descriptor pool ptr
-    // todo(persistence): check if we have to initialize? DescriptorPool has a third param for existing vm addr...
-    desc_pool = D_RW(D_RW(POBJ_ROOT(pop, struct BzPMDKRootObj))->desc_pool);
-    // todo(persistence): after verifying desc_pool works: increment the global epoch
-    // also throw if global epoch cannot fit in 28 bits, because we borrow offset for that
-    global_epoch = 1;
-    printf("did you forget to rm the pool (replace me when persistence is implemented)");
-    // assert(0);
+    struct BzPMDKRootObj *rootobj = D_RW(POBJ_ROOT(pop, struct BzPMDKRootObj));
+    desc_pool = D_RW(rootobj->desc_pool);
+    smo_log = D_RW(rootobj->smo_log);
+    update_log = D_RW(rootobj->update_log);
+
+    // finish or roll back the pmwcas that were in flight (freeing the blobs they never installed), then thaw what the SMOs in flight had frozen
+    // and roll back the in-place updates in flight (see bztree_recovery.cc)
+    desc_pool->Recovery(false, 0, BzTree::FreeBlob);
+    recover_smos();
+    recover_updates();
+
+    // a new epoch, so reservations from before can be told apart, it has to fit in the offset next to the bit
+    // (if it wraps around, reservations from that many opens ago look like new ones, and just stay until the
+    // node is compacted for other reasons)
+    struct BzPMDKMetadata *md = get_metadata();
+    md->global_epoch = (md->global_epoch + 1) & (GLOBAL_EPOCH_OFFSET_BIT - 1);
+    persist(&md->global_epoch, sizeof(md->global_epoch));
+    global_epoch = md->global_epoch;
+
+    if (is_dram_node(md->root_node)) {
+      // the inner nodes were in dram, so they are gone, put them back together from the leaves
+      // (this also takes the node size from the leaves)
+      rebuild();
+    } else {
+      // nodes cannot change size under an existing tree, so take the size it was created with
+      uint32_t existing_node_size = node_ptr(md->root_node)->header.node_size;
+      if (existing_node_size != 0) this->node_size = existing_node_size;
+      recover_nodes();
+    }
   }
 #else
-#error "Non-PMDK not implemented"
+  // no pool, so this is always a new tree, and everything is in dram anyway
+  this->dram_inner = false;
+  struct BzPMDKMetadata *newmetadata = new_metadata();
+  newmetadata->root_node = new_node(true);
+  newmetadata->height = 1;
+  global_epoch = newmetadata->global_epoch = 0;
+  desc_pool = new DescriptorPool(POOL_SIZE, POOL_THREADS);
+  metadata_word = (uint64_t)newmetadata;
 #endif  // PMDK
 }
 
 BzTree::~BzTree() {
+  stop_smo_workers();
+#ifndef PMDK
+  // without a pool, nothing outlives the tree
+  if (desc_pool) destroy();
+#endif  // PMDK
+  // the nodes still on the garbage list go back to the slabs while those are still around
+  garbage.Uninitialize();
   Thread::ClearRegistry(true);
 }
 
-bool BzTree::insert(const std::string key, const std::string value) {
-  if (DEBUG_PRINT_ACTIONS) printf("--- insert %s %s\n", key.c_str(), value.c_str());
-  size_t space_required = sizeof(struct NodeMetadata) + key.length() + 1 + value.length() + 1;
+bool BzTree::insert(const Slice &key, const Slice &value) {
+  if (DEBUG_PRINT_ACTIONS) printf("--- insert %.*s %.*s\n", (int)key.size(), key.data(), (int)value.size(), value.data());
   // exit early if it is too large for any node
-  if (space_required > BZTREE_MIN_FREE_SPACE) return false;
+  if (key.size() > max_key_size()) return false;
+
+  // large values only take up their blob offset in the leaf, plus up to 7 bytes to align it
+  // (max_key_size leaves room for that)
+  bool out_of_line = value_out_of_line(key.size(), value.size());
+  size_t record_len = key.size() + (out_of_line ? sizeof(uint64_t) : value.size());
+  size_t space_required = sizeof(struct NodeMetadata) + record_len;
 
   assert(epoch.Protect().ok());
-  TOID(struct Node) leaf_oid = find_leaf(key, true);
-  struct Node *leaf = D_RW(leaf_oid);
+  NodeRef leaf_oid = find_leaf(key, true);
+  struct Node *leaf = node_ptr(leaf_oid);
   struct NodeMetadata *nmd = reinterpret_cast<struct NodeMetadata*>(leaf->body);
 
   // check for existing value
   // this first pass is only opportunistic, it's not to formally check for existing value
   // it catches the common bad insertion case though
   bool recheck = false;
-  // todo(optimization): binary search sorted keys
-  for (uint16_t i=0; i<leaf->header.status_word.record_count; i++) {
-    // any not-visible ones potentially are key conflicts in the middle of insertion, if in the same epoch
-    if (!nmd[i].visible && nmd[i].offset == (global_epoch | GLOBAL_EPOCH_OFFSET_BIT)) recheck = true;
-    if (nmd[i].visible && strcmp(&leaf->body[nmd[i].offset], key.c_str()) == 0) {
-      // fail because we found one that's already the same key
-      assert(epoch.Unprotect().ok());
-      return false;
-    }
+  if (leaf_search(leaf, key, &recheck).has_value()) {
+    // fail because we found one that's already the same key
+    assert(epoch.Unprotect().ok());
+    return false;
   }
 
   // reserve space for metadata and key value entry
+  // the record index and offset come from our own reservation, not from whatever the node has by now
+  uint16_t record_index;
+  uint32_t record_offset;
   while (1) {
     // set up pmwcas to allocate space on the node
     // copy status word
-    struct NodeHeaderStatusWord sw_old = leaf->header.status_word;
+    struct NodeHeaderStatusWord sw_old = read_status_word(leaf);
     struct NodeHeaderStatusWord sw = sw_old;
-    if (sw.block_size + space_required > sizeof(struct Node) - sizeof(struct NodeHeader) -
-        sw.record_count * sizeof(struct NodeMetadata)) {
+    // the body ends word aligned, so padding after the record puts the blob offset on a word
+    uint32_t padding = out_of_line ? (sizeof(uint64_t) - sw_old.block_size % sizeof(uint64_t)) % sizeof(uint64_t) : 0;
+    if (sw.block_size + space_required + padding > body_size() - sw.record_count * sizeof(struct NodeMetadata)) {
 
       // too large to fit - something went wrong since we never should've seen this from find_leaf's SMOs
       assert(epoch.Unprotect().ok());
       assert(false);
       return false;
     }
-    sw.block_size += key.length() + 1 + value.length() + 1;
+    sw.block_size += record_len + padding;
     sw.record_count += 1;
 
     // copy node metadata
-    struct NodeMetadata md_old = nmd[sw_old.record_count];
+    struct NodeMetadata md_old = read_metadata(leaf, sw_old.record_count);
     struct NodeMetadata md = md_old;
     assert(md.visible == 0);
     md.offset = (global_epoch | GLOBAL_EPOCH_OFFSET_BIT);
@@ -120,21 +184,24 @@ bool BzTree::insert(const std::string key, const std::string value) {
       recheck = true;
       continue;
     }
+    record_index = sw_old.record_count;
+    record_offset = body_size() - sw.block_size;
     break;
   }
 
   // set up pmwcas to make record visible, also check and ensure the frozen bit
   // status word is not modified, only to ensure frozen bit
-  struct NodeHeaderStatusWord sw = leaf->header.status_word;
+  struct NodeHeaderStatusWord sw = read_status_word(leaf);
 
   // now we can basically safely work, copy the key and value in
-  struct NodeMetadata md_old = nmd[sw.record_count-1];
+  struct NodeMetadata md_old = read_metadata(leaf, record_index);
   struct NodeMetadata md = md_old;
-  md.offset = sizeof(leaf->body) - sw.block_size;
-  md.key_len = key.length() + 1;
-  md.total_len = key.length() + 1 + value.length() + 1;
-  pmemobj_memcpy_persist(pop, &leaf->body[md.offset], key.c_str(), key.length() + 1);
-  pmemobj_memcpy_persist(pop, &leaf->body[md.offset + md.key_len], value.c_str(), value.length() + 1);
+  md.offset = record_offset;
+  md.out_of_line = out_of_line;
+  md.key_len = key.size();
+  md.total_len = record_len;
+  write_record(leaf, md, key, value);
+  set_fingerprint(leaf, record_index, key);
 
   if (sw.frozen) {
     // must retry entire thing (including traversal) since this is frozen
@@ -144,10 +211,19 @@ bool BzTree::insert(const std::string key, const std::string value) {
   }
 
   md.visible = 1;
-  auto *desc = desc_pool->AllocateDescriptor();
+  auto *desc = desc_pool->AllocateDescriptor(nullptr, BzTree::FreeBlob);
   assert(desc);
   desc->AddEntry((uint64_t*)&leaf->header.status_word, *(uint64_t*)&sw, *(uint64_t*)&sw);
-  desc->AddEntry((uint64_t*)&nmd[sw.record_count-1], *(uint64_t*)&md_old, *(uint64_t*)&md);
+  desc->AddEntry((uint64_t*)&nmd[record_index], *(uint64_t*)&md_old, *(uint64_t*)&md);
+  if (out_of_line) {
+    // the blob is allocated straight into the descriptor, so pmwcas frees it if this fails
+    // (the reserved space is still zero since nodes are append only)
+    uint32_t blob_entry = desc->ReserveAndAddEntry((uint64_t*)&leaf->body[md.offset + md.key_len], 0,
+        Descriptor::kRecycleNewOnFailure);
+    new_blob(value, desc, blob_entry);
+  }
+  // everything written for this record so far is only flushed, one drain makes it all durable before it's visible
+  drain();
   if (!desc->MwCAS()) {
     // node has unfortunately become frozen in the meantime
     // so we must retry the entire thing
@@ -161,200 +237,304 @@ bool BzTree::insert(const std::string key, const std::string value) {
   return true;
 }
 
-bool BzTree::update(const std::string key, const std::string value) {
-  if (DEBUG_PRINT_ACTIONS) printf("--- update %s %s\n", key.c_str(), value.c_str());
-  // fail if the size required is larger than min free space, because the key can potentially cause rebalancing issues
-  size_t space_required = key.length() + 1 + value.length() + 1;
-  if (sizeof(struct NodeMetadata) + space_required > BZTREE_MIN_FREE_SPACE) return false;
+bool BzTree::update(const Slice &key, const Slice &value) {
+  if (DEBUG_PRINT_ACTIONS) printf("--- update %.*s %.*s\n", (int)key.size(), key.data(), (int)value.size(), value.data());
+  // fail if the key is too large for any node, it can't be in the tree then either
+  if (key.size() > max_key_size()) return false;
+
+  // large values go out of line like in insert
+  bool out_of_line = value_out_of_line(key.size(), value.size());
+  size_t space_required = key.size() + (out_of_line ? sizeof(uint64_t) : value.size());
 
   // now we start
   assert(epoch.Protect().ok());
-  TOID(struct Node) leaf_oid = find_leaf(key, true);
-  struct Node *leaf = D_RW(leaf_oid);
+  NodeRef leaf_oid = find_leaf(key, true);
+  struct Node *leaf = node_ptr(leaf_oid);
   struct NodeMetadata *nmd = reinterpret_cast<struct NodeMetadata*>(leaf->body);
 
-  // todo(optimization): binary search sorted keys
-  for (uint16_t i=0; i<leaf->header.status_word.record_count; i++) {
-    if (nmd[i].visible && strcmp(&leaf->body[nmd[i].offset], key.c_str()) == 0) {
-      // found! now we copy it into local and recheck
-      // while (1) is to be able to retry upon new data region allocation failure, since the node is the same
-      // (almost certainly, that is, it's rechecked for failures though so it's fine)
-      while (1) {
-        struct NodeHeaderStatusWord sw_old = leaf->header.status_word;
-        struct NodeHeaderStatusWord sw = sw_old;
-        struct NodeMetadata nmdi_old = nmd[i];
-        struct NodeMetadata nmdi = nmdi_old;
-        if (!nmdi.visible || sw.frozen) {
-          // we have been bamboozled (potentially via a concurrent delete for the same node)
-          // or the thing is frozen, either way, we must re-scan
-          assert(epoch.Unprotect().ok());
-          // todo(optimization): tail call
-          return update(key, value);
-        }
-
-        // todo(feature): if the payload value is smaller, consider updating in-place
-        // this is nontrivial though because there could be a concurrent read for the
-        // value which cannot return a partial old and partial new value
-
-        // todo(optimization): we really don't need to re-allocate the key here, but then
-        // we would have to change the node data structure to have key and value ptrs
-        // instead of a key len and value len and offset... which may be better, actually, sidenote:
-        // we did take the design decision to only store strings, so nulls cannot be in k or v
-        // so we can get away with one less pointer in the struct
-
-        // now we need to reserve some space, or split the node if we can't
-        size_t space_required = key.length() + 1 + value.length() + 1;
-        if (sw.block_size + space_required > sizeof(struct Node) - sizeof(struct NodeHeader) -
-            sw.record_count * sizeof(struct NodeMetadata)) {
-          // too large to fit - something went wrong since we never should've seen this from find_leaf's SMOs
-          assert(epoch.Unprotect().ok());
-          assert(false);
-          return false;
-        }
-
-        // allocate space first
-        // todo(optimization): we only need a one-word CAS for this, but,
-        // we're using the library for convenience
-        sw.block_size += space_required;
-        {
-          auto *desc = desc_pool->AllocateDescriptor();
-          assert(desc);
-          desc->AddEntry((uint64_t*)&leaf->header.status_word, *(uint64_t*)&sw_old, *(uint64_t*)&sw);
-          if (!desc->MwCAS()) {
-            // possible frozen or insert, optimistically continue, it'll detect frozen if so
-            continue;
-          }
-        }
-
-        // prepare next pmwcas
-        sw_old = sw;
-        // this one swaps in the offset and total_len, so we can also add in the delete_size
-        // (not mentioned in paper, but it's a good heuristic thing to add)
-        // since we need to pmwcas in the status word anyways to make sure the node didn't get frozen
-        sw.delete_size += nmdi.total_len;
-
-        nmdi.offset = sizeof(leaf->body) - sw.block_size;
-        assert(nmdi.key_len == key.length() + 1);
-        nmdi.total_len = key.length() + 1 + value.length() + 1;
-        pmemobj_memcpy_persist(pop, &leaf->body[nmdi.offset], key.c_str(), key.length() + 1);
-        pmemobj_memcpy_persist(pop, &leaf->body[nmdi.offset + nmdi.key_len], value.c_str(), value.length() + 1);
-
-        // install new data offset
-        {
-          auto *desc = desc_pool->AllocateDescriptor();
-          assert(desc);
-          desc->AddEntry((uint64_t*)&leaf->header.status_word, *(uint64_t*)&sw_old, *(uint64_t*)&sw);
-          desc->AddEntry((uint64_t*)&nmd[i], *(uint64_t*)&nmdi_old, *(uint64_t*)&nmdi);
-          if (!desc->MwCAS()) {
-            // possible frozen or insert, optimistically continue, it'll detect frozen if so
-            // todo(optimization): we could un-allocate the space... uhh, that's dangerous though
-            continue;
-          }
-        }
-
-        // all done!
-        assert(epoch.Unprotect().ok());
-        return true;
-      }
-    }
+  auto found = leaf_search(leaf, key);
+  if (!found.has_value()) {
+    // we did not find the key
+    assert(epoch.Unprotect().ok());
+    return false;
   }
+  uint16_t i = *found;
 
-  // we did not find the key
-  assert(epoch.Unprotect().ok());
-  return false;
-}
+  // found! now we copy it into local and recheck
+  // while (1) is to be able to retry upon new data region allocation failure, since the node is the same
+  // (almost certainly, that is, it's rechecked for failures though so it's fine)
+  while (1) {
+    struct NodeHeaderStatusWord sw_old = read_status_word(leaf);
+    struct NodeHeaderStatusWord sw = sw_old;
+    struct NodeMetadata nmdi_old = read_metadata(leaf, i);
+    struct NodeMetadata nmdi = nmdi_old;
+    if (!nmdi.visible || sw.frozen) {
+      // we have been bamboozled (potentially via a concurrent delete for the same node)
+      // or the thing is frozen, either way, we must re-scan
+      assert(epoch.Unprotect().ok());
+      // todo(optimization): tail call
+      return update(key, value);
+    }
+    // another update is writing the value in place, it's only copying so wait for it
+    if (nmdi.version % 2) continue;
+
+    // if the new value fits where the old one is, overwrite it in place, so that updates don't use up
+    // the node and get it compacted - see stable_metadata for how readers don't see a torn value
+    // the version must not wrap, so the update after the largest even version goes out of place
+    uint32_t old_len = nmdi.total_len - nmdi.key_len;
+    if (!out_of_line && !nmdi.out_of_line && value.size() <= old_len && nmdi.version < (1 << 7) - 2 &&
+        old_len <= update_log_capacity()) {
+      // the old value goes to the UpdateLog first, so a crash while the version is odd is rolled back
+      struct UpdateLogEntry *entry = log_update(leaf_oid, i, nmdi_old);
+      // make the version odd, and check that the node isn't frozen, since an SMO could copy it out
+      // the space freed at the end of the old value counts as deleted
+      nmdi.version++;
+      sw.delete_size += old_len - value.size();
+      auto *desc = desc_pool->AllocateDescriptor();
+      assert(desc);
+      desc->AddEntry((uint64_t*)&leaf->header.status_word, *(uint64_t*)&sw_old, *(uint64_t*)&sw);
+      desc->AddEntry((uint64_t*)&nmd[i], *(uint64_t*)&nmdi_old, *(uint64_t*)&nmdi);
+      if (entry != nullptr) desc->AddEntry(&entry->metadata, 0, *(uint64_t*)&nmdi_old);
+      if (!desc->MwCAS()) {
+        unlog_update(entry);
+        continue;
+      }
 
-std::optional<std::string> BzTree::lookup(const std::string key) {
-  if (DEBUG_PRINT_ACTIONS) printf("--- lookup %s\n", key.c_str());
-  // we still need protection against deletion for this
-  assert(epoch.Protect().ok());
+      memcpy(&leaf->body[nmdi.offset + nmdi.key_len], value.data(), value.size());
+      persist(&leaf->body[nmdi.offset + nmdi.key_len], value.size());
 
-  TOID(struct Node) leaf_oid = find_leaf(key, false);
-  const struct Node *leaf = D_RO(leaf_oid);
-  const struct NodeMetadata *nmd = reinterpret_cast<const struct NodeMetadata*>(leaf->body);
+      // make the version even again with the new length
+      // nothing else changes a record with an odd version, and SMOs wait for it, so this can't fail
+      struct NodeMetadata nmdi_done = nmdi;
+      nmdi_done.version++;
+      nmdi_done.total_len = key.size() + value.size();
+      bool done = cas_word(&nmd[i], *(uint64_t*)&nmdi, *(uint64_t*)&nmdi_done);
+      assert(done);
+      unlog_update(entry);
 
-  // todo(optimization): binary search sorted keys
-  for (uint16_t i=0; i<leaf->header.status_word.record_count; i++) {
-    if (nmd[i].visible && strcmp(&leaf->body[nmd[i].offset], key.c_str()) == 0) {
-      // found!
-      std::string res(&leaf->body[nmd[i].offset + nmd[i].key_len]);
       assert(epoch.Unprotect().ok());
-      return res;
+      return true;
     }
-  }
-
-  // did not find it
-  assert(epoch.Unprotect().ok());
-  return std::nullopt;
-}
 
-bool BzTree::erase(const std::string key) {
-  if (DEBUG_PRINT_ACTIONS) printf("--- erase %s\n", key.c_str());
-  assert(epoch.Protect().ok());
-  // todo(optimization): is perform_smo=true or false better here?
-  TOID(struct Node) leaf_oid = find_leaf(key, false);
-  struct Node *leaf = D_RW(leaf_oid);
-  struct NodeMetadata *nmd = reinterpret_cast<struct NodeMetadata*>(leaf->body);
+    // todo(optimization): we really don't need to re-allocate the key here, but then
+    // we would have to change the node data structure to have key and value ptrs
+    // instead of a key len and value len and offset... which may be better, actually
 
-  // todo(optimization): binary search sorted keys
-  for (uint16_t i=0; i<leaf->header.status_word.record_count; i++) {
-    if (nmd[i].visible && strcmp(&leaf->body[nmd[i].offset], key.c_str()) == 0) {
-      // found! now we copy it into local and recheck
-      struct NodeHeaderStatusWord sw_old = leaf->header.status_word;
-      struct NodeHeaderStatusWord sw = sw_old;
-      struct NodeMetadata nmdi_old = nmd[i];
-      struct NodeMetadata nmdi = nmdi_old;
-      if (!nmdi.visible || sw.frozen) {
-        // we have been bamboozled (potentially via a concurrent delete for the same node)
-        // or the thing is frozen, either way, we must re-scan
-        assert(epoch.Unprotect().ok());
-        // todo(optimization): tail call
-        return erase(key);
-      }
+    // now we need to reserve some space, or split the node if we can't
+    uint32_t padding = out_of_line ? (sizeof(uint64_t) - sw_old.block_size % sizeof(uint64_t)) % sizeof(uint64_t) : 0;
+    if (sw.block_size + space_required + padding > body_size() - sw.record_count * sizeof(struct NodeMetadata)) {
+      // too large to fit - something went wrong since we never should've seen this from find_leaf's SMOs
+      assert(epoch.Unprotect().ok());
+      assert(false);
+      return false;
+    }
 
-      // erase node
-      nmdi.offset = 0;
-      nmdi.visible = 0;
-      sw.delete_size += nmdi.total_len + sizeof(nmdi);
+    // allocate space first, only the status word changes
+    sw.block_size += space_required + padding;
+    if (!cas_word(&leaf->header.status_word, *(uint64_t*)&sw_old, *(uint64_t*)&sw)) {
+      // possible frozen or insert, optimistically continue, it'll detect frozen if so
+      continue;
+    }
 
-      // pmwcas to install new values
-      auto *desc = desc_pool->AllocateDescriptor();
+    // prepare next pmwcas
+    sw_old = sw;
+    // this one swaps in the offset and total_len, so we can also add in the delete_size
+    // (not mentioned in paper, but it's a good heuristic thing to add)
+    // since we need to pmwcas in the status word anyways to make sure the node didn't get frozen
+    sw.delete_size += nmdi.total_len;
+
+    // a new offset, so the versions of in-place updates can start over
+    nmdi.version = 0;
+    nmdi.offset = body_size() - sw.block_size;
+    nmdi.out_of_line = out_of_line;
+    assert(nmdi.key_len == key.size());
+    nmdi.total_len = space_required;
+    write_record(leaf, nmdi, key, value);
+
+    // install new data offset, and the new blob if there is one, see insert
+    {
+      auto *desc = desc_pool->AllocateDescriptor(nullptr, BzTree::FreeBlob);
       assert(desc);
       desc->AddEntry((uint64_t*)&leaf->header.status_word, *(uint64_t*)&sw_old, *(uint64_t*)&sw);
       desc->AddEntry((uint64_t*)&nmd[i], *(uint64_t*)&nmdi_old, *(uint64_t*)&nmdi);
+      if (out_of_line) {
+        uint32_t blob_entry = desc->ReserveAndAddEntry((uint64_t*)&leaf->body[nmdi.offset + nmdi.key_len], 0,
+            Descriptor::kRecycleNewOnFailure);
+        new_blob(value, desc, blob_entry);
+      }
+      drain();
       if (!desc->MwCAS()) {
-        // node has unfortunately become frozen in the meantime, or something, we have to re-traverse
-        assert(epoch.Unprotect().ok());
-        // todo(optimization): tail call
-        return erase(key);
+        // possible frozen or insert, optimistically continue, it'll detect frozen if so
+        // todo(optimization): we could un-allocate the space... uhh, that's dangerous though
+        continue;
       }
+    }
 
-      return true;
+    // the old value is unreachable now, but readers may still be in its blob
+    if (nmdi_old.out_of_line) {
+      assert(garbage.Push(record_blob(leaf, nmdi_old), BzTree::DestroyNode, nullptr).ok());
     }
+
+    // all done!
+    assert(epoch.Unprotect().ok());
+    return true;
+  }
+}
+
+std::optional<std::string> BzTree::lookup(const Slice &key) {
+  while (1) {
+    ValueView view = lookup_view(key);
+    if (!view.found()) return std::nullopt;
+    std::string res(view.value().data(), view.value().size());
+    // overwritten in place while copying, so look it up again
+    if (view.valid()) return res;
+  }
+}
+
+BzTree::ValueView BzTree::lookup_view(const Slice &key) {
+  if (DEBUG_PRINT_ACTIONS) printf("--- lookup %.*s\n", (int)key.size(), key.data());
+  // the view protects the thread until it's destroyed, and the value is read under that
+  ValueView view(this);
+
+  NodeRef leaf_oid = find_leaf(key, false);
+  const struct Node *leaf = node_ptr(leaf_oid);
+
+  auto found = leaf_search(leaf, key);
+  if (found.has_value()) {
+    // found!
+    view.found_ = true;
+    view.leaf = leaf;
+    view.index = *found;
+    view.md = stable_metadata(leaf, *found);
+    view.value_ = record_value(leaf, view.md);
+  }
+  return view;
+}
+
+BzTree::ValueView::ValueView(BzTree *tree) : tree(tree), found_(false), leaf(nullptr), index(0), md() {
+  assert(tree->epoch.Protect().ok());
+}
+
+BzTree::ValueView::ValueView(ValueView &&other)
+    : tree(other.tree), found_(other.found_), value_(other.value_),
+      leaf(other.leaf), index(other.index), md(other.md) {
+  other.tree = nullptr;
+}
+
+bool BzTree::ValueView::valid() const {
+  return !found_ || tree->metadata_unchanged(leaf, index, md);
+}
+
+BzTree::ValueView::~ValueView() {
+  if (tree != nullptr) assert(tree->epoch.Unprotect().ok());
+}
+
+bool BzTree::erase(const Slice &key) {
+  if (DEBUG_PRINT_ACTIONS) printf("--- erase %.*s\n", (int)key.size(), key.data());
+  assert(epoch.Protect().ok());
+  // todo(optimization): is perform_smo=true or false better here?
+  NodeRef leaf_oid = find_leaf(key, false);
+  struct Node *leaf = node_ptr(leaf_oid);
+  struct NodeMetadata *nmd = reinterpret_cast<struct NodeMetadata*>(leaf->body);
+
+  auto found = leaf_search(leaf, key);
+  if (!found.has_value()) {
+    // we did not find the key
+    assert(epoch.Unprotect().ok());
+    return false;
+  }
+  uint16_t i = *found;
+
+  // found! now we copy it into local and recheck
+  struct NodeHeaderStatusWord sw_old = read_status_word(leaf);
+  struct NodeHeaderStatusWord sw = sw_old;
+  struct NodeMetadata nmdi_old = read_metadata(leaf, i);
+  struct NodeMetadata nmdi = nmdi_old;
+  if (!nmdi.visible || sw.frozen || nmdi.version % 2) {
+    // we have been bamboozled (potentially via a concurrent delete for the same node)
+    // or the thing is frozen, or an update is writing it in place, either way, we must re-scan
+    assert(epoch.Unprotect().ok());
+    // todo(optimization): tail call
+    return erase(key);
+  }
+
+  // erase node
+  // the offset is left alone so the key stays readable, leaf_search binary searches over it
+  nmdi.visible = 0;
+  sw.delete_size += nmdi.total_len + sizeof(nmdi);
+
+  // pmwcas to install new values
+  auto *desc = desc_pool->AllocateDescriptor();
+  assert(desc);
+  desc->AddEntry((uint64_t*)&leaf->header.status_word, *(uint64_t*)&sw_old, *(uint64_t*)&sw);
+  desc->AddEntry((uint64_t*)&nmd[i], *(uint64_t*)&nmdi_old, *(uint64_t*)&nmdi);
+  if (!desc->MwCAS()) {
+    // node has unfortunately become frozen in the meantime, or something, we have to re-traverse
+    assert(epoch.Unprotect().ok());
+    // todo(optimization): tail call
+    return erase(key);
+  }
+
+  if (nmdi_old.out_of_line) {
+    assert(garbage.Push(record_blob(leaf, nmdi_old), BzTree::DestroyNode, nullptr).ok());
   }
 
-  // we did not find the key
   assert(epoch.Unprotect().ok());
-  return false;
+  return true;
 }
 
 void BzTree::destroy() {
-  // todo(optimization): we should free all the nodes, otherwise they're still taking up memory
-  // either that or just rm the pool object after closing it
-  // todo(benchmarks): we may actually need to do the latter for benchmarks
+  stop_smo_workers();
+
+  // free all the nodes and blobs, otherwise they're still taking up the pool
+  // (and a tree with inner nodes in dram would pick up the leaves of this one when it is rebuilt)
+  // replaced nodes are still on the garbage list, which frees them below
+  struct BzPMDKMetadata *md = get_metadata();
+  std::vector<std::pair<NodeRef, uint64_t>> stack{{md->root_node, md->height}};
+  while (!stack.empty()) {
+    auto [node_oid, height] = stack.back();
+    stack.pop_back();
+    struct Node *node = node_ptr(node_oid);
+    const struct NodeMetadata *nmd = reinterpret_cast<const struct NodeMetadata*>(node->body);
+    for (uint16_t i=0; i<node->header.status_word.record_count; i++) {
+      if (!nmd[i].visible) continue;
+      if (height > 1) {
+        NodeRef child{*(const uint64_t*)&node->body[nmd[i].offset + nmd[i].key_len]};
+        stack.emplace_back(child, height - 1);
+      } else if (nmd[i].out_of_line) {
+        DestroyNode(nullptr, record_blob(node, nmd[i]));
+      }
+    }
+    free_node(node_oid);
+  }
+  DestroyNode(nullptr, md);
 
+#ifdef PMDK
   // destroy the tree root node
   D_RW(POBJ_ROOT(pop, struct BzPMDKRootObj))->metadata = TOID_NULL(struct BzPMDKMetadata);
   D_RW(POBJ_ROOT(pop, struct BzPMDKRootObj))->desc_pool = TOID_NULL(DescriptorPool);
+  POBJ_FREE(&D_RW(POBJ_ROOT(pop, struct BzPMDKRootObj))->smo_log);
+  smo_log = nullptr;
+  POBJ_FREE(&D_RW(POBJ_ROOT(pop, struct BzPMDKRootObj))->update_log);
+  update_log = nullptr;
 
-  // clear decriptor pool and prevent reuse of this instance by resetting pop
+  // clear decriptor pool
   if (desc_pool) desc_pool->~DescriptorPool();
   desc_pool = nullptr;
-  pop = nullptr;
+#else
+  delete desc_pool;
+  desc_pool = nullptr;
+  metadata_word = 0;
+#endif  // PMDK
 
   // clear aux stuff
   garbage.Uninitialize();
   epoch.Uninitialize();
+#ifdef PMDK
+  // only now that the garbage list freed the replaced nodes too, and prevent reuse of this instance by resetting pop
+  destroy_slabs();
+  pop = nullptr;
+#endif  // PMDK
 
   // clear tls
   Thread::ClearRegistry(true);
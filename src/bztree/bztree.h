@@ -1,18 +1,35 @@
+#include <atomic>
+#include <condition_variable>
 #include <cstdint>
+#include <functional>
+#include <initializer_list>
+#include <memory>
+#include <mutex>
 #include <optional>
 #include <string>
+#include <thread>
+#include <vector>
 #include "mwcas/mwcas.h"
 #include "common/garbage_list.h"
+#include "include/slice.h"
 
 #pragma once  
 
+// these are the defaults for the BzTree constructor, every tree can pick its own
+
 // size in bytes of each node
-// this should be = 16 + 16*(num keys) + total key len
-// 16 for header, per key: 8 for metadata, 8 for value ptr, variable for key 
+// this should be = 16 + 16 + 16*(num keys) + total key len (+ padding to keep value ptrs word aligned)
+// 16 for header, 16 or more for fingerprints, per key: 8 for metadata, 8 for value ptr, variable for key 
+// limits: a multiple of 16, and delete_size must stay below the pmwcas flags in the status word (see below)
 #define BZTREE_NODE_SIZE 256
+#define BZTREE_MAX_NODE_SIZE (1 << 19)
+
+// records (key and inline value, or key and blob offset) are shorter than this, and so is min_free_space,
+// since total_len must stay below the pmwcas flags in the metadata (see below)
+#define BZTREE_MAX_RECORD_SIZE (1 << 13)
 
 // minimum free space for node to not be split during non-read traversal
-// warning: keys larger than this minus 16 (nmd + child ptr) currently cannot be inserted
+// warning: keys larger than this minus 23 (nmd + child ptr + alignment) cannot be inserted
 // todo(feature): add this - it'd require a lot of design decision though, since we shouldn't assume
 // that the large key needs to be propagated upwards every time we traverse the tree for an insertion, right
 // but, on the other hand, we don't want to have to keep track of /all/ the ancestors during traversal
@@ -22,6 +39,35 @@
 // maximum deleted space before a node is compacted
 #define BZTREE_MAX_DELETED_SPACE 100
 
+// records that are still reserving space have this bit and the global epoch in their offset
+// so that recovery (and concurrent inserts) can tell them apart from real offsets
+#define GLOBAL_EPOCH_OFFSET_BIT (1 << 22)
+
+// nodes are referred to by an 8 byte word, in inner nodes and in a NodeRef
+// that is the pool offset of nodes in pmem, and the address of nodes in dram with this bit set
+// (below the three bits pmwcas keeps its flags in, and above any user space address)
+// the volatile build (no PMDK) has no pool, so all of its nodes are in dram
+#define DRAM_NODE_BIT (1ull << 60)
+
+// nodes in the pool are allocated from slabs of about this size (or of a single node, if nodes are larger)
+// and threads are spread over this many free lists of their slots, see NodeSlab and bztree_alloc.cc
+#define BZTREE_SLAB_SIZE (1 << 20)
+#define BZTREE_SLAB_PARTITIONS 16
+
+// how many SMOs can be in flight at once, each one takes an entry in the SmoLog while its nodes are frozen
+#define BZTREE_SMO_LOG_SIZE 256
+
+// how many in-place updates can be in flight at once, each one takes an entry in the UpdateLog
+#define BZTREE_UPDATE_LOG_SIZE 256
+
+// how many nodes can wait for the background SMO workers, nodes that cross the soft thresholds while
+// the queue is full are left for the writers, see BzTree::start_smo_workers
+#define BZTREE_SMO_QUEUE_SIZE 1024
+
+// set in the control bits of a leaf's status word, by the pmwcas that replaces it with new leaves,
+// so that a tree with inner nodes in dram can tell which leaves are still in it, see BzTree::rebuild
+#define NODE_RETIRED 1
+
 // debug options:
 #define DEBUG_PRINT_ACTIONS 0
 #define DEBUG_PRINT_SMOS 0
@@ -43,12 +89,18 @@ namespace pmwcas {
 // NodeHeader and NodeMetadata don't need to be in the layout
 // because no persistent pointers to those types should ever be needed
 // since they are calculated from offsets on the Node persistent pointer
+#ifdef PMDK
 POBJ_LAYOUT_BEGIN(bztree_layout);
 POBJ_LAYOUT_ROOT(bztree_layout, struct BzPMDKRootObj);
 POBJ_LAYOUT_ROOT(bztree_layout, struct BzPMDKMetadata);
 POBJ_LAYOUT_TOID(bztree_layout, DescriptorPool);
 POBJ_LAYOUT_TOID(bztree_layout, struct Node);
+POBJ_LAYOUT_TOID(bztree_layout, struct NodeSlab);
+POBJ_LAYOUT_TOID(bztree_layout, struct SmoLog);
+POBJ_LAYOUT_TOID(bztree_layout, struct UpdateLog);
+POBJ_LAYOUT_TOID(bztree_layout, struct Blob);
 POBJ_LAYOUT_END(bztree_layout);
+#endif  // PMDK
 
 // ref figure 2 for these
 #pragma pack(1)
@@ -61,29 +113,101 @@ struct NodeHeaderStatusWord {
 };
 #pragma pack(1)
 struct NodeHeader {
-  uint32_t node_size    : 32; // note: unused, our nodes are constant size
-  uint32_t sorted_count : 32;
+  uint32_t node_size    : 32; // note: all nodes of a tree are the same size, this is how a reopened tree finds it
+  uint16_t sorted_count : 16;
+  uint16_t slot         : 15; // note: where the node is in its NodeSlab, nodes in dram don't use it
+  bool leaf             : 1;  // note: inner nodes keep their values (child ptrs) word aligned, see copy_in
   struct NodeHeaderStatusWord status_word;
 };
 static_assert(sizeof(struct NodeHeader) == 16);
 
 #pragma pack(1)
 struct NodeMetadata {
-  uint8_t control       : 3;
+  uint8_t version       : 7;  // note: the paper's control bits, pmwcas keeps its flags in the top bits instead
+                              // so these count in-place updates of the value, see BzTree::update
   bool visible          : 1;
-  uint32_t offset       : 28;
-  uint16_t key_len      : 16; // note: includes trailing null
-  uint16_t total_len    : 16; // note: includes trailing null for key and value
+  bool out_of_line      : 1; // note: the value is the 8 byte pool offset of a Blob instead, see BzTree::insert
+  uint32_t offset       : 23; // note: an offset into the body, or a reservation (see GLOBAL_EPOCH_OFFSET_BIT)
+  uint16_t key_len      : 16;
+  uint16_t total_len    : 16; // note: key and value, keys and values are binary so there are no trailing nulls
 };
 static_assert(sizeof(struct NodeMetadata) == 8);
 
+// pmwcas keeps its flags in the top three bits of every word it changes, so the fields at the top of the
+// status word and the metadata must never reach them: delete_size starts at bit 42 and is less than the
+// node size, total_len starts at bit 48 and is less than BZTREE_MAX_RECORD_SIZE
+#define PMWCAS_FLAG_BITS (MwcTargetField<uint64_t>::kDescriptorMask | MwcTargetField<uint64_t>::kDirtyFlag)
+static_assert(PMWCAS_FLAG_BITS == 7ull << 61);
+static_assert(3 + 1 + 16 + 22 + 22 == 64 && ((uint64_t)BZTREE_MAX_NODE_SIZE << (3 + 1 + 16 + 22)) <= 1ull << 61);
+static_assert(7 + 1 + 1 + 23 + 16 + 16 == 64 && ((uint64_t)BZTREE_MAX_RECORD_SIZE << (7 + 1 + 1 + 23 + 16)) <= 1ull << 61);
+// and a real offset never has the reservation bit
+static_assert(BZTREE_MAX_NODE_SIZE <= GLOBAL_EPOCH_OFFSET_BIT && GLOBAL_EPOCH_OFFSET_BIT < 1 << 23);
+
+// values too large to be stored in a leaf are allocated separately, and the record only holds the
+// pool offset (the address in the volatile build) - only leaves have these, and a blob is never
+// modified after its record is visible
+struct Blob {
+  uint64_t size;
+  char data[];
+};
+
+// nodes are allocated with the node size of the tree, so the body is sized at runtime
+// that means sizeof(struct Node) is only the header, use BzTree::body_size() for the body
+// after the body, the last BzTree::fingerprint_count() bytes of a node are the key fingerprints
+// of the unsorted tail of a leaf, see BzTree::leaf_search
 #pragma pack(1)
 struct Node {
   struct NodeHeader header;
-  char body[BZTREE_NODE_SIZE - sizeof(header)];
+  char body[];
+};
+static_assert(sizeof(struct Node) == sizeof(struct NodeHeader));
+
+// nodes in the pool are allocated from these, many slots of the tree's node size at a time, so
+// splits and merges don't go through the pmdk allocator (and its locks) for every node
+// a set bit in the bitmap is an allocated slot, that is what the pool has to go by when it is
+// opened again, since the free lists are in dram - the slots start at BzTree::slab_slots_offset
+struct NodeSlab {
+  uint32_t node_size;
+  uint32_t slot_count;
+  uint64_t bitmap[];
+};
+
+// the nodes that SMOs in flight have frozen, a cache line per SMO (which freezes at most three nodes)
+// an entry is taken before the nodes are frozen, and given back once they are replaced or unfrozen again,
+// so when the pool is opened again, these are the only nodes that can be frozen without an SMO to finish it
+// (see BzTree::recover_smos) - otherwise they would stay frozen, and nothing could change them anymore
+struct SmoLogEntry {
+  uint64_t nodes[8];
+};
+struct SmoLog {
+  struct SmoLogEntry entries[BZTREE_SMO_LOG_SIZE];
 };
-static_assert(sizeof(struct Node) == BZTREE_NODE_SIZE);
 
+// the old values of the in-place updates in flight (see BzTree::update), so that one a crash cut off is
+// rolled back when the pool is opened again, instead of leaving a torn value behind
+// an entry is taken and filled in before the update starts, but it only counts once metadata is set, which
+// the pmwcas that makes the record's version odd does - so an entry is never armed with a stale value
+// entries are entry_size bytes, which is a multiple of 64 that holds a value of the largest inline size
+// the tree was created with, larger values (of a tree opened with a larger min_free_space) go out of place
+struct UpdateLogEntry {
+  uint64_t node;      // the leaf's node word, zero while the entry is free
+  uint64_t metadata;  // the record's metadata before the update, zero until the update starts
+  uint64_t index;     // the record's index in the leaf
+  char value[];
+};
+struct UpdateLog {
+  uint64_t entry_size;
+  char entries[];
+};
+
+// a node, by its node word (see DRAM_NODE_BIT), use BzTree::node_ptr to get to it
+// the inner nodes only have room for the 8 byte word, so bztrees cannot span pools anyway,
+// and a full TOID would only repeat the pool id everywhere
+struct NodeRef {
+  uint64_t word;
+};
+
+#ifdef PMDK
 // actual root object only contains a pointer to the root object and descriptor pool
 // this is so we can atomically update height alongside a new root that's that high
 // the paper does not address this problem
@@ -91,110 +215,662 @@ static_assert(sizeof(struct Node) == BZTREE_NODE_SIZE);
 struct BzPMDKRootObj {
   TOID(struct BzPMDKMetadata) metadata;
   TOID(DescriptorPool) desc_pool;
+  TOID(struct SmoLog) smo_log;
+  TOID(struct UpdateLog) update_log;
 };
+#endif  // PMDK
 
 // root object contains root node and height and global index epoch
 // multiple may exist if we're in the middle of a root rotation
 struct BzPMDKMetadata {
-  TOID(struct Node) root_node;
+  NodeRef root_node;
   uint64_t height;
   uint64_t global_epoch;
 };
 
 class BzTree {
   public:
-    BzTree();
+    // node_size, min_free_space and max_deleted_space are described at their defaults above
+    // if the pool already holds a tree, its node size wins over node_size
+    // if dram_inner is set, inner nodes are allocated in dram instead of the pool, so traversals only
+    // touch pmem at the leaf - only the leaves and the metadata are persistent, and the inner levels are
+    // rebuilt from the leaves when the pool is opened again, see rebuild
+    // the volatile build (without PMDK) keeps the whole tree in dram, so there is no pool and
+    // dram_inner does nothing, and the tree is gone with the process
+    BzTree(uint32_t node_size = BZTREE_NODE_SIZE, uint32_t min_free_space = BZTREE_MIN_FREE_SPACE,
+        uint32_t max_deleted_space = BZTREE_MAX_DELETED_SPACE, bool dram_inner = false);
     ~BzTree();
 
     // insert, update, lookup, erase
     // these return false on failure, the user may retry if they want
-    bool insert(const std::string key, const std::string value);
-    bool update(const std::string key, const std::string value);
-    std::optional<std::string> lookup(const std::string key);
-    bool erase(const std::string key);
+    // keys and values are arbitrary bytes, keys are ordered by memcmp (shorter first on a tie, see Slice::compare)
+    bool insert(const Slice &key, const Slice &value);
+    bool update(const Slice &key, const Slice &value);
+    std::optional<std::string> lookup(const Slice &key);
+    bool erase(const Slice &key);
+
+    // result of lookup_view, a read-only view of a value directly in the tree, without copying it
+    // the thread stays epoch protected while this is alive, so the value can't be freed under it
+    // note: protection doesn't nest, so the thread must not call into the tree (or hold another
+    // view) until this is destroyed, and it should be short lived since it holds back the gc
+    class ValueView {
+      public:
+        ValueView(ValueView &&other);
+        ValueView(const ValueView &) = delete;
+        ValueView &operator=(const ValueView &) = delete;
+        ValueView &operator=(ValueView &&) = delete;
+        ~ValueView();
+
+        bool found() const { return found_; }
+        explicit operator bool() const { return found_; }
+        // only valid if found(), and only while this view is alive
+        // a concurrent update usually swaps in a new record, so this keeps showing the old value,
+        // but a value that fits in the old one's place is overwritten in place
+        Slice value() const { return value_; }
+        // whether the value wasn't overwritten in place since the lookup, so whatever was read from
+        // value() before this call is not torn - check this after reading if updates may be concurrent
+        bool valid() const;
+
+      private:
+        friend class BzTree;
+        explicit ValueView(BzTree *tree);
+
+        // nullptr once moved from, so only one of them unprotects
+        BzTree *tree;
+        bool found_;
+        Slice value_;
+        // the record and its metadata as of the lookup, to tell if it changed
+        const struct Node *leaf;
+        uint16_t index;
+        struct NodeMetadata md;
+    };
+
+    // like lookup, but the value is not copied out, see ValueView
+    ValueView lookup_view(const Slice &key);
+
+    // batched lookup and insert, results are in the same order as the input
+    // the batch is sorted and keys that land on the same leaf are served by one traversal, and batched
+    // inserts reserve and publish as many records per pmwcas as fit in a descriptor (DESC_CAP words)
+    // the batch is not atomic, other operations can see any part of it
+    // if a key is in an insert batch more than once, only the first one is inserted
+    std::vector<std::optional<std::string>> multi_get(const std::vector<Slice> &keys);
+    std::vector<bool> multi_insert(const std::vector<std::pair<Slice, Slice>> &records);
+
+    // ordered iterator over a key range, see scan()
+    // leaves are copied out one at a time into a buffer that is reused across leaves, so the
+    // views returned by key() and value() are only valid until the next call to next()
+    // this is not a snapshot: each leaf is consistent, but concurrent changes to leaves that
+    // have not been copied yet may or may not be seen
+    class Iterator {
+      public:
+        // moves to the next record, returns false once the range or limit is exhausted
+        // must be called once before the first record is available
+        bool next();
+
+        Slice key() const;
+        Slice value() const;
+
+      private:
+        friend class BzTree;
+        Iterator(BzTree *tree, std::optional<Slice> start_key, std::optional<Slice> end_key,
+            uint64_t limit, bool reverse);
+
+        // copies the next leaf in the scan direction that has records in range into the buffer
+        // returns false if there are no more leaves
+        bool fill();
+
+        struct Entry {
+          uint32_t key_off;
+          uint32_t key_len;
+          uint32_t value_off;
+          uint32_t value_len;
+        };
+
+        BzTree *tree;
+        std::optional<std::string> start_key, end_key;
+        uint64_t remaining;
+        bool reverse;
+
+        // the separator to continue from for the next leaf, nullopt once the last leaf was copied
+        std::optional<std::string> fence;
+        bool first;
+
+        // copied records of the current leaf, in scan order
+        std::vector<char> buf;
+        std::vector<Entry> entries;
+        size_t pos;
+    };
+
+    // scans the keys in [start_key, end_key) in key order, or in reverse key order if reverse is set
+    // nullopt for a bound means that side is unbounded, and at most limit records are returned
+    Iterator scan(std::optional<Slice> start_key, std::optional<Slice> end_key,
+        uint64_t limit = UINT64_MAX, bool reverse = false);
+
+    // builds the tree bottom up from records in strictly increasing key order, instead of inserting them
+    // next is called for each record until it returns false, and the slices it sets only have to
+    // stay valid until it is called again
+    // every node is packed to fill_factor of its space, so later inserts don't split them right away
+    // the tree must be empty, it is replaced in one metadata swap at the end, so concurrent operations
+    // either see the empty tree or the whole load
+    // returns false if the tree was not empty or the input was not sorted, or had a key too large
+    // to insert, then nothing is loaded
+    bool bulk_load(const std::function<bool(Slice *key, Slice *value)> &next, double fill_factor = 1.0);
+
+    // how long the constructor took to rebuild the inner levels from the leaves, 0 if it didn't have to
+    uint64_t rebuild_micros() const { return rebuild_us; }
+
+    // starts threads that split, compact and merge nodes in the background, ahead of need, so that writers
+    // rarely have to do SMOs themselves (see the background SMOs section below)
+    // the workers split nodes with less than soft_free_space free, and compact nodes with more than
+    // soft_deleted_space deleted - 0 picks min_free_space plus an eighth of the node, and half of
+    // max_deleted_space, and writers still do SMOs at min_free_space and max_deleted_space
+    // the workers are stopped by stop_smo_workers, destroy and the destructor
+    // neither is thread safe, so call them while no other operations are ongoing
+    void start_smo_workers(uint32_t threads = 1, uint32_t soft_free_space = 0, uint32_t soft_deleted_space = 0);
+    void stop_smo_workers();
 
     // used to destroy the tree, so that a new tree can be constructed
     // the destructor doesn't actually destroy the tree, because it is saved in pmem
+    // (except in the volatile build, where the destructor calls this if it wasn't yet)
     // not thread safe, will cause UB if called while other operations are ongoing
     void destroy();
 
     // prints stuff to stdout, without regard for safety
     void DEBUG_print_node(const struct Node* node);
-    void DEBUG_print_tree(TOID(struct Node) node_oid = TOID_NULL(struct Node), int h = 0, int height = 0);
-    void DEBUG_verify_sorted(TOID(struct Node) node_oid);
+    void DEBUG_print_tree(NodeRef node_oid = NodeRef{}, int h = 0, int height = 0);
+    void DEBUG_verify_sorted(NodeRef node_oid);
 
   private:
+#ifdef PMDK
     // we must re-obtain the root pointer on every action, so nothing in pmem can really be "cached"
     PMEMobjpool *pop;
+#else
+    // the address of the current metadata, which the pool root object holds in pmem
+    uint64_t metadata_word;
+#endif  // PMDK
 
     // garbage collection
     EpochManager epoch;
     GarbageList garbage;
 
     // these are cached from the pmem safely because they never are changed
+    // (the global epoch only changes when the pool is opened, see the constructor)
     DescriptorPool *desc_pool;
     uint64_t global_epoch;
+#ifdef PMDK
+    struct SmoLog *smo_log;
+    struct UpdateLog *update_log;
+    // where the calling thread last found a free SmoLog and UpdateLog entry
+    static thread_local uint32_t smo_log_hint;
+    static thread_local uint32_t update_log_hint;
+#endif  // PMDK
+
+    // node size and SMO thresholds, see the constructor
+    uint32_t node_size;
+    uint32_t min_free_space;
+    uint32_t max_deleted_space;
+    bool dram_inner;
+
+    uint64_t rebuild_us;
 
-    // destroy function for garbage list
+#ifdef PMDK
+    // free slots of the node slabs, the slab is its pool offset
+    struct FreeSlot {
+      uint64_t slab;
+      uint16_t slot;
+    };
+
+    // threads take nodes from (and free them to) their own partition, see slab_partition
+    // the lock is only ever contended if there are more threads than partitions
+    struct SlabPartition {
+      std::mutex lock;
+      std::vector<FreeSlot> free_slots;
+    };
+    std::unique_ptr<SlabPartition[]> slab_partitions;
+    std::atomic<uint32_t> next_slab_partition;
+
+    // the partition of the calling thread, like DescriptorPool hands out its partitions
+    static thread_local BzTree *slab_tree;
+    static thread_local SlabPartition *slab_part;
+#endif  // PMDK
+
+    // destroy function for garbage list, for value blobs and metadata, nodes use FreeNode
     static void DestroyNode(void *destroyContext, void *p) {
 #ifdef PMDK
-      auto oid_ptr = pmemobj_oid(p);
       TOID(char) ptr_cpy;
-      TOID_ASSIGN(ptr_cpy, oid_ptr);
+      TOID_ASSIGN(ptr_cpy, pmemobj_oid(p));
       POBJ_FREE(&ptr_cpy);
 #else
-#error "Non-PMDK not implemented"
+      free(p);
 #endif  // PMDK
     };
 
+    // destroy function for garbage list, for nodes, tree is the BzTree and word the node word
+    static void FreeNode(void *tree, void *word) {
+      reinterpret_cast<BzTree*>(tree)->free_node(NodeRef{(uint64_t)word});
+    }
+
+    // free callback for descriptors that install a blob, word is the blob word new_blob put in the descriptor
+    // pmwcas calls this if the blob never became visible, with the descriptor's slot for it as context
+    static void FreeBlob(void *context, void *word);
+
     // === helpers ===
 
+    // reads a word that pmwcas changes - while a pmwcas on it is in flight, it holds a pointer to the descriptor,
+    // and then that pmwcas is helped along first, so only this slow path pays for the descriptor pool's epoch
+    // whatever goes into a pmwcas as the expected value, or is followed to a node, has to be read like this
+    inline uint64_t read_word(const uint64_t *addr) {
+#ifdef PMEMEMU
+      NVRAM::Touch(sizeof(uint64_t), addr);
+#endif  // PMEMEMU
+      uint64_t word = __atomic_load_n(addr, __ATOMIC_ACQUIRE);
+      if (MwcTargetField<uint64_t>::IsCleanPtr(word)) return word;
+      return reinterpret_cast<MwcTargetField<uint64_t>*>(const_cast<uint64_t*>(addr))->GetValue(desc_pool->GetEpoch());
+    }
+    inline struct NodeHeaderStatusWord read_status_word(const struct Node *node) {
+      uint64_t word = read_word(reinterpret_cast<const uint64_t*>(&node->header.status_word));
+      return *reinterpret_cast<struct NodeHeaderStatusWord*>(&word);
+    }
+    inline struct NodeMetadata read_metadata(const struct Node *node, uint16_t i) {
+      uint64_t word = read_word(reinterpret_cast<const uint64_t*>(node->body) + i);
+      return *reinterpret_cast<struct NodeMetadata*>(&word);
+    }
+    // the child ptr of an inner node's record
+    inline NodeRef read_child(const struct Node *node, struct NodeMetadata md) {
+      return NodeRef{read_word(reinterpret_cast<const uint64_t*>(&node->body[md.offset + md.key_len]))};
+    }
+
+    // a pmwcas of a single word, which needs no descriptor, see MwcTargetField::CAS
+    inline bool cas_word(void *addr, uint64_t old_value, uint64_t new_value) {
+      return reinterpret_cast<MwcTargetField<uint64_t>*>(addr)->CAS(old_value, new_value);
+    }
+
     // get metadata struct from pop
     struct BzPMDKMetadata *get_metadata();
 
+    // allocates a new zeroed metadata struct, free it with DestroyNode
+    struct BzPMDKMetadata *new_metadata();
+
+    // adds swapping the current metadata md for md_new to a descriptor, for the SMOs that change the root
+    void desc_add_metadata(Descriptor *desc, struct BzPMDKMetadata *md, struct BzPMDKMetadata *md_new);
+
     // traverses the tree to find where a key would go, if not in the tree already
     // if perform_smo is on, will heuristically SMO nodes that need it and re-launch itself
     // required except if we're traversing to read, because otherwise, there may not be room to insert
     // either at the leaf or somewhere along the ancestor chain, not necessarily
     // expects the gc to be already protected
-    TOID(struct Node) find_leaf(const std::string key, bool perform_smo);
+    NodeRef find_leaf(const Slice &key, bool perform_smo);
 
     // like (and used by) find_leaf but it returns tuple(the leaf, the parent, id in parent) instead,
     // all the info needed for structural modifications, in order to be recursively called
     // if parent is nullopt then the node is the root
     // expects the gc to be already protected
-    std::tuple<TOID(struct Node), std::optional<TOID(struct Node)>, uint16_t>
-        find_leaf_parent(const std::string key, bool perform_smo);
+    // soft is for the background SMO workers, which SMO nodes at the soft thresholds instead
+    std::tuple<NodeRef, std::optional<NodeRef>, uint16_t>
+        find_leaf_parent(const Slice &key, bool perform_smo, bool soft = false);
 
     // implementation for find_leaf_parent and find_leaf, so that it can potentially fail
     // and also perform any SMOs needed during traversal
     // if repeatedly called on the same tree, will only fail up to O(height of tree) times
     // if it fails, then we need to acquire a new md, since root could have changed
     // expects the gc to be already protected
-    std::optional<std::tuple<TOID(struct Node), std::optional<TOID(struct Node)>, uint16_t>>
-        find_leaf_parent_smo(const std::string key, bool perform_smo, struct BzPMDKMetadata *md);
-
-    // helpers for getting and setting the pmdk offset of a TOID
-    // note: this is breaking into pmdk internals, but necessary because
-    // in the node we want to only store offset pointers
-    static inline void toid_set_offset(TOID(struct Node) *target, uint64_t off);
-    static inline uint64_t toid_get_offset(TOID(struct Node) target);
-
-    // helper for adding a TOID to a mwcas descriptor
-    // this is required in a few places because TOIDs are not actually one word, so they
-    // can't be atomically set in-place
-    // TOID(T) is a macro that ends up using ##T, so we can't template it like TOID(T) sadly
-    template<typename T> static void desc_add_toid(Descriptor *desc, T *loc, T a, T b);
+    std::optional<std::tuple<NodeRef, std::optional<NodeRef>, uint16_t>>
+        find_leaf_parent_smo(const Slice &key, bool perform_smo, struct BzPMDKMetadata *md, bool soft = false);
 
     // helper for swapping out a node pointer inside a node or inside the root
     // this is the only safe thing to do without freezing a node
+    // retired are the frozen nodes that new_node replaces, see retire_leaf
     // returns if it fails (only if the node freezes)
-    bool swap_node(std::optional<TOID(struct Node)> parent, uint64_t *node_off_ptr,
-        TOID(struct Node) old_node, TOID(struct Node) new_node);
+    bool swap_node(std::optional<NodeRef> parent, uint64_t *node_off_ptr,
+        NodeRef old_node, NodeRef new_node, std::initializer_list<NodeRef> retired = {});
+
+    // === node storage ===
+
+    // the node a node word refers to, wherever it is, see DRAM_NODE_BIT
+    // the tree only uses one pool, so this is the same as pmemobj_direct, without looking the pool up
+    // a node in nvram (any node in the EMU build) pays the emulated read delay for its header, see NVRAM::Touch
+    inline struct Node *node_ptr(NodeRef node) {
+#ifdef PMDK
+      if (!(node.word & DRAM_NODE_BIT)) {
+        struct Node *ptr = reinterpret_cast<struct Node*>((char*)pop + node.word);
+        NVRAM::Touch(sizeof(struct NodeHeader), ptr);
+        return ptr;
+      }
+#endif  // PMDK
+      struct Node *ptr = reinterpret_cast<struct Node*>(node.word & ~DRAM_NODE_BIT);
+#ifdef PMEMEMU
+      NVRAM::Touch(sizeof(struct NodeHeader), ptr);
+#endif  // PMEMEMU
+      return ptr;
+    }
+
+    static inline bool is_dram_node(NodeRef node) { return node.word & DRAM_NODE_BIT; }
+
+    // allocates a new zeroed node of this tree's size, see bztree_alloc.cc
+    // inner nodes are allocated in dram if dram_inner is set
+    // a node in the pool is only flushed, so the caller must drain before it's reachable (copy_in does)
+    NodeRef new_node(bool leaf);
+
+    // the two halves of new_node, for a node that is filled in before it counts as allocated (copy_in)
+    // until commit_node, a crash leaves its slot free, so neither rebuild nor recover_nodes can find it half written
+    // commit_node must only be called once the node is durable
+    NodeRef alloc_node(bool leaf);
+    void commit_node(NodeRef node);
+
+    // frees a node that was never visible, for ones that were push it to the garbage list with FreeNode
+    void free_node(NodeRef node);
+
+#ifdef PMDK
+    // slots per slab, the slot index in the node header is 15 bits
+    inline uint32_t slab_slot_count() { return std::min(std::max(BZTREE_SLAB_SIZE / node_size, 1u), 1u << 15); }
+
+    // where the slots start in a slab with this many slots, after the bitmap, on a cache line
+    static inline uint64_t slab_slots_offset(uint32_t slot_count) {
+      return (sizeof(struct NodeSlab) + (slot_count + 63) / 64 * sizeof(uint64_t) + 63) & ~63ull;
+    }
+
+    inline struct NodeSlab *slab_ptr(uint64_t slab) {
+      return reinterpret_cast<struct NodeSlab*>((char*)pop + slab);
+    }
+
+    // the node word of a slot
+    inline NodeRef slot_node(uint64_t slab, uint16_t slot) {
+      return NodeRef{slab + slab_slots_offset(slab_slot_count()) + (uint64_t)slot * node_size};
+    }
+
+    SlabPartition *slab_partition();
+
+    // allocates a new slab for this partition, and adds all of its slots to the free list
+    // expects the partition to be locked
+    void new_slab(SlabPartition *part);
+
+    // puts the free slots of the slabs in the pool back on the free lists, since those only live in dram
+    // and takes the node size from them, returns every node that is allocated (for rebuild and recover_nodes)
+    // not thread safe, it's only called by the constructor
+    std::vector<NodeRef> open_slabs();
+
+    // frees all the slabs, once no node is in use anymore
+    void destroy_slabs();
+#endif  // PMDK
+
+    // flush, drain and persist (both) what the tree writes outside of pmwcas
+    // the volatile build has nothing to make durable, so these do nothing there
+    inline void flush(const void *addr, size_t len) {
+#ifdef PMDK
+      pmemobj_flush(pop, addr, len);
+#else
+      (void)addr;
+      (void)len;
+#endif  // PMDK
+    }
+    inline void drain() {
+#ifdef PMDK
+      pmemobj_drain(pop);
+#endif  // PMDK
+    }
+    inline void persist(const void *addr, size_t len) {
+#ifdef PMDK
+      pmemobj_persist(pop, addr, len);
+#else
+      (void)addr;
+      (void)len;
+#endif  // PMDK
+    }
+
+    // if inner nodes are in dram, marks a frozen leaf as retired in the pmwcas that swaps in its replacement
+    // nothing persistent points to leaves then, so this is what makes replacing one durable
+    // does nothing for inner nodes, or if inner nodes are in the pool
+    void retire_leaf(Descriptor *desc, NodeRef node);
+
+    // replaces the inner levels of the tree with new ones built from all the leaves in the pool
+    // this is how a tree with inner nodes in dram is opened, since they were gone with the process
+    // leaves that were retired are freed, and so are leaves that an SMO created but didn't get to swap in
+    // not thread safe, it's only called by the constructor
+    void rebuild();
+
+    // builds the levels above a level of nodes, given as each node's largest key and its node word,
+    // packing budget bytes of records into each node - used by bulk_load and rebuild
+    // returns the root, and adds the new nodes to nodes and the new levels to height
+    NodeRef build_levels(std::vector<std::pair<std::string, uint64_t>> level, uint32_t budget,
+        uint64_t *height, std::vector<NodeRef> *nodes);
 
     // calculates the free space in a node
     uint32_t free_space(const struct NodeHeaderStatusWord *sw);
 
+    // size of the body of every node in this tree, which is where the metadata and records go
+    inline uint32_t body_size() { return node_size - sizeof(struct NodeHeader) - fingerprint_count(); }
+
+    // free space left in the left node of an append split, past the split threshold the node would be held to so
+    // that an out of order key or two fit, and merges are held to it too so that they don't undo an append split
+    inline uint32_t append_free_space() {
+      return (smo_workers ? smo_workers->soft_free_space : min_free_space) + body_size() / 16;
+    }
+
+    // === fingerprints ===
+    // records appended to a leaf since copy_in wrote it are unsorted, so every search would compare
+    // against each of their keys - instead, the first fingerprint_count() of them have a one byte hash
+    // of their key at the end of the node (like FPTree), and searches only compare keys whose
+    // fingerprint matches, 16 fingerprints at a time
+    // inner nodes are always sorted so they don't use theirs, but all nodes are the same size
+
+    // a multiple of 16, a 16th of a cache line per 64 bytes of node, capped at one cache line
+    inline uint32_t fingerprint_count() { return std::min(std::max(node_size / 64, 16u), 64u) & ~15u; }
+
+    // never 0, since that is what a slot holds before its insert writes it
+    static inline uint8_t fingerprint(const Slice &key) {
+      // fnv-1a, folded to a byte
+      uint32_t h = 2166136261u;
+      for (size_t i=0; i<key.size(); i++) h = (h ^ (uint8_t)key[i]) * 16777619u;
+      uint8_t fp = h ^ (h >> 8) ^ (h >> 16) ^ (h >> 24);
+      return fp ? fp : 1;
+    }
+
+    inline uint8_t *fingerprints(const struct Node *node) {
+      return (uint8_t*)&node->body[body_size()];
+    }
+
+    // sets the fingerprint of a record that was just reserved in a leaf, before it's made visible
+    // records past the fingerprinted part of the tail are left without one
+    // like write_record, this is only flushed
+    void set_fingerprint(struct Node *leaf, uint16_t record_index, const Slice &key);
+
+    // largest key that can be inserted, since every key may end up in an inner node next to an aligned child ptr
+    inline size_t max_key_size() {
+      return min_free_space - sizeof(struct NodeMetadata) - sizeof(uint64_t) - (sizeof(uint64_t) - 1);
+    }
+
+    // copies a record's key and inline value to where md says, into space reserved in a leaf
+    // this is only flushed and not drained, so that all the writes of an operation pay for a single
+    // fence - the caller must drain before making the record visible
+    void write_record(struct Node *leaf, struct NodeMetadata md, const Slice &key, const Slice &value);
+
+    // the key of a record
+    inline Slice record_key(const struct Node *node, struct NodeMetadata md) {
+#ifdef PMEMEMU
+      NVRAM::Touch(md.key_len, &node->body[md.offset]);
+#endif  // PMEMEMU
+      return Slice(&node->body[md.offset], md.key_len);
+    }
+
+    // === out-of-line values ===
+    // a value is stored out of line if its record wouldn't fit in min_free_space inline
+    // the 8 byte blob offset in the record is kept word aligned by insert and update, since it's
+    // installed by the same pmwcas that makes the record visible, so a blob is never leaked or
+    // visible before it's complete
+
+    inline bool value_out_of_line(size_t key_len, size_t value_len) {
+      return sizeof(struct NodeMetadata) + key_len + value_len > min_free_space;
+    }
+
+    // allocates and flushes a blob for this value, returns its blob word - the pool offset of the blob,
+    // or its address in the volatile build
+    // it's not drained, so the caller must drain before publishing it
+    uint64_t new_blob(const Slice &value);
+    // the same, but allocated straight into the new value of a descriptor entry added with kRecycleNewOnFailure,
+    // so the descriptor owns the blob until its pmwcas installs it: pmwcas frees it if that fails,
+    // and pmwcas recovery if the process crashes first
+    void new_blob(const Slice &value, Descriptor *desc, uint32_t entry);
+
+    // the blob an out-of-line record points to
+    struct Blob *record_blob(const struct Node *node, struct NodeMetadata md);
+
+    // the value of a record, wherever it is stored
+    Slice record_value(const struct Node *node, struct NodeMetadata md);
+
+    // === in-place updates ===
+    // an update whose value fits in the old value's place overwrites it instead of appending a new record
+    // the record's version is odd while it does, like a seqlock: readers copy the value and retry if the
+    // metadata changed meanwhile, and anything else that changes the record waits for it to be even again
+    // the version never wraps: once it's at the largest even version, the next update goes out of place and
+    // starts over at 0 at a new offset - offsets in a node only go down, so a record's metadata never repeats
+    // (an empty value can get the same offset again, but there is nothing in it to tear)
+    // the old value is kept in the UpdateLog meanwhile, see recover_updates
+
+    // waits until no in-place update is writing record i, and returns its metadata
+    struct NodeMetadata stable_metadata(const struct Node *node, uint16_t i);
+
+    // whether record i still has this metadata, so a value read with it was not torn
+    bool metadata_unchanged(const struct Node *node, uint16_t i, struct NodeMetadata md);
+
+    // takes an UpdateLog entry for an in-place update of record i of leaf, and copies its value in
+    // it's durable once this returns, the caller arms it by adding its metadata word to the pmwcas that makes
+    // the version odd (with 0 as the old value, and md as the new one)
+    // the value must fit an entry (see update_log_capacity), and in the volatile build this returns nullptr
+    struct UpdateLogEntry *log_update(NodeRef leaf, uint16_t i, struct NodeMetadata md);
+
+    // the largest value an UpdateLog entry holds, larger ones are updated out of place
+    inline uint32_t update_log_capacity() {
+#ifdef PMDK
+      return update_log->entry_size - sizeof(struct UpdateLogEntry);
+#else
+      return UINT32_MAX;
+#endif  // PMDK
+    }
+
+    // gives back the UpdateLog entry of an in-place update, once the version is even again (or it never went odd)
+    void unlog_update(struct UpdateLogEntry *entry);
+
+    // === node search ===
+    // records [0, sorted_count) are sorted by key and unique, since copy_in wrote them, so they are
+    // binary searched - anything after that was appended by insert and is scanned linearly
+    // note: erase leaves the offset of a deleted record alone, so keys in the sorted prefix are
+    // always readable, even if they are not visible anymore
+
+    // the unsorted tail is filtered by fingerprint first, see fingerprint_count
+    // finds the visible record with this key in a leaf, or nullopt if there is none
+    // if in_progress is given, it is set if an insert from this epoch is still reserving space
+    // in the unsorted tail, since that could be for the same key
+    std::optional<uint16_t> leaf_search(const struct Node *node, const Slice &key, bool *in_progress = nullptr);
+
+    // finds the index of the child an inner node routes this key to
+    // that is, the first separator that is >= key, or the last one if key is past all of them
+    // if after is set, it is the first separator that is > key instead, which is the child
+    // holding the smallest keys greater than key (used by scans to step to the next leaf)
+    // inner nodes are immutable and written by copy_in, so they are entirely sorted
+    uint16_t inner_search(const struct Node *node, const Slice &key, bool after = false);
+
+    // read-only traversal for scans, it never performs SMOs
+    // routes like inner_search, or always to the rightmost child if key is nullopt
+    // lower and upper are set to the separators bounding the leaf, nullopt if it is unbounded on that side
+    // keys in the leaf are in (lower, upper]
+    // expects the gc to be already protected
+    NodeRef find_leaf_bounds(const std::optional<std::string> &key, bool after,
+        std::optional<std::string> *lower, std::optional<std::string> *upper);
+
+    // === batches ===
+
+    // inserts a run of records from a multi_insert batch, starting at order[next], into leaf
+    // the run ends at the first record that is past upper, or doesn't fit in the leaf or the descriptor
+    // records that are in the leaf already, repeated in the batch or too large are skipped as failed
+    // returns how many records of order were consumed, 0 if the leaf is frozen or the record at next
+    // has to go through insert instead, then nothing in the run was inserted
+    // expects the gc to be already protected
+    size_t leaf_insert_run(struct Node *leaf, const std::optional<std::string> &upper,
+        const std::vector<std::pair<Slice, Slice>> &records, const std::vector<size_t> &order,
+        size_t next, std::vector<bool> *inserted);
+
+    // === crash recovery ===
+    // opening the pool runs pmwcas recovery first, which rolls every pmwcas that was in flight back or forward
+    // then the global epoch is bumped, so that space reserved by inserts that were in flight is told apart from
+    // inserts of this process - those reservations are never made visible, and are dropped like deleted
+    // records the next time their node is compacted, so nothing has to look at the whole tree
+    // the rest is in the SmoLog and the UpdateLog, see there
+
+    // takes a SmoLog entry for the nodes an SMO is about to freeze, it's durable once this returns
+    // there is nothing to log for a tree with inner nodes in dram (or in the volatile build), since rebuild
+    // already puts together a tree without frozen nodes, so this returns nullptr then
+    struct SmoLogEntry *log_smo(std::initializer_list<NodeRef> nodes);
+
+    // gives back the SmoLog entry of an SMO, once its nodes are replaced or unfrozen again
+    // nodes that are unfrozen again must be persisted before this
+    void unlog_smo(struct SmoLogEntry *entry);
+
+    // unfreezes the nodes of the SMOs that were in flight when the pool was closed, and empties the log
+    // only the nodes that are still in the tree matter, the rest were replaced and are garbage anyway
+    // not thread safe, it's only called by the constructor
+    void recover_smos();
+
+    // rolls back the in-place updates that were in flight when the pool was closed, and empties the log
+    // their value may be torn, and the version would stay odd forever, so it has the old value and metadata again
+    // not thread safe, it's only called by the constructor
+    void recover_updates();
+
+    // puts the slabs back together like open_slabs, and frees every node that isn't reachable from the root -
+    // nodes of SMOs that didn't get to swap them in, and replaced nodes that were still on the garbage list
+    // not thread safe, it's only called by the constructor, for a tree that keeps its inner nodes in the pool
+    void recover_nodes();
+
+    // whether a node has space reserved by inserts from before the pool was last opened, which were never
+    // made visible - that space is only reclaimed by compacting the node, so it shouldn't be split for it
+    bool has_stale_reservations(const struct Node *node);
+
+    // === background SMOs ===
+    // with workers running, writers only do the SMOs that can't wait (at the thresholds the tree was made
+    // with), and queue the nodes they pass that crossed the lower soft thresholds instead - a worker
+    // traverses to the node again with soft thresholds, and does its SMO (and any other on the way)
+    // merges are never needed, so with workers running writers leave all of them to the workers
+    // see bztree_smo_worker.cc
+
+    // a queued node, with a key that routes to it, since the node may be gone by the time a worker gets to it
+    // the sequence is for the queue, see SmoWorkers
+    struct SmoRequest {
+      std::atomic<uint64_t> sequence;
+      NodeRef node;
+      std::string key;
+    };
+
+    // the queue is a bounded lock-free multi producer multi consumer ring (Vyukov's), the workers only
+    // take the lock to sleep while it's empty
+    struct SmoWorkers {
+      SmoRequest requests[BZTREE_SMO_QUEUE_SIZE];
+      // the next positions to push to and to pop from
+      std::atomic<uint64_t> head;
+      std::atomic<uint64_t> tail;
+      // the queued nodes, each in the entry its node word hashes to, so that a node that every insert passes
+      // is queued once - a collision only means a node isn't queued, and the writers SMO it when they must
+      std::atomic<uint64_t> queued[BZTREE_SMO_QUEUE_SIZE];
+
+      std::vector<std::thread> threads;
+      std::mutex lock;
+      std::condition_variable wake;
+      std::atomic<uint32_t> sleeping;
+      bool stop;
+
+      uint32_t soft_free_space;
+      uint32_t soft_deleted_space;
+    };
+    // null while no workers are running
+    std::unique_ptr<SmoWorkers> smo_workers;
+
+    // queues a node for the workers, unless it's queued already or the queue is full
+    void queue_smo(const Slice &key, NodeRef node);
+
+    // takes the oldest request off the queue, returns false if it's empty
+    bool pop_smo(NodeRef *node, std::string *key);
+
+    // what each worker thread runs until the workers are stopped
+    void smo_worker();
+
     // === structural modifications (SMOs) ===
     // note: all of these invalidate the tree if they return true
     // so, you must unprotect before calling them, and the only safe thing to do after calling them
@@ -204,29 +880,59 @@ class BzTree {
     // all of these expect the gc to be already protected
 
 
-    // copy all the key value pairs into a vector of pairs and sort them
-    std::vector<std::pair<std::string, std::string>> copy_out(TOID(struct Node) node_oid);
-    // copy all the key value pairs back into a new node
-    // expects pairs to be sorted
-    TOID(struct Node) copy_in(std::vector<std::pair<std::string, std::string>> pairs);
+    // a record copied out of a node, by reference into the node, see bztree_smos.cc
+    // out-of-line values are referenced as their 8 byte blob offset, the blob itself stays where it is
+    struct RecordRef {
+      Slice key;
+      Slice value;
+      bool out_of_line;
+    };
+
+    // per-thread scratch space for SMOs, reused so that they don't allocate
+    // records is for the nodes being restructured, parent for their parent, and merge is used by copy_out
+    static thread_local std::vector<RecordRef> smo_records;
+    static thread_local std::vector<RecordRef> smo_parent;
+    static thread_local std::vector<RecordRef> smo_merge;
+
+    // a record of a node by reference
+    // the blob word of an out-of-line value, or the child ptr of an inner node, may still be finishing its pmwcas
+    // (see record_blob), reading it helps that along and leaves it clean in place, and nothing changes it after
+    // that in a frozen node
+    inline RecordRef record_ref(const struct Node *node, struct NodeMetadata md) {
+      if (md.out_of_line || !node->header.leaf) read_word(reinterpret_cast<const uint64_t*>(&node->body[md.offset + md.key_len]));
+      return RecordRef{record_key(node, md), Slice(&node->body[md.offset + md.key_len], md.total_len - md.key_len),
+          md.out_of_line};
+    }
+
+    // appends all the visible records of a node to out, sorted
+    // only the unsorted tail is sorted, and then merged with the sorted prefix
+    void copy_out(NodeRef node_oid, std::vector<RecordRef> *out);
+    // copy the records into a new leaf or inner node
+    // expects records to be sorted
+    NodeRef copy_in(const RecordRef *records, size_t count, bool leaf);
 
     // compacts node, making deleted key space available and (todo) sorting the keys
     // returns allocated new node, does not delete old node
     // new node must be spliced into parent
-    TOID(struct Node) node_compact(TOID(struct Node) node);
+    NodeRef node_compact(NodeRef node);
 
     // splits node once
+    // index is where node is in parent, as found by the traversal, the new parent is the old one with the
+    // two new children spliced in at index
     // returns allocated new parent and the two children (for deleting on failure), does not delete old nodes
     // new parent must be spliced into grandparent of the split nodes
     // if parent is nullopt, then a new parent is created (split of root)
-    std::pair<TOID(struct Node), std::pair<TOID(struct Node), TOID(struct Node)>>
-        node_split(std::optional<TOID(struct Node)> parent, TOID(struct Node) node);
+    // key is the one the traversal was for, and rightmost whether node is the rightmost of its level, if both say
+    // that node takes appends the left node is filled up to append_free_space instead of splitting in half
+    std::pair<NodeRef, std::pair<NodeRef, NodeRef>>
+        node_split(std::optional<NodeRef> parent, NodeRef node, uint16_t index, const Slice &key, bool rightmost);
 
     // merges sibling nodes
-    // takes the parent node and two children to be merged
+    // takes the parent node and two children to be merged, merge_left is at left_index in parent
+    // and merge_right right after it
     // returns the two allocated nodes, parent and new child, does not delete old nodes
     // new parent must be spliced into grandparent of the merged nodes
-    std::pair<TOID(struct Node), TOID(struct Node)> node_merge(TOID(struct Node) parent,
-        TOID(struct Node) merge_left, TOID(struct Node) merge_right);
+    std::pair<NodeRef, NodeRef> node_merge(NodeRef parent,
+        NodeRef merge_left, NodeRef merge_right, uint16_t left_index);
 };
 }  // namespace pmwcas
@@ -0,0 +1,167 @@
+#include "bztree.h"
+#include "include/pmwcas.h"
+
+namespace pmwcas {
+
+// nodes in the pool come from slabs of fixed size slots, which are handed out from per-thread free lists
+// - a slot is allocated by setting its bit in the slab's bitmap, and freed by clearing it, only the bitmap
+//   is persistent, the free lists are made again from it when the pool is opened (see open_slabs)
+// - the bit is only set once the node in the slot is durable, so every allocated slot has a whole node
+// - nodes that were visible are freed through the garbage list (FreeNode), so a slot is only reused
+//   once no thread can still be reading the node in it
+// - a freed slot goes to the free list of the thread that frees it, which is not necessarily the one
+//   it came from, so slabs are shared by threads over time, and the bitmap words are changed atomically
+// - slabs are only given back to the pool by destroy
+// nodes in dram (inner nodes with dram_inner, and every node in the volatile build) are plain allocations
+
+#ifdef PMDK
+thread_local BzTree *BzTree::slab_tree = nullptr;
+thread_local BzTree::SlabPartition *BzTree::slab_part = nullptr;
+#endif  // PMDK
+
+NodeRef BzTree::new_node(bool leaf) {
+  NodeRef node_oid = alloc_node(leaf);
+  if (!is_dram_node(node_oid)) {
+    drain();
+    commit_node(node_oid);
+  }
+  return node_oid;
+}
+
+NodeRef BzTree::alloc_node(bool leaf) {
+#ifdef PMDK
+  if (leaf || !dram_inner) {
+    SlabPartition *part = slab_partition();
+    FreeSlot free_slot;
+    {
+      std::lock_guard<std::mutex> guard(part->lock);
+      if (part->free_slots.empty()) new_slab(part);
+      free_slot = part->free_slots.back();
+      part->free_slots.pop_back();
+    }
+    NodeRef node_oid = slot_node(free_slot.slab, free_slot.slot);
+    struct Node *node = node_ptr(node_oid);
+
+    // slots of a new slab are zeroed already, but a slot that was freed still has its old node
+    bool reused = node->header.node_size != 0;
+    if (reused) memset(node, 0, node_size);
+    node->header.node_size = node_size;
+    node->header.slot = free_slot.slot;
+    node->header.leaf = leaf;
+    flush(node, reused ? node_size : sizeof(struct NodeHeader));
+    return node_oid;
+  }
+#endif  // PMDK
+
+  void *node;
+  assert(posix_memalign(&node, 64, node_size) == 0);
+  memset(node, 0, node_size);
+  NodeRef node_oid{(uint64_t)node | DRAM_NODE_BIT};
+  node_ptr(node_oid)->header.node_size = node_size;
+  node_ptr(node_oid)->header.leaf = leaf;
+  return node_oid;
+}
+
+void BzTree::commit_node(NodeRef node) {
+  if (is_dram_node(node)) return;
+#ifdef PMDK
+  uint16_t slot = node_ptr(node)->header.slot;
+  uint64_t slab = node.word - (uint64_t)slot * node_size - slab_slots_offset(slab_slot_count());
+
+  // only flushed, the caller drains before the node is reachable
+  uint64_t *bitmap_word = &slab_ptr(slab)->bitmap[slot / 64];
+  __atomic_fetch_or(bitmap_word, 1ull << (slot % 64), __ATOMIC_SEQ_CST);
+  flush(bitmap_word, sizeof(uint64_t));
+#endif  // PMDK
+}
+
+void BzTree::free_node(NodeRef node) {
+  if (is_dram_node(node)) {
+    free(node_ptr(node));
+    return;
+  }
+#ifdef PMDK
+  uint16_t slot = node_ptr(node)->header.slot;
+  uint64_t slab = node.word - (uint64_t)slot * node_size - slab_slots_offset(slab_slot_count());
+  assert(slab_ptr(slab)->node_size == node_size);
+
+  // only flushed, a crash before this thread drains again leaves the slot allocated, like a node
+  // that an SMO allocated and didn't get to swap in
+  uint64_t *bitmap_word = &slab_ptr(slab)->bitmap[slot / 64];
+  assert(*bitmap_word & (1ull << (slot % 64)));
+  __atomic_fetch_and(bitmap_word, ~(1ull << (slot % 64)), __ATOMIC_SEQ_CST);
+  flush(bitmap_word, sizeof(uint64_t));
+
+  SlabPartition *part = slab_partition();
+  std::lock_guard<std::mutex> guard(part->lock);
+  part->free_slots.push_back({slab, slot});
+#endif  // PMDK
+}
+
+#ifdef PMDK
+BzTree::SlabPartition *BzTree::slab_partition() {
+  if (slab_tree != this) {
+    // registered once per thread, ClearRegistry resets them when the tree goes away
+    if (slab_tree == nullptr) {
+      Thread::RegisterTls((uint64_t*)&slab_tree, (uint64_t)nullptr);
+      Thread::RegisterTls((uint64_t*)&slab_part, (uint64_t)nullptr);
+    }
+    slab_tree = this;
+    slab_part = &slab_partitions[next_slab_partition.fetch_add(1) % BZTREE_SLAB_PARTITIONS];
+  }
+  return slab_part;
+}
+
+void BzTree::new_slab(SlabPartition *part) {
+  uint32_t slot_count = slab_slot_count();
+  TOID(struct NodeSlab) slab_oid;
+  POBJ_ZALLOC(pop, &slab_oid, struct NodeSlab, slab_slots_offset(slot_count) + (uint64_t)slot_count * node_size);
+  struct NodeSlab *slab = D_RW(slab_oid);
+  slab->node_size = node_size;
+  slab->slot_count = slot_count;
+  persist(slab, sizeof(struct NodeSlab));
+
+  // backwards, so that the slots are handed out in address order
+  for (uint32_t slot = slot_count; slot-- > 0;) {
+    part->free_slots.push_back({slab_oid.oid.off, (uint16_t)slot});
+  }
+}
+
+std::vector<NodeRef> BzTree::open_slabs() {
+  std::vector<NodeRef> nodes;
+  uint32_t i = 0;
+  TOID(struct NodeSlab) slab_oid;
+  POBJ_FOREACH_TYPE(pop, slab_oid) {
+    struct NodeSlab *slab = D_RW(slab_oid);
+    // every slab of a tree has its node size
+    node_size = slab->node_size;
+    assert(slab->slot_count == slab_slot_count());
+
+    // the free slots are spread over the partitions a slab at a time
+    SlabPartition *part = &slab_partitions[i++ % BZTREE_SLAB_PARTITIONS];
+    for (uint32_t slot = slab->slot_count; slot-- > 0;) {
+      uint64_t *bitmap_word = &slab->bitmap[slot / 64];
+      if (*bitmap_word & (1ull << (slot % 64))) {
+        nodes.push_back(slot_node(slab_oid.oid.off, slot));
+        continue;
+      }
+      part->free_slots.push_back({slab_oid.oid.off, (uint16_t)slot});
+    }
+  }
+  return nodes;
+}
+
+void BzTree::destroy_slabs() {
+  // collected first, since freeing them while iterating would skip some
+  std::vector<uint64_t> slabs;
+  TOID(struct NodeSlab) slab_oid;
+  POBJ_FOREACH_TYPE(pop, slab_oid) slabs.push_back(slab_oid.oid.off);
+  for (uint64_t slab : slabs) {
+    TOID_ASSIGN(slab_oid, pmemobj_oid(slab_ptr(slab)));
+    POBJ_FREE(&slab_oid);
+  }
+  for (uint32_t i = 0; i < BZTREE_SLAB_PARTITIONS; i++) slab_partitions[i].free_slots.clear();
+}
+#endif  // PMDK
+
+}  // namespace pmwcas
@@ -0,0 +1,196 @@
+#include <numeric>
+#include "bztree.h"
+#include "include/pmwcas.h"
+
+namespace pmwcas {
+
+// batches are sorted first, so the keys that belong in one leaf are next to each other
+// a leaf holds the keys in (lower, upper], so starting from the first key of a run, the run goes on
+// until a key is past upper - this is one traversal and one epoch protection per leaf instead of per key
+
+std::vector<std::optional<std::string>> BzTree::multi_get(const std::vector<Slice> &keys) {
+  std::vector<std::optional<std::string>> values(keys.size());
+  std::vector<size_t> order(keys.size());
+  std::iota(order.begin(), order.end(), 0);
+  std::sort(order.begin(), order.end(), [&](size_t a, size_t b) { return keys[a].compare(keys[b]) < 0; });
+
+  assert(epoch.Protect().ok());
+
+  size_t next = 0;
+  while (next < order.size()) {
+    const Slice &first = keys[order[next]];
+    std::optional<std::string> lower, upper;
+    NodeRef leaf_oid = find_leaf_bounds(std::string(first.data(), first.size()), false, &lower, &upper);
+    const struct Node *leaf = node_ptr(leaf_oid);
+
+    do {
+      const Slice &key = keys[order[next]];
+      auto found = leaf_search(leaf, key);
+      if (found.has_value()) {
+        // retry the copy if the value was overwritten in place meanwhile
+        struct NodeMetadata md;
+        do {
+          md = stable_metadata(leaf, *found);
+          Slice value = record_value(leaf, md);
+          values[order[next]] = std::string(value.data(), value.size());
+        } while (!metadata_unchanged(leaf, *found, md));
+      }
+      next++;
+    } while (next < order.size() && (!upper.has_value() || keys[order[next]].compare(*upper) <= 0));
+  }
+
+  assert(epoch.Unprotect().ok());
+  return values;
+}
+
+std::vector<bool> BzTree::multi_insert(const std::vector<std::pair<Slice, Slice>> &records) {
+  std::vector<bool> inserted(records.size(), false);
+  // stable, so the first of repeated keys is the one that gets inserted
+  std::vector<size_t> order(records.size());
+  std::iota(order.begin(), order.end(), 0);
+  std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+    return records[a].first.compare(records[b].first) < 0;
+  });
+
+  size_t next = 0;
+  while (next < order.size()) {
+    const Slice &first = records[order[next]].first;
+
+    // no SMOs on the way down, a full leaf is handed to insert below instead, which does them
+    assert(epoch.Protect().ok());
+    std::optional<std::string> lower, upper;
+    NodeRef leaf_oid = find_leaf_bounds(std::string(first.data(), first.size()), false, &lower, &upper);
+    size_t consumed;
+    while (next < order.size() &&
+        (consumed = leaf_insert_run(node_ptr(leaf_oid), upper, records, order, next, &inserted)) > 0) {
+      next += consumed;
+    }
+    assert(epoch.Unprotect().ok());
+
+    // the leaf is full or frozen, so this record goes through the regular path
+    // that also makes room in the leaf for the runs after it
+    if (next < order.size()) {
+      const auto &record = records[order[next]];
+      inserted[order[next]] = (next == 0 || !(record.first == records[order[next - 1]].first)) &&
+          insert(record.first, record.second);
+      next++;
+    }
+  }
+  return inserted;
+}
+
+size_t BzTree::leaf_insert_run(struct Node *leaf, const std::optional<std::string> &upper,
+    const std::vector<std::pair<Slice, Slice>> &records, const std::vector<size_t> &order,
+    size_t next, std::vector<bool> *inserted) {
+  struct NodeMetadata *nmd = reinterpret_cast<struct NodeMetadata*>(leaf->body);
+
+  // a record in the run takes one descriptor word for its metadata, and one more for its blob,
+  // and the status word is in both pmwcas
+  struct Run {
+    size_t index;
+    bool out_of_line;
+    size_t record_len;
+    uint32_t offset;
+  };
+  std::vector<Run> run;
+  uint32_t words = 1;
+
+  // pick the run, and reserve space for it, which is retried if another insert gets in first
+  size_t consumed;
+  struct NodeHeaderStatusWord sw_old, sw;
+  while (1) {
+    run.clear();
+    words = 1;
+    consumed = 0;
+    sw_old = read_status_word(leaf);
+    sw = sw_old;
+    if (sw.frozen) return 0;
+
+    for (size_t j = next; j < order.size(); j++) {
+      const auto &record = records[order[j]];
+      const Slice &key = record.first;
+      if (upper.has_value() && key.compare(*upper) > 0) break;
+
+      // these fail, same as insert would
+      // (a repeated key may not be visible yet if its first copy is in this run)
+      if (key.size() > max_key_size() || (j > 0 && key == records[order[j - 1]].first) ||
+          leaf_search(leaf, key).has_value()) {
+        (*inserted)[order[j]] = false;
+        consumed++;
+        continue;
+      }
+
+      // padding and offsets like in insert, but stacked on the records before it in the run
+      bool out_of_line = value_out_of_line(key.size(), record.second.size());
+      size_t record_len = key.size() + (out_of_line ? sizeof(uint64_t) : record.second.size());
+      uint32_t padding = out_of_line ? (sizeof(uint64_t) - sw.block_size % sizeof(uint64_t)) % sizeof(uint64_t) : 0;
+      if (words + 1 + out_of_line > DESC_CAP) break;
+      if (sw.block_size + record_len + padding >
+          body_size() - (sw.record_count + 1) * sizeof(struct NodeMetadata)) break;
+
+      sw.block_size += record_len + padding;
+      sw.record_count += 1;
+      words += 1 + out_of_line;
+      run.push_back({order[j], out_of_line, record_len, body_size() - sw.block_size});
+      consumed++;
+    }
+    if (run.empty()) {
+      // nothing to publish, but what was skipped is done
+      // if the first record didn't fit, it goes to insert
+      return consumed;
+    }
+
+    // one pmwcas reserves the space and the metadata of the whole run
+    auto *desc = desc_pool->AllocateDescriptor();
+    assert(desc);
+    desc->AddEntry((uint64_t*)&leaf->header.status_word, *(uint64_t*)&sw_old, *(uint64_t*)&sw);
+    for (size_t r = 0; r < run.size(); r++) {
+      struct NodeMetadata md_old = read_metadata(leaf, sw_old.record_count + r);
+      struct NodeMetadata md = md_old;
+      assert(md.visible == 0);
+      md.offset = (global_epoch | GLOBAL_EPOCH_OFFSET_BIT);
+      desc->AddEntry((uint64_t*)&nmd[sw_old.record_count + r], *(uint64_t*)&md_old, *(uint64_t*)&md);
+    }
+    if (desc->MwCAS()) break;
+    // collision with another allocation, pick the run again since it may have inserted one of our keys
+  }
+
+  // copy the records in, then publish them all together, this also checks the frozen bit
+  sw = read_status_word(leaf);
+  if (sw.frozen) return 0;
+
+  auto *desc = desc_pool->AllocateDescriptor(nullptr, BzTree::FreeBlob);
+  assert(desc);
+  desc->AddEntry((uint64_t*)&leaf->header.status_word, *(uint64_t*)&sw, *(uint64_t*)&sw);
+  for (size_t r = 0; r < run.size(); r++) {
+    const auto &record = records[run[r].index];
+    uint16_t record_index = sw_old.record_count + r;
+    struct NodeMetadata md_old = read_metadata(leaf, record_index);
+    struct NodeMetadata md = md_old;
+    md.offset = run[r].offset;
+    md.out_of_line = run[r].out_of_line;
+    md.key_len = record.first.size();
+    md.total_len = run[r].record_len;
+    md.visible = 1;
+    write_record(leaf, md, record.first, record.second);
+    set_fingerprint(leaf, record_index, record.first);
+
+    desc->AddEntry((uint64_t*)&nmd[record_index], *(uint64_t*)&md_old, *(uint64_t*)&md);
+    if (md.out_of_line) {
+      uint32_t blob_entry = desc->ReserveAndAddEntry((uint64_t*)&leaf->body[md.offset + md.key_len], 0,
+          Descriptor::kRecycleNewOnFailure);
+      new_blob(record.second, desc, blob_entry);
+    }
+  }
+  // one drain for the whole run
+  drain();
+  if (!desc->MwCAS()) {
+    // frozen in the meantime, the reserved space is lost like in insert, and the run is retried
+    return 0;
+  }
+
+  for (const auto &r : run) (*inserted)[r.index] = true;
+  return consumed;
+}
+
+}  // namespace pmwcas
@@ -0,0 +1,168 @@
+#include "bztree.h"
+#include "include/pmwcas.h"
+
+namespace pmwcas {
+
+// the leaves are packed straight from the input with copy_in, and every finished node hands its largest
+// key and its node word up to the level above, which is exactly the record its parent needs
+// (see node_split) - so each level is built from the one below it until a level is a single node, the root
+// none of the nodes are reachable until the root is swapped in, so they need no pmwcas or epochs
+
+bool BzTree::bulk_load(const std::function<bool(Slice *key, Slice *value)> &next, double fill_factor) {
+  assert(fill_factor > 0 && fill_factor <= 1);
+  uint32_t budget = fill_factor * body_size();
+
+  // cheap check before doing any work, it's checked again when swapping the root in
+  assert(epoch.Protect().ok());
+  smo_records.clear();
+  if (get_metadata()->height == 1) copy_out(get_metadata()->root_node, &smo_records);
+  bool empty = get_metadata()->height == 1 && smo_records.empty();
+  assert(epoch.Unprotect().ok());
+  if (!empty) return false;
+
+  // everything allocated, so it can be freed if the load fails
+  std::vector<NodeRef> nodes;
+  std::vector<uint64_t> blobs;
+  auto free_all = [&]() {
+    for (auto &node : nodes) free_node(node);
+    for (uint64_t blob : blobs) FreeBlob(nullptr, (void*)blob);
+  };
+
+  // the input has to be copied, since next() may reuse what its slices point to
+  struct Record {
+    std::string key;
+    std::string value;
+    bool out_of_line;
+  };
+
+  // turns records into a leaf, and adds its record to the level above
+  std::vector<std::pair<std::string, uint64_t>> level;
+  auto finish_leaf = [&](std::vector<Record> *records) {
+    smo_records.clear();
+    for (auto &r : *records) smo_records.push_back(RecordRef{r.key, r.value, r.out_of_line});
+    NodeRef node = copy_in(smo_records.data(), smo_records.size(), true);
+    nodes.push_back(node);
+    level.emplace_back(records->back().key, node.word);
+    records->clear();
+  };
+
+  // leaves
+  std::vector<Record> records;
+  uint32_t used = 0;
+  Slice key, value;
+  while (next(&key, &value)) {
+    const std::string *last = !records.empty() ? &records.back().key : (!level.empty() ? &level.back().first : nullptr);
+    if (key.size() > max_key_size() || (last != nullptr && key.compare(*last) <= 0)) {
+      free_all();
+      return false;
+    }
+
+    // out of line values are the same as in insert, but they don't need aligning since they are never swapped
+    // the blob is only flushed, the drain in copy_in for its leaf covers it
+    Record record{std::string(key.data(), key.size()), "", value_out_of_line(key.size(), value.size())};
+    if (record.out_of_line) {
+      uint64_t blob = new_blob(value);
+      blobs.push_back(blob);
+      record.value = std::string((char*)&blob, sizeof(blob));
+    } else {
+      record.value = std::string(value.data(), value.size());
+    }
+
+    uint32_t size = sizeof(struct NodeMetadata) + record.key.size() + record.value.size();
+    if (!records.empty() && used + size > budget) {
+      finish_leaf(&records);
+      used = 0;
+    }
+    records.push_back(std::move(record));
+    used += size;
+  }
+  if (!records.empty() || level.empty()) {
+    if (records.empty()) {
+      // no input at all, so just a new empty root
+      NodeRef node = new_node(true);
+      drain();
+      nodes.push_back(node);
+      level.emplace_back("", node.word);
+    } else {
+      finish_leaf(&records);
+    }
+  }
+
+  uint64_t height = 1;
+  NodeRef root = build_levels(std::move(level), budget, &height, &nodes);
+
+  struct BzPMDKMetadata *md_new = new_metadata();
+  md_new->root_node = root;
+  md_new->height = height;
+
+  // swap the root in, freezing the old one in the same pmwcas so it's still the same empty root
+  assert(epoch.Protect().ok());
+  struct BzPMDKMetadata *md = get_metadata();
+  md_new->global_epoch = md->global_epoch;
+
+  struct NodeHeaderStatusWord *root_sw = &node_ptr(md->root_node)->header.status_word;
+  struct NodeHeaderStatusWord sw_old = read_status_word(node_ptr(md->root_node)), sw = sw_old;
+  sw.frozen = 1;
+  // the same as retire_leaf, but in the same word
+  if (dram_inner) sw.control |= NODE_RETIRED;
+  bool swapped = false;
+  smo_records.clear();
+  if (md->height == 1) copy_out(md->root_node, &smo_records);
+  if (md->height == 1 && !sw_old.frozen && smo_records.empty()) {
+    auto *desc = desc_pool->AllocateDescriptor();
+    assert(desc);
+    desc->AddEntry((uint64_t*)root_sw, *(uint64_t*)&sw_old, *(uint64_t*)&sw);
+    desc_add_metadata(desc, md, md_new);
+    swapped = desc->MwCAS();
+  }
+
+  if (swapped) {
+    assert(garbage.Push(md, BzTree::DestroyNode, nullptr).ok());
+    assert(garbage.Push((void*)md->root_node.word, BzTree::FreeNode, this).ok());
+  } else {
+    // something got into the tree while loading
+    DestroyNode(nullptr, md_new);
+    free_all();
+  }
+  assert(epoch.Unprotect().ok());
+  return swapped;
+}
+
+NodeRef BzTree::build_levels(std::vector<std::pair<std::string, uint64_t>> level, uint32_t budget,
+    uint64_t *height, std::vector<NodeRef> *nodes) {
+  assert(!level.empty());
+  NodeRef root{level.back().second};
+
+  // the child ptrs are referenced by the records, so they're kept where they are until the level is done
+  std::vector<RecordRef> records;
+  std::vector<std::pair<std::string, uint64_t>> children;
+  auto finish_node = [&]() {
+    root = copy_in(records.data(), records.size(), false);
+    nodes->push_back(root);
+    level.emplace_back(std::string(records.back().key.data(), records.back().key.size()), root.word);
+    records.clear();
+  };
+
+  // one level at a time, until there's a single node left
+  while (level.size() > 1) {
+    std::swap(children, level);
+    level.clear();
+    uint32_t used = 0;
+    for (auto &child : children) {
+      // key, child ptr and up to a word of padding to align it, see copy_in
+      uint32_t size = sizeof(struct NodeMetadata) + child.first.size() + 2 * sizeof(uint64_t) - 1;
+      // an inner node should route somewhere, so it gets at least two children if they fit at all
+      if (!records.empty() && used + size > budget && (records.size() > 1 || used + size > body_size())) {
+        finish_node();
+        used = 0;
+      }
+      records.push_back(RecordRef{child.first, Slice((char*)&child.second, sizeof(child.second)), false});
+      used += size;
+    }
+    finish_node();
+    (*height)++;
+  }
+  return root;
+}
+
+}  // namespace pmwcas
@@ -3,10 +3,12 @@
 namespace pmwcas {
 
 void BzTree::DEBUG_print_node(const struct Node* node) {
-  printf("=== node %p / %lx ===\n", node, pmemobj_oid(node).off);
+  printf("=== node %p ===\n", node);
   if (!node) return;
   printf("node_size:    %d\n", node->header.node_size);
   printf("sorted_count: %d\n", node->header.sorted_count);
+  printf("slot:         %d\n", node->header.slot);
+  printf("leaf:         %d\n", node->header.leaf);
   printf("-\n");
   printf("control:      %d\n", node->header.status_word.control);
   printf("frozen:       %d\n", node->header.status_word.frozen);
@@ -15,8 +17,9 @@ void BzTree::DEBUG_print_node(const struct Node* node) {
   printf("delete_size:  %d\n", node->header.status_word.delete_size);
   printf("-\n");
   printf("data block:\n");
-  assert(sizeof(node->body) % 16 == 0);
-  for (size_t i=0; i<sizeof(node->body); i+=16) {
+  size_t body_size = node->header.node_size - sizeof(node->header);
+  assert(body_size % 16 == 0);
+  for (size_t i=0; i<body_size; i+=16) {
     for (size_t j=0; j<16; j++) printf("%02x ", (unsigned char)node->body[i+j]);
     printf("| ");
     for (size_t j=0; j<16; j++) {
@@ -27,8 +30,8 @@ void BzTree::DEBUG_print_node(const struct Node* node) {
   }
 }
 
-void BzTree::DEBUG_print_tree(TOID(struct Node) node_oid /*= TOID_NULL(struct Node)*/, int h /*= 0*/, int height /*= 0*/) {
-  if (TOID_IS_NULL(node_oid)) {
+void BzTree::DEBUG_print_tree(NodeRef node_oid /*= NodeRef{}*/, int h /*= 0*/, int height /*= 0*/) {
+  if (!node_oid.word) {
     auto *md = get_metadata();
 
     printf("=== TREE ===\n");
@@ -40,53 +43,51 @@ void BzTree::DEBUG_print_tree(TOID(struct Node) node_oid /*= TOID_NULL(struct No
     return;
   }
 
-  const struct Node *node = D_RO(node_oid);
+  const struct Node *node = node_ptr(node_oid);
 
-  printf("%*s%s node %p / %lx {\n", h*2-2, "", h == height ? "leaf" : "inner", node, pmemobj_oid(node).off);
+  printf("%*s%s node %p / %lx {\n", h*2-2, "", h == height ? "leaf" : "inner", node, node_oid.word);
 
   const struct NodeHeader *header = &node->header;
   const struct NodeMetadata *nmd = reinterpret_cast<const struct NodeMetadata*>(header + 1);
 
   for (size_t i=0; i<header->status_word.record_count; i++) {
     if (!nmd[i].visible) {
-      printf("%*skey=%s (deleted)\n", h*2, "", &node->body[nmd[i].offset]);
+      printf("%*skey=%.*s (deleted)\n", h*2, "", nmd[i].key_len, &node->body[nmd[i].offset]);
     } else if (h != height) {
       // inner node
-      printf("%*skey=%s\n", h*2, "", &node->body[nmd[i].offset]);
+      printf("%*skey=%.*s\n", h*2, "", nmd[i].key_len, &node->body[nmd[i].offset]);
 
-      // warning: here we are reaching into TOID internals to get and set offset
-      TOID(struct Node) child;
-      child.oid.pool_uuid_lo = node_oid.oid.pool_uuid_lo;
-      child.oid.off = *(uint64_t*)&node->body[nmd[i].offset + nmd[i].key_len];
-      if (TOID_IS_NULL(child)) printf("%*s(null)\n", h*2, "");
+      NodeRef child{*(uint64_t*)&node->body[nmd[i].offset + nmd[i].key_len]};
+      if (!child.word) printf("%*s(null)\n", h*2, "");
       else DEBUG_print_tree(child, h+1, height);
       // extra newline to separate out key value sections
     } else {
       // child node
-      printf("%*skey=%s value=%s\n", h*2, "",
-        &node->body[nmd[i].offset], &node->body[nmd[i].offset + nmd[i].key_len]);
+      Slice value = record_value(node, nmd[i]);
+      printf("%*skey=%.*s value=%.*s%s\n", h*2, "", nmd[i].key_len, &node->body[nmd[i].offset],
+        (int)value.size(), value.data(), nmd[i].out_of_line ? " (blob)" : "");
     }
   }
   printf("%*s}\n", h*2-2, "");
 }
 
-void BzTree::DEBUG_verify_sorted(TOID(struct Node) node_oid) {
-  const struct Node *node = D_RO(node_oid);
+void BzTree::DEBUG_verify_sorted(NodeRef node_oid) {
+  const struct Node *node = node_ptr(node_oid);
   const struct NodeMetadata *nmd = reinterpret_cast<const struct NodeMetadata*>(&node->body);
 
-  const char *last = &node->body[nmd[0].offset];
-  printf("=-= DEBUG_verify_sorted\n0. %s\n", last);
+  Slice last = record_key(node, nmd[0]);
+  printf("=-= DEBUG_verify_sorted\n0. %.*s\n", (int)last.size(), last.data());
   bool sorted = true;
   for (size_t i=1; i<node->header.status_word.record_count; i++) {
     if (!nmd[i].visible) continue;
-    const char *curr = &node->body[nmd[i].offset];
-    printf("%ld. %s\n", i, curr);
-    if (strcmp(last, curr) >= 0) sorted = false;
+    Slice curr = record_key(node, nmd[i]);
+    printf("%ld. %.*s\n", i, (int)curr.size(), curr.data());
+    if (last.compare(curr) >= 0) sorted = false;
     last = curr;
   }
   if (!sorted) {
     DEBUG_print_tree();
-    DEBUG_print_node(D_RO(node_oid));
+    DEBUG_print_node(node_ptr(node_oid));
   }
   assert(sorted);
 }
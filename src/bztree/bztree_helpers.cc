@@ -1,57 +1,79 @@
+#include <emmintrin.h>
 #include "bztree.h"
 #include "include/pmwcas.h"
 
 namespace pmwcas {
 
 struct BzPMDKMetadata *BzTree::get_metadata() {
-  return D_RW(D_RW(POBJ_ROOT(pop, struct BzPMDKRootObj))->metadata);
+#ifdef PMDK
+  // only the offset is swapped, see desc_add_metadata
+  uint64_t offset = read_word(&D_RW(POBJ_ROOT(pop, struct BzPMDKRootObj))->metadata.oid.off);
+  return offset ? reinterpret_cast<struct BzPMDKMetadata*>((char*)pop + offset) : nullptr;
+#else
+  return reinterpret_cast<struct BzPMDKMetadata*>(read_word(&metadata_word));
+#endif  // PMDK
 }
 
-template<typename T> void BzTree::desc_add_toid(Descriptor *desc, T *loc, T a, T b) {
-  static_assert(sizeof(T) == 16);
-  // todo(hack): we assume the pool is always the same, so we don't actually set it
+struct BzPMDKMetadata *BzTree::new_metadata() {
+#ifdef PMDK
+  TOID(struct BzPMDKMetadata) md_oid;
+  POBJ_ZNEW(pop, &md_oid, struct BzPMDKMetadata);
+  return D_RW(md_oid);
+#else
+  return reinterpret_cast<struct BzPMDKMetadata*>(calloc(1, sizeof(struct BzPMDKMetadata)));
+#endif  // PMDK
+}
+
+void BzTree::desc_add_metadata(Descriptor *desc, struct BzPMDKMetadata *md, struct BzPMDKMetadata *md_new) {
+#ifdef PMDK
+  // todo(hack): we assume the pool is always the same, so we only swap the offset of the TOID
   // this is because pool id is not aligned and therefore does not have three free bits for pmwcas
-  // desc->AddEntry((uint64_t*)loc, *(uint64_t*)&a, *(uint64_t*)&b);
-  desc->AddEntry(((uint64_t*)loc)+1, *(((uint64_t*)&a)+1), *(((uint64_t*)&b)+1));
+  struct BzPMDKRootObj *rootobj = D_RW(POBJ_ROOT(pop, struct BzPMDKRootObj));
+  desc->AddEntry(&rootobj->metadata.oid.off, pmemobj_oid(md).off, pmemobj_oid(md_new).off);
+#else
+  desc->AddEntry(&metadata_word, (uint64_t)md, (uint64_t)md_new);
+#endif  // PMDK
 }
 
-TOID(struct Node) BzTree::find_leaf(const std::string key, bool perform_smo) {
+NodeRef BzTree::find_leaf(const Slice &key, bool perform_smo) {
   auto [leaf, parent, idx] = find_leaf_parent(key, perform_smo);
   return leaf;
 }
 
-std::tuple<TOID(struct Node), std::optional<TOID(struct Node)>, uint16_t>
-  BzTree::find_leaf_parent(const std::string key, bool perform_smo) {
+std::tuple<NodeRef, std::optional<NodeRef>, uint16_t>
+  BzTree::find_leaf_parent(const Slice &key, bool perform_smo, bool soft) {
   while (1) {
-    auto v = find_leaf_parent_smo(key, perform_smo, get_metadata());
+    auto v = find_leaf_parent_smo(key, perform_smo, get_metadata(), soft);
     if (v == std::nullopt) continue;
     return *v;
   }
 }
 
-bool BzTree::swap_node(std::optional<TOID(struct Node)> parent, uint64_t *node_off_ptr, TOID(struct Node) old_node, TOID(struct Node) new_node) {
+bool BzTree::swap_node(std::optional<NodeRef> parent, uint64_t *node_off_ptr, NodeRef old_node,
+    NodeRef new_node, std::initializer_list<NodeRef> retired) {
   struct NodeHeaderStatusWord sw;
   if (parent.has_value()) {
-    sw = D_RW(*parent)->header.status_word;
+    sw = read_status_word(node_ptr(*parent));
     if (sw.frozen) return false;
   }
 
-  uint64_t old_offset = toid_get_offset(old_node);
-  uint64_t new_offset = toid_get_offset(new_node);
+  uint64_t old_offset = old_node.word;
+  uint64_t new_offset = new_node.word;
 
   // retry if the node didn't become frozen, because that's recoverable
   // and returning false out of here is very expensive, it unfreezes the new node and re-traverses
   while (1) {
     auto *desc = desc_pool->AllocateDescriptor();
     assert(desc);
-    if (parent.has_value()) desc->AddEntry((uint64_t*)&D_RW(*parent)->header.status_word, *(uint64_t*)&sw, *(uint64_t*)&sw);
+    if (parent.has_value()) desc->AddEntry((uint64_t*)&node_ptr(*parent)->header.status_word, *(uint64_t*)&sw, *(uint64_t*)&sw);
     desc->AddEntry(node_off_ptr, old_offset, new_offset);
+    for (auto node : retired) retire_leaf(desc, node);
     if (desc->MwCAS()) return true;
 
     // failed, check if it is because it became frozen or if the current value changed
-    if (*node_off_ptr != old_offset) return false;
+    if (read_word(node_off_ptr) != old_offset) return false;
     if (parent.has_value()) {
-      sw = D_RW(*parent)->header.status_word;
+      sw = read_status_word(node_ptr(*parent));
       if (sw.frozen) return false;
     }
 
@@ -59,109 +81,337 @@ bool BzTree::swap_node(std::optional<TOID(struct Node)> parent, uint64_t *node_o
   }
 }
 
-void BzTree::toid_set_offset(TOID(struct Node) *target, uint64_t off) {
-  target->oid.off = off;
-}
-uint64_t BzTree::toid_get_offset(TOID(struct Node) target) {
-  return target.oid.off;
-}
-
 uint32_t BzTree::free_space(const struct NodeHeaderStatusWord *sw) {
-  return sizeof(struct Node)
-            - sizeof(struct NodeHeader)
+  return body_size()
             - (sw->record_count * sizeof(struct NodeMetadata))
             - sw->block_size;
 }
 
-std::optional<std::tuple<TOID(struct Node), std::optional<TOID(struct Node)>, uint16_t>>
-    BzTree::find_leaf_parent_smo(const std::string key, bool perform_smo, struct BzPMDKMetadata *md) {
-  // hack: we want the original toid of the metadata to be able to add it
-  TOID(struct BzPMDKMetadata) md_oid;
-  TOID_ASSIGN(md_oid, pmemobj_oid(md));
+void BzTree::retire_leaf(Descriptor *desc, NodeRef node) {
+  struct Node *leaf = node_ptr(node);
+  if (!dram_inner || !leaf->header.leaf) return;
+  // inserts still reserve space in frozen leaves, so this is read again every time the pmwcas is retried
+  struct NodeHeaderStatusWord sw_old = read_status_word(leaf), sw = sw_old;
+  assert(sw.frozen);
+  sw.control |= NODE_RETIRED;
+  desc->AddEntry((uint64_t*)&leaf->header.status_word, *(uint64_t*)&sw_old, *(uint64_t*)&sw);
+}
+
+void BzTree::FreeBlob(void *context, void *word) {
+#ifdef PMDK
+  // there is no pool in the callback, but the tree always uses the allocator's pool
+  auto allocator = reinterpret_cast<PMDKAllocator*>(Allocator::Get());
+  PMEMobjpool *pool = allocator->GetPool();
+  PMEMoid oid = pmemobj_root(pool, sizeof(struct BzPMDKRootObj));
+  oid.off = (uint64_t)word;
+  if (!context) {
+    pmemobj_free(&oid);
+    return;
+  }
+  // the blob is still in the descriptor slot, so the slot is emptied in the same step, else recovery frees it again
+  struct pobj_action actions[2];
+  pmemobj_defer_free(pool, oid, &actions[0]);
+  pmemobj_set_value(pool, &actions[1], reinterpret_cast<uint64_t*>(context), Descriptor::kNewValueReserved);
+  pmemobj_publish(pool, actions, 2);
+#else
+  (void)context;
+  free(word);
+#endif  // PMDK
+}
+
+uint64_t BzTree::new_blob(const Slice &value) {
+#ifdef PMDK
+  TOID(struct Blob) blob_oid;
+  POBJ_ALLOC(pop, &blob_oid, struct Blob, sizeof(struct Blob) + value.size(), nullptr, nullptr);
+  struct Blob *blob = D_RW(blob_oid);
+  uint64_t word = blob_oid.oid.off;
+#else
+  struct Blob *blob = reinterpret_cast<struct Blob*>(malloc(sizeof(struct Blob) + value.size()));
+  uint64_t word = (uint64_t)blob;
+#endif  // PMDK
+  blob->size = value.size();
+  memcpy(blob->data, value.data(), value.size());
+  flush(blob, sizeof(struct Blob) + value.size());
+  return word;
+}
+
+void BzTree::new_blob(const Slice &value, Descriptor *desc, uint32_t entry) {
+#ifdef PMDK
+  auto *blob = reinterpret_cast<struct Blob*>(desc->AllocateNewValue(entry, sizeof(struct Blob) + value.size(),
+      TOID_TYPE_NUM(struct Blob)));
+  blob->size = value.size();
+  memcpy(blob->data, value.data(), value.size());
+  flush(blob, sizeof(struct Blob) + value.size());
+#else
+  // nothing survives a crash here, so there is nothing to leak
+  *desc->GetNewValuePtr(entry) = new_blob(value);
+#endif  // PMDK
+}
+
+void BzTree::write_record(struct Node *leaf, struct NodeMetadata md, const Slice &key, const Slice &value) {
+  // key and value are next to each other, so this flushes one range of lines
+#ifdef PMDK
+  pmemobj_memcpy(pop, &leaf->body[md.offset], key.data(), key.size(), PMEM_F_MEM_NODRAIN);
+  if (!md.out_of_line) {
+    pmemobj_memcpy(pop, &leaf->body[md.offset + md.key_len], value.data(), value.size(), PMEM_F_MEM_NODRAIN);
+  }
+#else
+  memcpy(&leaf->body[md.offset], key.data(), key.size());
+  if (!md.out_of_line) memcpy(&leaf->body[md.offset + md.key_len], value.data(), value.size());
+#endif  // PMDK
+}
+
+struct Blob *BzTree::record_blob(const struct Node *node, struct NodeMetadata md) {
+  assert(md.out_of_line);
+  // the blob word is installed by the pmwcas that makes the record visible, and it is the last word that pmwcas
+  // finishes, so it can still hold the descriptor (or be dirty) after the metadata says visible
+  uint64_t word = read_word(reinterpret_cast<const uint64_t*>(&node->body[md.offset + md.key_len]));
+#ifdef PMDK
+  // the blob is in the same pool as the node, like node_ptr
+  return reinterpret_cast<struct Blob*>((char*)pop + word);
+#else
+  return reinterpret_cast<struct Blob*>(word);
+#endif  // PMDK
+}
+
+Slice BzTree::record_value(const struct Node *node, struct NodeMetadata md) {
+  if (md.out_of_line) {
+    const struct Blob *blob = record_blob(node, md);
+    return Slice(blob->data, blob->size);
+  }
+  return Slice(&node->body[md.offset + md.key_len], md.total_len - md.key_len);
+}
+
+struct NodeMetadata BzTree::stable_metadata(const struct Node *node, uint16_t i) {
+  while (1) {
+    struct NodeMetadata md = read_metadata(node, i);
+    // the writer is only copying the value in, so this is short
+    if (md.version % 2 == 0) return md;
+    _mm_pause();
+  }
+}
+
+bool BzTree::metadata_unchanged(const struct Node *node, uint16_t i, struct NodeMetadata md) {
+  const struct NodeMetadata *nmd = reinterpret_cast<const struct NodeMetadata*>(node->body);
+  // the reads of the value must not move after this
+  std::atomic_thread_fence(std::memory_order_acquire);
+  return reinterpret_cast<const std::atomic<uint64_t>*>(&nmd[i])->load(std::memory_order_relaxed) ==
+      *(uint64_t*)&md;
+}
+
+std::optional<uint16_t> BzTree::leaf_search(const struct Node *node, const Slice &key, bool *in_progress) {
+  // the status word and the metadata are changed by pmwcas, so they are read like any other word it changes
+  uint16_t record_count = read_status_word(node).record_count;
+  uint16_t sorted_count = std::min<uint32_t>(node->header.sorted_count, record_count);
+
+  // binary search the sorted prefix, keys are unique in here so there is at most one candidate
+  uint16_t lo = 0, hi = sorted_count;
+  while (lo < hi) {
+    uint16_t mid = lo + (hi - lo) / 2;
+    struct NodeMetadata md = read_metadata(node, mid);
+    int cmp = record_key(node, md).compare(key);
+    if (cmp == 0) {
+      // a deleted record here may have been re-inserted into the tail, so only return if visible
+      if (md.visible) return mid;
+      break;
+    }
+    if (cmp < 0) lo = mid + 1;
+    else hi = mid;
+  }
+
+  // linear scan the unsorted tail of recent inserts
+  // an insert still reserving space hasn't written its fingerprint yet, so when looking for those,
+  // empty fingerprints are candidates too - once written, a different fingerprint means a different key
+  const uint8_t *fps = fingerprints(node);
+  const __m128i fp = _mm_set1_epi8(fingerprint(key));
+  const __m128i empty = _mm_setzero_si128();
+  uint32_t fingerprinted = std::min<uint32_t>(sorted_count + fingerprint_count(), record_count);
+  for (uint16_t i=sorted_count; i<fingerprinted; i+=16) {
+    __m128i chunk = _mm_loadu_si128((const __m128i*)&fps[i - sorted_count]);
+    __m128i eq = _mm_cmpeq_epi8(chunk, fp);
+    if (in_progress) eq = _mm_or_si128(eq, _mm_cmpeq_epi8(chunk, empty));
+    uint32_t candidates = _mm_movemask_epi8(eq);
+    if (fingerprinted - i < 16) candidates &= (1u << (fingerprinted - i)) - 1;
+    while (candidates) {
+      uint16_t j = i + __builtin_ctz(candidates);
+      candidates &= candidates - 1;
+      // any not-visible ones potentially are key conflicts in the middle of insertion, if in the same epoch
+      struct NodeMetadata md = read_metadata(node, j);
+      if (!md.visible) {
+        if (in_progress && md.offset == (global_epoch | GLOBAL_EPOCH_OFFSET_BIT)) *in_progress = true;
+        continue;
+      }
+      if (record_key(node, md) == key) return j;
+    }
+  }
+  // the rest of the tail has no fingerprints
+  for (uint16_t i=fingerprinted; i<record_count; i++) {
+    struct NodeMetadata md = read_metadata(node, i);
+    if (!md.visible) {
+      if (in_progress && md.offset == (global_epoch | GLOBAL_EPOCH_OFFSET_BIT)) *in_progress = true;
+      continue;
+    }
+    if (record_key(node, md) == key) return i;
+  }
+  return std::nullopt;
+}
+
+void BzTree::set_fingerprint(struct Node *leaf, uint16_t record_index, const Slice &key) {
+  uint32_t t = record_index - leaf->header.sorted_count;
+  if (t >= fingerprint_count()) return;
+  uint8_t *fp = &fingerprints(leaf)[t];
+  *fp = fingerprint(key);
+  flush(fp, sizeof(*fp));
+}
+
+uint16_t BzTree::inner_search(const struct Node *node, const Slice &key, bool after) {
+  // the metadata of inner nodes is never changed after copy_in, only the status word (frozen) and the child ptrs
+  const struct NodeMetadata *nmd = reinterpret_cast<const struct NodeMetadata*>(node->body);
+  uint16_t record_count = read_status_word(node).record_count;
+  assert(record_count > 0);
+  assert(node->header.sorted_count == record_count);
+
+  // lower bound: we want the first key that's >= the search key (or > for upper bound)
+  uint16_t lo = 0, hi = record_count;
+  while (lo < hi) {
+    uint16_t mid = lo + (hi - lo) / 2;
+    assert(nmd[mid].total_len == nmd[mid].key_len + 8); // optimization to use 8 for value len
+    int cmp = record_key(node, nmd[mid]).compare(key);
+    if (cmp < 0 || (after && cmp == 0)) lo = mid + 1;
+    else hi = mid;
+  }
+  // disregard last limit, it is basically infinity
+  if (lo == record_count) lo--;
+  return lo;
+}
+
+NodeRef BzTree::find_leaf_bounds(const std::optional<std::string> &key, bool after,
+    std::optional<std::string> *lower, std::optional<std::string> *upper) {
+  struct BzPMDKMetadata *md = get_metadata();
+  NodeRef node{read_word(&md->root_node.word)};
+  *lower = std::nullopt;
+  *upper = std::nullopt;
+
+  // the bounds only get tighter as we go down, so the deepest ones win
+  for (uint64_t h=1; h<md->height; h++) {
+    const struct Node *inner = node_ptr(node);
+    const struct NodeMetadata *nmd = reinterpret_cast<const struct NodeMetadata*>(inner->body);
+    uint16_t record_count = read_status_word(inner).record_count;
+    uint16_t i = key.has_value() ? inner_search(inner, *key, after) : record_count - 1;
+
+    if (i > 0) *lower = std::string(&inner->body[nmd[i-1].offset], nmd[i-1].key_len);
+    if (i < record_count - 1) *upper = std::string(&inner->body[nmd[i].offset], nmd[i].key_len);
+    node = read_child(inner, nmd[i]);
+  }
+  return node;
+}
+
+std::optional<std::tuple<NodeRef, std::optional<NodeRef>, uint16_t>>
+    BzTree::find_leaf_parent_smo(const Slice &key, bool perform_smo, struct BzPMDKMetadata *md, bool soft) {
+  // the thresholds to SMO at, the soft ones for the background SMO workers
+  // writers queue nodes past the soft thresholds for the workers if there are any, and leave merges to them
+  // (see the background SMOs in bztree.h)
+  SmoWorkers *workers = smo_workers.get();
+  assert(!soft || workers != nullptr);
+  bool queue = perform_smo && !soft && workers != nullptr;
+  uint32_t split_free_space = soft ? workers->soft_free_space : min_free_space;
+  uint32_t compact_deleted_space = soft ? workers->soft_deleted_space : max_deleted_space;
 
   // special case: does the root need SMO? if so, do them
   // todo(optimization): this is checked on nearly every operation, optimize this maybe? only check if root changes?
   if (perform_smo) {
-    const struct NodeHeaderStatusWord *root_sw = &D_RO(md->root_node)->header.status_word;
+    // the root is swapped in place in the metadata when it's replaced by a split below it, see swap_node
+    NodeRef root{read_word(&md->root_node.word)};
+    const struct NodeHeaderStatusWord root_sw = read_status_word(node_ptr(root));
     // root, of course, cannot be merged with a sibling (it has no siblings)
-    bool root_compact = root_sw->delete_size > BZTREE_MAX_DELETED_SPACE;
-    bool root_split = sizeof(struct Node) < BZTREE_MIN_FREE_SPACE + sizeof(struct NodeHeader) + root_sw->block_size +
-                        (root_sw->record_count*(sizeof(struct NodeMetadata)));
+    bool root_compact = root_sw.delete_size > compact_deleted_space;
+    bool root_split = free_space(&root_sw) < split_free_space;
+    // space held by reservations from before the pool was opened comes back by compacting
+    if (root_split && has_stale_reservations(node_ptr(root))) root_compact = true;
+    if (queue && !root_compact && !root_split && (root_sw.delete_size > workers->soft_deleted_space ||
+        free_space(&root_sw) < workers->soft_free_space)) {
+      queue_smo(key, root);
+    }
 
     // root split needs to be a special case because we modify height, so the root cannot be swapped with swap_node
     // todo(optimization): move root_compact out of here, it's needlessly complex (no new md needed, and with it, no
     // double pmwcas) and only attached to this for ease of implementation
-    TOID(struct BzPMDKMetadata) md_new_oid;
     struct BzPMDKMetadata *md_new;
+    struct SmoLogEntry *smo_entry = nullptr;
     if (root_compact || root_split) {
-      // first, freeze the root node
+      // first, freeze the root node, unless another SMO has already
       {
-        struct NodeHeaderStatusWord sw_old = *root_sw, sw=*root_sw;
+        if (root_sw.frozen) return std::nullopt;
+        struct NodeHeaderStatusWord sw_old = root_sw, sw = root_sw;
         sw.frozen = 1;
 
-        auto *desc = desc_pool->AllocateDescriptor();
-        assert(desc);
-        desc->AddEntry((uint64_t*)root_sw, *(uint64_t*)&sw_old, *(uint64_t*)&sw);
-        if (!desc->MwCAS()) return std::nullopt;
+        smo_entry = log_smo({root});
+        if (!cas_word(&node_ptr(root)->header.status_word, *(uint64_t*)&sw_old, *(uint64_t*)&sw)) {
+          unlog_smo(smo_entry);
+          return std::nullopt;
+        }
       }
 
-      // create a new pmdk metadata object for the new root node
-      POBJ_ZNEW(pop, &md_new_oid, struct BzPMDKMetadata);
-      md_new = D_RW(md_new_oid);
+      // create a new metadata object for the new root node
+      md_new = new_metadata();
       md_new->height = md->height;
       md_new->global_epoch = md->global_epoch;
     }
 
     // keep these for cleanup
-    std::optional<std::pair<TOID(struct Node), TOID(struct Node)>> new_children = std::nullopt;
+    std::optional<std::pair<NodeRef, NodeRef>> new_children = std::nullopt;
 
     // if both are needed, perform compact first, since it's possible splitting isn't needed after compaction
     // (whereas splitting will implicitly compact them, so the resulting ones might just get merged back next step)
-    if (root_compact) md_new->root_node = node_compact(md->root_node);
+    if (root_compact) md_new->root_node = node_compact(root);
     else if (root_split) {
-        std::tie(md_new->root_node, new_children) = node_split(std::nullopt, md->root_node);
+        std::tie(md_new->root_node, new_children) = node_split(std::nullopt, root, 0, key, true);
         md_new->height++;
     }
 
     // swap it into the pmem root data structure
     if (root_compact || root_split) {
-      struct BzPMDKRootObj *root = D_RW(POBJ_ROOT(pop, struct BzPMDKRootObj));
-
       auto *desc = desc_pool->AllocateDescriptor();
       assert(desc);
-      desc_add_toid(desc, &root->metadata, md_oid, md_new_oid);
+      desc_add_metadata(desc, md, md_new);
+      retire_leaf(desc, root);
       if (desc->MwCAS()) {
         // destroy old metadata and root
         assert(garbage.Push(md, BzTree::DestroyNode, nullptr).ok());
-        assert(garbage.Push(D_RW(md->root_node), BzTree::DestroyNode, nullptr).ok());
+        assert(garbage.Push((void*)root.word, BzTree::FreeNode, this).ok());
       } else {
         // destroy new metadata and root and children, if any
-        POBJ_FREE(md_new);
-        POBJ_FREE(D_RW(md_new->root_node));
+        free_node(md_new->root_node);
+        DestroyNode(nullptr, md_new);
         if (new_children.has_value()) {
-          POBJ_FREE(D_RW(new_children->first));
-          POBJ_FREE(D_RW(new_children->second));
+          free_node(new_children->first);
+          free_node(new_children->second);
         }
       }
+      unlog_smo(smo_entry);
       // whether or not it worked, return nullopt to re-traverse
       return std::nullopt;
     }
   }
 
   // if there's only the root node we're done
-  if (md->height == 1) return std::make_tuple(md->root_node, std::nullopt, 0);
+  if (md->height == 1) return std::make_tuple(NodeRef{read_word(&md->root_node.word)}, std::nullopt, 0);
 
-  TOID(struct Node) child;
+  NodeRef child;
   uint64_t *child_off_ptr;
-  TOID(struct Node) parent = md->root_node;
+  NodeRef parent{read_word(&md->root_node.word)};
   // todo(cleanup): this is not a good way to abstract between updating the root_node offset and updating a regular node offset
-  // we should keep the ".oid.off" hack isolated in toid_set_offset and toid_get_offset
-  uint64_t *parent_off_ptr = &md->root_node.oid.off;
-  std::optional<TOID(struct Node)> grandparent = std::nullopt;
+  uint64_t *parent_off_ptr = &md->root_node.word;
+  std::optional<NodeRef> grandparent = std::nullopt;
+  // whether parent is the rightmost node of its level, which is where appends go, see node_split
+  bool rightmost = true;
 
-  // saved for later
+  // saved for later, child_sw is where the status word is, and child_sw_old what it was
   struct NodeHeaderStatusWord *child_sw;
+  struct NodeHeaderStatusWord child_sw_old;
   size_t child_fs;
+  // the SmoLog entry of an SMO on the child, see log_smo
+  struct SmoLogEntry *smo_entry;
 
   // perform height-1 dereferences to get to leaf
   uint64_t h=0;
@@ -170,130 +420,141 @@ std::optional<std::tuple<TOID(struct Node), std::optional<TOID(struct Node)>, ui
     // the inner nodes do not have a full TOID!
     // the spec dictates that they are 8 bytes, which means we don't have enough space for pool id
     // the tradeoff is that this means inner nodes can hold more keys, but, bztrees cannot span pools
-    // for us, we need to reconstitute the TOID from the parent's pool id and the offset in the node body
-    struct NodeHeader *parent_header = &D_RW(parent)->header;
-    const struct NodeHeaderStatusWord parent_sw = parent_header->status_word;
+    // so the node word in the node body is all there is to a NodeRef
+    struct NodeHeader *parent_header = &node_ptr(parent)->header;
+    const struct NodeHeaderStatusWord parent_sw = read_status_word(node_ptr(parent));
 
-    // todo(optimization): binary search sorted keys, inner nodes are guaranteed to
-    // be sorted because they are immutable
     // here we also get the left and right siblings to consider merging
-    TOID(struct Node) sib_left = TOID_NULL(struct Node), sib_right = TOID_NULL(struct Node);
+    NodeRef sib_left = NodeRef{}, sib_right = NodeRef{};
     uint16_t i;
+    bool child_rightmost;
     {
       const struct NodeMetadata *nmd = reinterpret_cast<const struct NodeMetadata*>(parent_header + 1);
-      // the first key does not matter, it is zero for consistency
-      // so we check starting at the second key
-      // we want the last key less than the one past the one, which is one minus the first key that's <= it
-      for (i=0; i<parent_sw.record_count; i++) {
-        assert(nmd[i].total_len == nmd[i].key_len + 8); // optimization to use 8 for value len
-        if (strcmp(&D_RO(parent)->body[nmd[i].offset], key.c_str()) >= 0) break;
-      }
-      // disregard last limit, it is basically infinity
-      if (i == parent_sw.record_count) i--;
-      child_off_ptr = (uint64_t*)&D_RW(parent)->body[nmd[i].offset + nmd[i].key_len];
+      i = inner_search(node_ptr(parent), key);
+      child_off_ptr = (uint64_t*)&node_ptr(parent)->body[nmd[i].offset + nmd[i].key_len];
+      child_rightmost = rightmost && i == parent_sw.record_count - 1;
 
-      // dereference child (first set is to set pool id for first iteration)
-      child = parent;
-      toid_set_offset(&child, *child_off_ptr);
-      child_sw = &D_RW(child)->header.status_word;
-      child_fs = free_space(child_sw);
+      // dereference child
+      child = NodeRef{read_word(child_off_ptr)};
+      child_sw = &node_ptr(child)->header.status_word;
+      child_sw_old = read_status_word(node_ptr(child));
+      child_fs = free_space(&child_sw_old);
 
       // dereference left and right and check free space, setting it back to null if there's not enough space to merge
       // todo(safety): we don't actually hold a lock over our siblings here, so, what if they change between this check
       // and when we do actual merging? is merging an action that can fail, unlike the other node operations? sigh
       // left zero does not actually have a child, remember
+      // (merged nodes are held to the free space an append split leaves, so that they aren't split again right away
+      // and don't undo an append split)
       if (i > 0) {
-        sib_left = parent;
-        toid_set_offset(&sib_left, *(uint64_t*)&D_RW(parent)->body[nmd[i-1].offset + nmd[i-1].key_len]);
-        if (child_fs + free_space(&D_RO(sib_left)->header.status_word) < BZTREE_MIN_FREE_SPACE + sizeof(struct Node))
-          sib_left = TOID_NULL(struct Node);
+        sib_left = read_child(node_ptr(parent), nmd[i-1]);
+        struct NodeHeaderStatusWord sib_sw = read_status_word(node_ptr(sib_left));
+        if (child_fs + free_space(&sib_sw) < append_free_space() + node_size)
+          sib_left = NodeRef{};
       }
       if (i < parent_sw.record_count-1) {
-        sib_right = parent;
-        toid_set_offset(&sib_right, *(uint64_t*)&D_RW(parent)->body[nmd[i+1].offset + nmd[i+1].key_len]);
-        if (child_fs + free_space(&D_RO(sib_right)->header.status_word) < BZTREE_MIN_FREE_SPACE + sizeof(struct Node))
-          sib_right = TOID_NULL(struct Node);
+        sib_right = read_child(node_ptr(parent), nmd[i+1]);
+        struct NodeHeaderStatusWord sib_sw = read_status_word(node_ptr(sib_right));
+        if (child_fs + free_space(&sib_sw) < append_free_space() + node_size)
+          sib_right = NodeRef{};
       }
     }
 
     // do SMOs on child if needed
     if (perform_smo) {
-      bool do_compact = child_sw->delete_size > BZTREE_MAX_DELETED_SPACE;
-      bool do_split = child_fs < BZTREE_MIN_FREE_SPACE;
-      bool do_merge = !TOID_IS_NULL(sib_left) || !TOID_IS_NULL(sib_right);
+      bool do_compact = child_sw_old.delete_size > compact_deleted_space;
+      bool do_split = child_fs < split_free_space;
+      // see the root above
+      do_compact |= do_split && has_stale_reservations(node_ptr(child));
+      bool do_merge = !!sib_left.word || !!sib_right.word;
+      if (queue && !do_compact && !do_split && (do_merge || child_sw_old.delete_size > workers->soft_deleted_space ||
+          child_fs < workers->soft_free_space)) {
+        queue_smo(key, child);
+      }
+      if (queue) do_merge = false;
 
       // compact takes priority because it may remove/add need to do splits or merges, and is implicitly done for them
       if (do_compact) {
-        // opportunistically ensure parent is not frozen
-        if (parent_sw.frozen) return std::nullopt;
+        // opportunistically ensure parent is not frozen, and the node isn't frozen by another SMO already
+        if (parent_sw.frozen || child_sw_old.frozen) return std::nullopt;
 
         // first, freeze the node
         {
-          struct NodeHeaderStatusWord sw_old = *child_sw, sw=*child_sw;
+          struct NodeHeaderStatusWord sw_old = child_sw_old, sw = child_sw_old;
           sw.frozen = 1;
 
-          auto *desc = desc_pool->AllocateDescriptor();
-          assert(desc);
-          desc->AddEntry((uint64_t*)child_sw, *(uint64_t*)&sw_old, *(uint64_t*)&sw);
-          if (!desc->MwCAS()) return std::nullopt;
+          smo_entry = log_smo({child});
+          if (!cas_word(child_sw, *(uint64_t*)&sw_old, *(uint64_t*)&sw)) {
+            unlog_smo(smo_entry);
+            return std::nullopt;
+          }
         }
 
         // perform the compaction
-        TOID(struct Node) new_child = node_compact(child);
+        NodeRef new_child = node_compact(child);
 
         // swap the new node in
-        if (swap_node(parent, child_off_ptr, child, new_child)) {
+        if (swap_node(parent, child_off_ptr, child, new_child, {child})) {
           // success, delete the old node
-          assert(garbage.Push((void*)D_RW(child), BzTree::DestroyNode, nullptr).ok());
+          assert(garbage.Push((void*)child.word, BzTree::FreeNode, this).ok());
         } else {
           // failure should happen only when the parent node freezes
           // we can just unfreeze the child node directly safely because only this thread could have frozen it
           // the adjacent fields of the struct are not going to be modified by any other thread while it is frozen
           child_sw->frozen = 0;
+          persist(child_sw, sizeof(*child_sw));
 
-          POBJ_FREE(D_RW(new_child));
+          free_node(new_child);
         }
+        unlog_smo(smo_entry);
 
         // whether or not it worked, return nullopt to re-traverse
         return std::nullopt;
       }
 
       if (do_split) {
-        // opportunistically ensure parent and grandparent are unfrozen
-        if (parent_sw.frozen) return std::nullopt;
-        if (grandparent.has_value() && D_RW(*grandparent)->header.status_word.frozen) return std::nullopt;
+        // opportunistically ensure parent and grandparent are unfrozen, and the node isn't frozen by another SMO
+        if (parent_sw.frozen || child_sw_old.frozen) return std::nullopt;
+        if (grandparent.has_value() && read_status_word(node_ptr(*grandparent)).frozen) return std::nullopt;
 
         // freeze the node and the parent (deviation from paper)
-        struct NodeHeaderStatusWord sw_old = *child_sw, sw=*child_sw;
+        struct NodeHeaderStatusWord sw_old = child_sw_old, sw = child_sw_old;
         sw.frozen = 1;
 
         struct NodeHeaderStatusWord parent_sw_new = parent_sw;
         parent_sw_new.frozen = 1;
 
+        smo_entry = log_smo({child, parent});
         auto *desc = desc_pool->AllocateDescriptor();
         assert(desc);
         desc->AddEntry((uint64_t*)child_sw, *(uint64_t*)&sw_old, *(uint64_t*)&sw);
         desc->AddEntry((uint64_t*)&parent_header->status_word, *(uint64_t*)&parent_sw, *(uint64_t*)&parent_sw_new);
-        if (!desc->MwCAS()) return std::nullopt;
+        if (!desc->MwCAS()) {
+          unlog_smo(smo_entry);
+          return std::nullopt;
+        }
 
         // perform the split
-        auto [new_parent, new_children] = node_split(parent, child);
+        auto [new_parent, new_children] = node_split(parent, child, i, key, child_rightmost);
 
         // swap the new parent in
-        if (swap_node(grandparent, parent_off_ptr, parent, new_parent)) {
+        if (swap_node(grandparent, parent_off_ptr, parent, new_parent, {child})) {
           // success, delete the old nodes
-          assert(garbage.Push((void*)D_RW(child), BzTree::DestroyNode, nullptr).ok());
-          assert(garbage.Push((void*)D_RW(parent), BzTree::DestroyNode, nullptr).ok());
+          assert(garbage.Push((void*)child.word, BzTree::FreeNode, this).ok());
+          assert(garbage.Push((void*)parent.word, BzTree::FreeNode, this).ok());
         } else {
           // failure should happen only when the grandparent node freezes
           // we can just unfreeze the nodes directly safely because only this thread could have frozen them, see above
           parent_header->status_word.frozen = 0;
           child_sw->frozen = 0;
+          flush(&parent_header->status_word, sizeof(parent_header->status_word));
+          persist(child_sw, sizeof(*child_sw));
 
-          POBJ_FREE(D_RW(new_children.first));
-          POBJ_FREE(D_RW(new_children.second));
-          POBJ_FREE(D_RW(new_parent));
+          free_node(new_children.first);
+          free_node(new_children.second);
+          free_node(new_parent);
         }
+        unlog_smo(smo_entry);
 
         // whether or not it worked, return nullopt to re-traverse
         return std::nullopt;
@@ -301,58 +562,69 @@ std::optional<std::tuple<TOID(struct Node), std::optional<TOID(struct Node)>, ui
 
       if (do_merge) {
         // figure out which sibling to merge
-        TOID(struct Node) merge_left, merge_right;
-        if (!TOID_IS_NULL(sib_left)) {
+        NodeRef merge_left, merge_right;
+        uint16_t merge_left_index;
+        if (!!sib_left.word) {
           merge_left = sib_left;
           merge_right = child;
-        } else if (!TOID_IS_NULL(sib_right)) {
+          merge_left_index = i - 1;
+        } else if (!!sib_right.word) {
           merge_left = child;
           merge_right = sib_right;
+          merge_left_index = i;
         } else assert(0);
 
         // opportunistically ensure parent and grandparent are unfrozen
         if (parent_sw.frozen) return std::nullopt;
-        if (grandparent.has_value() && D_RW(*grandparent)->header.status_word.frozen) return std::nullopt;
+        if (grandparent.has_value() && read_status_word(node_ptr(*grandparent)).frozen) return std::nullopt;
 
         // freeze the nodes and the parent (deviation from paper)
-        struct NodeHeaderStatusWord sw_left_old = D_RO(merge_left)->header.status_word;
-        struct NodeHeaderStatusWord sw_right_old = D_RO(merge_right)->header.status_word;
+        struct NodeHeaderStatusWord sw_left_old = read_status_word(node_ptr(merge_left));
+        struct NodeHeaderStatusWord sw_right_old = read_status_word(node_ptr(merge_right));
         if (sw_left_old.frozen) return std::nullopt;
         if (sw_right_old.frozen) return std::nullopt;
 
         // ensure that there's still enough space if we merged them now (previous check was opportunistic)
-        if (free_space(&sw_left_old) + free_space(&sw_right_old) < BZTREE_MIN_FREE_SPACE + sizeof(struct Node)) return std::nullopt;
+        if (free_space(&sw_left_old) + free_space(&sw_right_old) < append_free_space() + node_size) return std::nullopt;
 
         // set both to frozen, and parent
         struct NodeHeaderStatusWord sw_left = sw_left_old, sw_right = sw_right_old, parent_sw_new = parent_sw;
         sw_left.frozen = sw_right.frozen = parent_sw_new.frozen = 1;
 
+        smo_entry = log_smo({merge_left, merge_right, parent});
         auto *desc = desc_pool->AllocateDescriptor();
         assert(desc);
-        desc->AddEntry((uint64_t*)&D_RW(merge_left)->header.status_word, *(uint64_t*)&sw_left_old, *(uint64_t*)&sw_left);
-        desc->AddEntry((uint64_t*)&D_RW(merge_right)->header.status_word, *(uint64_t*)&sw_right_old, *(uint64_t*)&sw_right);
+        desc->AddEntry((uint64_t*)&node_ptr(merge_left)->header.status_word, *(uint64_t*)&sw_left_old, *(uint64_t*)&sw_left);
+        desc->AddEntry((uint64_t*)&node_ptr(merge_right)->header.status_word, *(uint64_t*)&sw_right_old, *(uint64_t*)&sw_right);
         desc->AddEntry((uint64_t*)&parent_header->status_word, *(uint64_t*)&parent_sw, *(uint64_t*)&parent_sw_new);
-        if (!desc->MwCAS()) return std::nullopt;
+        if (!desc->MwCAS()) {
+          unlog_smo(smo_entry);
+          return std::nullopt;
+        }
 
         // perform the merge
-        auto [new_parent, new_child] = node_merge(parent, merge_left, merge_right);
+        auto [new_parent, new_child] = node_merge(parent, merge_left, merge_right, merge_left_index);
 
         // swap the new parent in
-        if (swap_node(grandparent, parent_off_ptr, parent, new_parent)) {
+        if (swap_node(grandparent, parent_off_ptr, parent, new_parent, {merge_left, merge_right})) {
           // success, delete the old nodes
-          assert(garbage.Push((void*)D_RW(merge_left), BzTree::DestroyNode, nullptr).ok());
-          assert(garbage.Push((void*)D_RW(merge_right), BzTree::DestroyNode, nullptr).ok());
-          assert(garbage.Push((void*)D_RW(parent), BzTree::DestroyNode, nullptr).ok());
+          assert(garbage.Push((void*)merge_left.word, BzTree::FreeNode, this).ok());
+          assert(garbage.Push((void*)merge_right.word, BzTree::FreeNode, this).ok());
+          assert(garbage.Push((void*)parent.word, BzTree::FreeNode, this).ok());
         } else {
           // failure should happen only when the grandparent node freezes
           // we can just unfreeze the nodes directly safely because only this thread could have frozen them, see above
-          D_RW(merge_left)->header.status_word.frozen = 0;
-          D_RW(merge_right)->header.status_word.frozen = 0;
+          node_ptr(merge_left)->header.status_word.frozen = 0;
+          node_ptr(merge_right)->header.status_word.frozen = 0;
           parent_header->status_word.frozen = 0;
+          flush(&node_ptr(merge_left)->header.status_word, sizeof(struct NodeHeaderStatusWord));
+          flush(&node_ptr(merge_right)->header.status_word, sizeof(struct NodeHeaderStatusWord));
+          persist(&parent_header->status_word, sizeof(parent_header->status_word));
 
-          POBJ_FREE(D_RW(new_child));
-          POBJ_FREE(D_RW(new_parent));
+          free_node(new_child);
+          free_node(new_parent);
         }
+        unlog_smo(smo_entry);
 
         // whether or not it worked, return nullopt to re-traverse
         return std::nullopt;
@@ -366,6 +638,7 @@ std::optional<std::tuple<TOID(struct Node), std::optional<TOID(struct Node)>, ui
     grandparent = parent;
     parent_off_ptr = child_off_ptr;
     parent = child;
+    rightmost = child_rightmost;
   }
 }
 
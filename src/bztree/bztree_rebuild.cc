@@ -0,0 +1,129 @@
+#include <chrono>
+#include "bztree.h"
+#include "include/pmwcas.h"
+
+namespace pmwcas {
+
+#ifdef PMDK
+// with inner nodes in dram, the leaves in the pool are the whole tree: every leaf covers the keys between
+// the largest key of the leaf before it and its own largest key, so sorting the leaves by their keys and
+// building the inner levels over them gives back an equivalent tree, like bulk_load does from sorted input
+// the only question is which leaves are in the tree - every node in the pool is a leaf then, and
+// - leaves that were replaced have NODE_RETIRED set, by the same pmwcas that replaced them (see retire_leaf)
+// - a leaf that is frozen but not retired was being replaced by an SMO that didn't finish, so it is still
+//   in the tree, and any new leaf holding its keys was made by that SMO and never swapped in
+// - a leaf that copy_in was still writing isn't allocated yet (see alloc_node), so every leaf here is whole
+
+void BzTree::rebuild() {
+  auto start = std::chrono::steady_clock::now();
+
+  struct Leaf {
+    NodeRef node;
+    bool frozen;
+    bool empty;
+    // the smallest and largest key, these point into the leaf
+    Slice min, max;
+  };
+  std::vector<Leaf> leaves;
+  std::vector<NodeRef> unused;
+
+  // collect the leaves first, since some are freed along the way
+  // (this also takes the node size from the slabs)
+  for (NodeRef node_oid : open_slabs()) {
+    const struct Node *node = node_ptr(node_oid);
+    assert(node->header.leaf);
+    if (node->header.status_word.control & NODE_RETIRED) {
+      unused.push_back(node_oid);
+      continue;
+    }
+    leaves.push_back({node_oid, node->header.status_word.frozen, true, Slice(), Slice()});
+  }
+
+  for (auto &leaf : leaves) {
+    smo_records.clear();
+    copy_out(leaf.node, &smo_records);
+    // an empty leaf covers no keys, so it isn't needed to route any
+    if (smo_records.empty()) continue;
+    leaf.empty = false;
+    leaf.min = smo_records.front().key;
+    leaf.max = smo_records.back().key;
+  }
+  auto by_key = [](const Leaf &a, const Leaf &b) {
+    int cmp = a.max.compare(b.max);
+    // when an unfinished SMO's leaves end with the same key, the frozen one goes first, since it wins
+    return cmp < 0 || (cmp == 0 && a.frozen && !b.frozen);
+  };
+  std::sort(leaves.begin(), leaves.end(), by_key);
+
+  // drop what isn't in the tree, keeping the leaves that are in order
+  // a leaf made by an unfinished SMO has keys in the range of the frozen leaf it was made from,
+  // which is either right before or right after it in this order
+  std::vector<Leaf> live;
+  for (auto &leaf : leaves) {
+    if (leaf.empty) {
+      unused.push_back(leaf.node);
+      continue;
+    }
+    while (!live.empty() && leaf.min.compare(live.back().max) <= 0) {
+      assert(leaf.frozen != live.back().frozen);
+      if (leaf.frozen) {
+        unused.push_back(live.back().node);
+        live.pop_back();
+      } else {
+        break;
+      }
+    }
+    if (!live.empty() && leaf.min.compare(live.back().max) <= 0) {
+      unused.push_back(leaf.node);
+      continue;
+    }
+    live.push_back(leaf);
+  }
+
+  // the frozen ones can go back to being regular leaves, since nothing is reaching them anymore
+  for (auto &leaf : live) {
+    if (!leaf.frozen) continue;
+    struct Node *node = node_ptr(leaf.node);
+    node->header.status_word.frozen = 0;
+    persist(&node->header.status_word, sizeof(node->header.status_word));
+  }
+
+  // the separators are the largest keys, like in bulk_load, the last one is basically infinity anyway
+  std::vector<std::pair<std::string, uint64_t>> level;
+  for (auto &leaf : live) {
+    level.emplace_back(std::string(leaf.max.data(), leaf.max.size()), leaf.node.word);
+  }
+  if (level.empty()) {
+    // nothing left at all, so just a new empty root
+    NodeRef root = new_node(true);
+    drain();
+    level.emplace_back("", root.word);
+  }
+
+  // leave room for the splits that come right after, so they don't split the parents right away too
+  std::vector<NodeRef> nodes;
+  uint64_t height = 1;
+  NodeRef root = build_levels(std::move(level), body_size() - min_free_space, &height, &nodes);
+
+  // swap in new metadata, like any root swap - nothing else is running yet, so it doesn't need pmwcas
+  struct BzPMDKMetadata *md = get_metadata();
+  struct BzPMDKMetadata *md_new = new_metadata();
+  md_new->root_node = root;
+  md_new->height = height;
+  md_new->global_epoch = md->global_epoch;
+  persist(md_new, sizeof(*md_new));
+
+  struct BzPMDKRootObj *rootobj = D_RW(POBJ_ROOT(pop, struct BzPMDKRootObj));
+  TOID_ASSIGN(rootobj->metadata, pmemobj_oid(md_new));
+  persist(&rootobj->metadata, sizeof(rootobj->metadata));
+  DestroyNode(nullptr, md);
+
+  // only free things once the new tree is in place, a crash before that just does this again
+  for (auto &node : unused) free_node(node);
+
+  rebuild_us = std::chrono::duration_cast<std::chrono::microseconds>(
+      std::chrono::steady_clock::now() - start).count();
+}
+#endif  // PMDK
+
+}  // namespace pmwcas
@@ -0,0 +1,184 @@
+#include <unordered_set>
+#include "bztree.h"
+#include "include/pmwcas.h"
+
+namespace pmwcas {
+
+// what is left to do when an existing pool is opened, after pmwcas recovery (see the constructor)
+// - inserts only reserve space with the global epoch in the offset, and make it visible in a second pmwcas,
+//   so a crash in between leaves reservations behind that no thread will finish, these are found by their
+//   epoch, and compaction drops them like any other record that isn't visible
+// - SMOs freeze their nodes in one pmwcas and swap the new ones in with another, a crash in between leaves
+//   nodes frozen that no thread will replace, these are found in the SmoLog
+// - in-place updates make the record's version odd in one pmwcas and even again in another, a crash in between
+//   leaves the value torn and the version odd, these are found in the UpdateLog and rolled back
+// - nodes are allocated before they are swapped in and freed only after they are out of the tree, so a crash
+//   can leave nodes allocated that nothing points to, these are found by walking the tree (or by rebuild)
+
+#ifdef PMDK
+thread_local uint32_t BzTree::smo_log_hint = 0;
+thread_local uint32_t BzTree::update_log_hint = 0;
+#endif  // PMDK
+
+struct SmoLogEntry *BzTree::log_smo(std::initializer_list<NodeRef> nodes) {
+  (void)nodes;
+#ifdef PMDK
+  if (dram_inner) return nullptr;
+  assert(nodes.size() > 0 && nodes.size() <= 8);
+  uint64_t first = nodes.begin()->word;
+
+  // an entry is free while its first word is zero, nodes are never at offset zero of the pool
+  // full means more SMOs in flight than entries, which only waits for one of them to finish
+  for (uint32_t i = smo_log_hint;; i = (i + 1) % BZTREE_SMO_LOG_SIZE) {
+    struct SmoLogEntry *entry = &smo_log->entries[i];
+    if (entry->nodes[0] != 0 || CompareExchange64<uint64_t>(&entry->nodes[0], first, 0ull) != 0) continue;
+
+    uint32_t j = 1;
+    for (auto it = nodes.begin() + 1; it != nodes.end(); it++) entry->nodes[j++] = it->word;
+    persist(entry, sizeof(*entry));
+    smo_log_hint = i;
+    return entry;
+  }
+#else
+  return nullptr;
+#endif  // PMDK
+}
+
+void BzTree::unlog_smo(struct SmoLogEntry *entry) {
+  if (entry == nullptr) return;
+  // the other words first, so a taken entry never has a stale node after its first
+  // only flushed, until a later drain the worst case is that recovery unfreezes nodes that weren't frozen
+  for (uint32_t j = 1; j < 8; j++) entry->nodes[j] = 0;
+  __atomic_store_n(&entry->nodes[0], 0ull, __ATOMIC_RELEASE);
+  flush(entry, sizeof(*entry));
+}
+
+void BzTree::recover_smos() {
+#ifdef PMDK
+  for (uint32_t i = 0; i < BZTREE_SMO_LOG_SIZE; i++) {
+    for (uint64_t word : smo_log->entries[i].nodes) {
+      if (word == 0) continue;
+      // the node may have been replaced before the crash, in which case it's garbage and this doesn't matter
+      struct NodeHeaderStatusWord *sw = &node_ptr(NodeRef{word})->header.status_word;
+      if (!sw->frozen) continue;
+      sw->frozen = 0;
+      flush(sw, sizeof(*sw));
+    }
+  }
+  memset(smo_log, 0, sizeof(struct SmoLog));
+  persist(smo_log, sizeof(struct SmoLog));
+  smo_log_hint = 0;
+#endif  // PMDK
+}
+
+struct UpdateLogEntry *BzTree::log_update(NodeRef leaf, uint16_t i, struct NodeMetadata md) {
+#ifdef PMDK
+  uint32_t len = md.total_len - md.key_len;
+  assert(len <= update_log_capacity());
+
+  // an entry is free while its node is zero, like the SmoLog
+  for (uint32_t j = update_log_hint;; j = (j + 1) % BZTREE_UPDATE_LOG_SIZE) {
+    struct UpdateLogEntry *entry =
+        reinterpret_cast<struct UpdateLogEntry*>(&update_log->entries[j * update_log->entry_size]);
+    if (entry->node != 0 || CompareExchange64<uint64_t>(&entry->node, leaf.word, 0ull) != 0) continue;
+
+    // metadata stays zero, the pmwcas sets it - if the value changes meanwhile, so does the metadata, and that fails
+    entry->index = i;
+    const struct Node *node = node_ptr(leaf);
+    memcpy(entry->value, &node->body[md.offset + md.key_len], len);
+    persist(entry, sizeof(*entry) + len);
+    update_log_hint = j;
+    return entry;
+  }
+#else
+  (void)leaf;
+  (void)i;
+  (void)md;
+  return nullptr;
+#endif  // PMDK
+}
+
+void BzTree::unlog_update(struct UpdateLogEntry *entry) {
+  if (entry == nullptr) return;
+  // an armed entry whose record is even again is ignored by recovery, but the node could be reused by then,
+  // so this is persisted before the update lets go of the epoch
+  entry->metadata = 0;
+  __atomic_store_n(&entry->node, 0ull, __ATOMIC_RELEASE);
+  persist(entry, sizeof(*entry));
+}
+
+void BzTree::recover_updates() {
+#ifdef PMDK
+  for (uint32_t j = 0; j < BZTREE_UPDATE_LOG_SIZE; j++) {
+    struct UpdateLogEntry *entry =
+        reinterpret_cast<struct UpdateLogEntry*>(&update_log->entries[j * update_log->entry_size]);
+    if (entry->node == 0) continue;
+
+    // both the logged and the current metadata were written by the pmwcas, which may have left them dirty in the
+    // pool (pmwcas recovery skips finished descriptors), so they are read through read_word like anywhere else
+    // the update was cut off if the record still has the logged metadata with an odd version, otherwise it
+    // finished (or never started) and the entry is stale
+    uint64_t logged = read_word(&entry->metadata);
+    if (logged == 0) continue;
+    struct Node *leaf = node_ptr(NodeRef{entry->node});
+    uint64_t *word = reinterpret_cast<uint64_t*>(leaf->body) + entry->index;
+    struct NodeMetadata md = *reinterpret_cast<struct NodeMetadata*>(&logged);
+    struct NodeMetadata odd = md;
+    odd.version++;
+    if (read_word(word) != *(uint64_t*)&odd) continue;
+
+    // the value first, the metadata makes it readable again
+    // the status word still counts the space the update freed as deleted, that only compacts the node early
+    memcpy(&leaf->body[md.offset + md.key_len], entry->value, md.total_len - md.key_len);
+    persist(&leaf->body[md.offset + md.key_len], md.total_len - md.key_len);
+    *word = logged;
+    persist(word, sizeof(*word));
+  }
+  memset(update_log->entries, 0, BZTREE_UPDATE_LOG_SIZE * update_log->entry_size);
+  persist(update_log->entries, BZTREE_UPDATE_LOG_SIZE * update_log->entry_size);
+  update_log_hint = 0;
+#endif  // PMDK
+}
+
+bool BzTree::has_stale_reservations(const struct Node *node) {
+  // reservations are only ever in the unsorted part, compaction sorts everything that's visible
+  uint16_t record_count = read_status_word(node).record_count;
+  uint32_t reservation = global_epoch | GLOBAL_EPOCH_OFFSET_BIT;
+  for (uint16_t i = std::min(node->header.sorted_count, record_count); i < record_count; i++) {
+    struct NodeMetadata md = read_metadata(node, i);
+    if (!md.visible && (md.offset & GLOBAL_EPOCH_OFFSET_BIT) && md.offset != reservation) return true;
+  }
+  return false;
+}
+
+#ifdef PMDK
+void BzTree::recover_nodes() {
+  std::vector<NodeRef> nodes = open_slabs();
+
+  // pmwcas recovery doesn't clear the dirty flag of words its finished descriptors installed, so a child ptr
+  // can still have it, and the words are read like anywhere else in the tree
+  struct BzPMDKMetadata *md = get_metadata();
+  std::unordered_set<uint64_t> reachable;
+  std::vector<std::pair<NodeRef, uint64_t>> stack{{md->root_node, md->height}};
+  while (!stack.empty()) {
+    auto [node_oid, height] = stack.back();
+    stack.pop_back();
+    reachable.insert(node_oid.word);
+    if (height <= 1) continue;
+    const struct Node *node = node_ptr(node_oid);
+    uint16_t record_count = read_status_word(node).record_count;
+    for (uint16_t i=0; i<record_count; i++) {
+      struct NodeMetadata nmd = read_metadata(node, i);
+      if (!nmd.visible) continue;
+      stack.emplace_back(read_child(node, nmd), height - 1);
+    }
+  }
+
+  for (NodeRef node_oid : nodes) {
+    if (!reachable.count(node_oid.word)) free_node(node_oid);
+  }
+  drain();
+}
+#endif  // PMDK
+
+}  // namespace pmwcas
@@ -0,0 +1,127 @@
+#include "bztree.h"
+#include "include/pmwcas.h"
+
+namespace pmwcas {
+
+// there are no sibling pointers in the tree, so a scan finds each next leaf by traversing from the root
+// using the separator that bounded the previous leaf - this is still one traversal per leaf, not per key,
+// and it stays correct if the leaves split or merge between two steps, since it goes by key and not by pointer
+
+BzTree::Iterator BzTree::scan(std::optional<Slice> start_key, std::optional<Slice> end_key,
+    uint64_t limit, bool reverse) {
+  return Iterator(this, start_key, end_key, limit, reverse);
+}
+
+// the bounds are copied, since the iterator outlives the call
+BzTree::Iterator::Iterator(BzTree *tree, std::optional<Slice> start_key,
+    std::optional<Slice> end_key, uint64_t limit, bool reverse)
+    : tree(tree), remaining(limit), reverse(reverse), fence(std::nullopt), first(true), pos(0) {
+  if (start_key.has_value()) this->start_key = std::string(start_key->data(), start_key->size());
+  if (end_key.has_value()) this->end_key = std::string(end_key->data(), end_key->size());
+}
+
+bool BzTree::Iterator::next() {
+  if (remaining == 0) return false;
+  // the first call has nothing to advance past yet
+  if (!entries.empty()) pos++;
+  while (pos >= entries.size()) {
+    if (!fill()) return false;
+  }
+  remaining--;
+  return true;
+}
+
+Slice BzTree::Iterator::key() const {
+  const Entry &e = entries[pos];
+  return Slice(&buf[e.key_off], e.key_len);
+}
+
+Slice BzTree::Iterator::value() const {
+  const Entry &e = entries[pos];
+  return Slice(&buf[e.value_off], e.value_len);
+}
+
+bool BzTree::Iterator::fill() {
+  // the previous leaf was the last one in this direction
+  if (!first && !fence.has_value()) return false;
+
+  buf.clear();
+  entries.clear();
+  pos = 0;
+
+  assert(tree->epoch.Protect().ok());
+
+  // forward scans start from the leaf with start_key and go right using the upper separator,
+  // reverse scans start from the leaf with end_key (or the rightmost) and go left using the lower one
+  std::optional<std::string> lower, upper;
+  NodeRef leaf_oid;
+  if (first) {
+    if (!reverse) leaf_oid = tree->find_leaf_bounds(start_key.value_or(""), false, &lower, &upper);
+    else leaf_oid = tree->find_leaf_bounds(end_key, false, &lower, &upper);
+  } else {
+    leaf_oid = tree->find_leaf_bounds(fence, !reverse, &lower, &upper);
+  }
+  first = false;
+
+  const struct Node *leaf = tree->node_ptr(leaf_oid);
+  uint16_t record_count = tree->read_status_word(leaf).record_count;
+  uint16_t sorted_count = std::min<uint32_t>(leaf->header.sorted_count, record_count);
+
+  // copy the visible records in range into the buffer
+  // the sorted prefix comes out in order, the unsorted tail is sorted separately and merged after
+  size_t from_sorted = 0;
+  auto in_range = [&](const Slice &key) {
+    if (start_key.has_value() && key.compare(*start_key) < 0) return false;
+    if (end_key.has_value() && key.compare(*end_key) >= 0) return false;
+    return true;
+  };
+  for (uint16_t i=0; i<record_count; i++) {
+    // take a copy, a concurrent update may swap in a new offset, or overwrite the value in place
+    // in which case the copy is dropped and taken again
+    struct NodeMetadata md;
+    Entry e;
+    bool copied;
+    do {
+      buf.resize(entries.empty() ? 0 : entries.back().value_off + entries.back().value_len);
+      md = tree->stable_metadata(leaf, i);
+      copied = md.visible && in_range(tree->record_key(leaf, md));
+      if (!copied) break;
+
+      Slice key = tree->record_key(leaf, md);
+      Slice value = tree->record_value(leaf, md);
+      e.key_off = buf.size();
+      e.key_len = key.size();
+      e.value_off = e.key_off + key.size();
+      e.value_len = value.size();
+      buf.insert(buf.end(), key.data(), key.data() + key.size());
+      buf.insert(buf.end(), value.data(), value.data() + value.size());
+    } while (!tree->metadata_unchanged(leaf, i, md));
+    if (!copied) continue;
+
+    entries.push_back(e);
+    if (i < sorted_count) from_sorted = entries.size();
+  }
+
+  assert(tree->epoch.Unprotect().ok());
+
+  auto less = [this](const Entry &a, const Entry &b) {
+    return Slice(&buf[a.key_off], a.key_len).compare(Slice(&buf[b.key_off], b.key_len)) < 0;
+  };
+  std::sort(entries.begin() + from_sorted, entries.end(), less);
+  std::inplace_merge(entries.begin(), entries.begin() + from_sorted, entries.end(), less);
+  if (reverse) std::reverse(entries.begin(), entries.end());
+
+  // figure out where the next leaf is, stopping early if it can't have anything in range
+  // keys in the next leaf to the right are > upper, keys in the next leaf to the left are <= lower
+  // (std::string compares like memcmp, the same order as the tree)
+  if (!reverse) {
+    fence = upper;
+    if (fence.has_value() && end_key.has_value() && *fence >= *end_key) fence = std::nullopt;
+  } else {
+    fence = lower;
+    if (fence.has_value() && start_key.has_value() && *fence < *start_key) fence = std::nullopt;
+  }
+  return true;
+}
+
+}  // namespace pmwcas
@@ -0,0 +1,121 @@
+#include "bztree.h"
+#include "include/pmwcas.h"
+
+namespace pmwcas {
+
+// the workers do nothing that a writer wouldn't, they only do it earlier - a request is just a key to
+// traverse with, so a stale one (its node was replaced meanwhile) costs a traversal and nothing else
+// the soft thresholds are chosen so that a worker's SMO never sets off another one right away:
+// a split leaves both halves well above soft_free_space, and a merge is only done if the merged node
+// is, so the workers don't split what they merged or the other way around
+
+void BzTree::start_smo_workers(uint32_t threads, uint32_t soft_free_space, uint32_t soft_deleted_space) {
+  assert(threads > 0 && smo_workers == nullptr);
+  if (soft_free_space == 0) soft_free_space = min_free_space + body_size() / 8;
+  if (soft_deleted_space == 0) soft_deleted_space = max_deleted_space / 2;
+  assert(soft_free_space >= min_free_space && soft_free_space < body_size());
+  assert(soft_deleted_space <= max_deleted_space);
+
+  smo_workers.reset(new SmoWorkers());
+  for (uint64_t i = 0; i < BZTREE_SMO_QUEUE_SIZE; i++) {
+    smo_workers->requests[i].sequence = i;
+    smo_workers->queued[i] = 0;
+  }
+  smo_workers->head = 0;
+  smo_workers->tail = 0;
+  smo_workers->sleeping = 0;
+  smo_workers->stop = false;
+  smo_workers->soft_free_space = soft_free_space;
+  smo_workers->soft_deleted_space = soft_deleted_space;
+  for (uint32_t i = 0; i < threads; i++) smo_workers->threads.emplace_back(&BzTree::smo_worker, this);
+}
+
+void BzTree::stop_smo_workers() {
+  if (smo_workers == nullptr) return;
+  {
+    std::lock_guard<std::mutex> guard(smo_workers->lock);
+    smo_workers->stop = true;
+  }
+  smo_workers->wake.notify_all();
+  // the workers empty the queue before they stop, there are no writers to fill it anymore
+  for (auto &thread : smo_workers->threads) thread.join();
+  smo_workers.reset();
+}
+
+void BzTree::queue_smo(const Slice &key, NodeRef node) {
+  SmoWorkers *w = smo_workers.get();
+  std::atomic<uint64_t> *queued = &w->queued[(node.word >> 6) % BZTREE_SMO_QUEUE_SIZE];
+  uint64_t empty = 0;
+  if (queued->load(std::memory_order_relaxed) != 0 || !queued->compare_exchange_strong(empty, node.word)) return;
+
+  // the request at head is free once its sequence caught up with head, else the queue is full
+  uint64_t pos = w->head.load(std::memory_order_relaxed);
+  SmoRequest *request;
+  while (1) {
+    request = &w->requests[pos % BZTREE_SMO_QUEUE_SIZE];
+    int64_t diff = (int64_t)request->sequence.load(std::memory_order_acquire) - (int64_t)pos;
+    if (diff == 0) {
+      if (w->head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) break;
+    } else if (diff < 0) {
+      queued->store(0, std::memory_order_relaxed);
+      return;
+    } else {
+      pos = w->head.load(std::memory_order_relaxed);
+    }
+  }
+  request->node = node;
+  request->key.assign(key.data(), key.size());
+  request->sequence.store(pos + 1, std::memory_order_release);
+
+  if (w->sleeping.load() > 0) w->wake.notify_one();
+}
+
+bool BzTree::pop_smo(NodeRef *node, std::string *key) {
+  SmoWorkers *w = smo_workers.get();
+  uint64_t pos = w->tail.load(std::memory_order_relaxed);
+  SmoRequest *request;
+  while (1) {
+    request = &w->requests[pos % BZTREE_SMO_QUEUE_SIZE];
+    int64_t diff = (int64_t)request->sequence.load(std::memory_order_acquire) - (int64_t)(pos + 1);
+    if (diff == 0) {
+      if (w->tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) break;
+    } else if (diff < 0) {
+      return false;
+    } else {
+      pos = w->tail.load(std::memory_order_relaxed);
+    }
+  }
+  *node = request->node;
+  std::swap(*key, request->key);
+  request->sequence.store(pos + BZTREE_SMO_QUEUE_SIZE, std::memory_order_release);
+  return true;
+}
+
+void BzTree::smo_worker() {
+  MwCASMetrics::ThreadInitialize();
+  SmoWorkers *w = smo_workers.get();
+  NodeRef node;
+  std::string key;
+  while (1) {
+    if (!pop_smo(&node, &key)) {
+      std::unique_lock<std::mutex> guard(w->lock);
+      if (w->stop) break;
+      // writers only notify if they see someone sleeping, so a request can slip by, hence the timeout
+      w->sleeping++;
+      w->wake.wait_for(guard, std::chrono::milliseconds(1));
+      w->sleeping--;
+      continue;
+    }
+
+    // the traversal does the SMOs, on the queued node if it's still there, and anything else on the way
+    assert(epoch.Protect().ok());
+    find_leaf_parent(key, true, true);
+    assert(epoch.Unprotect().ok());
+
+    // only now, so that writers passing the node while it's being split don't queue it again
+    uint64_t word = node.word;
+    w->queued[(node.word >> 6) % BZTREE_SMO_QUEUE_SIZE].compare_exchange_strong(word, 0);
+  }
+}
+
+}  // namespace pmwcas
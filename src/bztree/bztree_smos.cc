@@ -3,171 +3,218 @@
 
 namespace pmwcas {
 
-// since SMOs are all infrequent and slow (hopefully), we implement these simply with vectors in main memory
-// note: these strings contain the end null character explicitly in the std::string! this is because we cannot
-// treat values as c strings, because even though our interface has them as c strings, for inner nodes, values
-// are pointers and may have nulls and will therefore be resized incorrectly
-
-// copy all the key value pairs into a vector of pairs and sort them
-std::vector<std::pair<std::string, std::string>> BzTree::copy_out(TOID(struct Node) node_oid) {
-  const struct Node *node = D_RO(node_oid);
-  const struct NodeMetadata *nmd = reinterpret_cast<const struct NodeMetadata*>(&node->body);
-
-  std::vector<std::pair<std::string, std::string>> ret;
-  for (uint16_t i=0; i<node->header.status_word.record_count; i++) {
-    if (!nmd[i].visible) continue;
-    std::string key(&node->body[nmd[i].offset], nmd[i].key_len);
-    std::string val(&node->body[nmd[i].offset + nmd[i].key_len], nmd[i].total_len - nmd[i].key_len);
-    ret.push_back(std::make_pair(key, val));
+// SMOs only read frozen nodes, which stay where they are until the epoch is over, so the records are
+// handled as references into the old nodes and only copied once, straight into the new node
+// the vectors of references are per-thread scratch space, so once a thread has done a few SMOs they don't allocate
+// note: keys and values are binary, and for inner nodes, values are pointers, so never treat them as c strings
+
+thread_local std::vector<BzTree::RecordRef> BzTree::smo_records;
+thread_local std::vector<BzTree::RecordRef> BzTree::smo_parent;
+thread_local std::vector<BzTree::RecordRef> BzTree::smo_merge;
+
+void BzTree::copy_out(NodeRef node_oid, std::vector<RecordRef> *out) {
+  const struct Node *node = node_ptr(node_oid);
+  uint16_t record_count = read_status_word(node).record_count;
+  uint16_t sorted_count = std::min<uint32_t>(node->header.sorted_count, record_count);
+  auto less = [](const RecordRef &a, const RecordRef &b) { return a.key.compare(b.key) < 0; };
+
+  size_t first = out->size();
+  size_t tail = first;
+  for (uint16_t i=0; i<record_count; i++) {
+    // the node is frozen, so no in-place update can start, but one may still be finishing
+    const struct NodeMetadata md = stable_metadata(node, i);
+    if (i == sorted_count) tail = out->size();
+    if (!md.visible) continue;
+    out->push_back(record_ref(node, md));
   }
-  // todo(optimization): only sort ones outside sorted_count?
-  std::sort(ret.begin(), ret.end(), [](auto &a, auto &b) {
-    return a.first < b.first;
-  });
-  return ret;
+  if (sorted_count == record_count) return;
+
+  // the prefix from copy_in is in order already, so only the unsorted tail needs sorting
+  // then the two are merged through the scratch space, since std::inplace_merge would allocate
+  std::sort(out->begin() + tail, out->end(), less);
+  smo_merge.clear();
+  std::merge(out->begin() + first, out->begin() + tail, out->begin() + tail, out->end(),
+      std::back_inserter(smo_merge), less);
+  std::copy(smo_merge.begin(), smo_merge.end(), out->begin() + first);
 }
 
-// copy all the key value pairs back into a new node
-// expects pairs to be sorted
-TOID(struct Node) BzTree::copy_in(std::vector<std::pair<std::string, std::string>> pairs) {
-  // create new node
-  TOID(struct Node) node_oid;
-  POBJ_ZNEW(pop, &node_oid, struct Node);
+NodeRef BzTree::copy_in(const RecordRef *records, size_t count, bool leaf) {
+  // create new node, it only counts as allocated once it's written, see alloc_node
+  NodeRef node_oid = alloc_node(leaf);
 
-  struct Node *node = D_RW(node_oid);
+  struct Node *node = node_ptr(node_oid);
   struct NodeMetadata *new_nmd = reinterpret_cast<struct NodeMetadata*>(&node->body);
 
   // add each key value pair in order to the new node
-  uint16_t record_count = 0;
-  uint32_t offset = sizeof(node->body);
-  for (auto [key, val] : pairs) {
-    new_nmd[record_count].control = 0;
-    new_nmd[record_count].visible = 1;
-    offset -= key.length() + val.length();
-    new_nmd[record_count].offset = offset;
-    new_nmd[record_count].key_len = key.length();
-    new_nmd[record_count].total_len = key.length() + val.length();
-    record_count++;
-
-    // note: key and val include the terminating null in the string itself (so c_str has two terminating nulls)
-    pmemobj_memcpy_persist(pop, &node->body[offset], key.c_str(), key.length());
-    pmemobj_memcpy_persist(pop, &node->body[offset + key.length()], val.c_str(), val.length());
+  // nothing can see the node yet, so it is written with plain stores and made durable all at once below
+  uint32_t offset = body_size();
+  for (size_t r=0; r<count; r++) {
+    const RecordRef &record = records[r];
+    // child ptrs are swapped in place with pmwcas, which needs them word aligned, so pad after them
+    if (!leaf) offset = (offset - record.value.size()) & ~(sizeof(uint64_t) - 1);
+    else offset -= record.value.size();
+    offset -= record.key.size();
+
+    struct NodeMetadata md = {};
+    md.visible = 1;
+    md.out_of_line = record.out_of_line;
+    md.offset = offset;
+    md.key_len = record.key.size();
+    md.total_len = record.key.size() + record.value.size();
+    new_nmd[r] = md;
+
+    memcpy(&node->body[offset], record.key.data(), record.key.size());
+    memcpy(&node->body[offset + record.key.size()], record.value.data(), record.value.size());
+  }
+  node->header.status_word.record_count = count;
+  node->header.status_word.block_size = body_size() - offset;
+  node->header.sorted_count = count;
+
+  // the header and metadata are at the front of the node and the records at the back, the rest is still zero
+  if (!is_dram_node(node_oid)) {
+    flush(node, sizeof(struct NodeHeader) + count * sizeof(struct NodeMetadata));
+    flush(&node->body[offset], body_size() - offset);
+    drain();
+    // and the slot has to be allocated for good before anything can point to the node
+    commit_node(node_oid);
+    drain();
   }
-  node->header.status_word.record_count = record_count;
-  node->header.status_word.block_size = sizeof(node->body) - offset;
-  node->header.sorted_count = record_count;
 
   return node_oid;
 }
 
-TOID(struct Node) BzTree::node_compact(TOID(struct Node) node_oid) {
+NodeRef BzTree::node_compact(NodeRef node_oid) {
   if (DEBUG_PRINT_SMOS) printf("--- compact\n");
   // in and out, real quick, 20 minute adventure
-  return copy_in(copy_out(node_oid));
+  smo_records.clear();
+  copy_out(node_oid, &smo_records);
+  return copy_in(smo_records.data(), smo_records.size(), node_ptr(node_oid)->header.leaf);
 }
 
-std::pair<TOID(struct Node), std::pair<TOID(struct Node), TOID(struct Node)>>
-    BzTree::node_split(std::optional<TOID(struct Node)> parent, TOID(struct Node) node) {
+std::pair<NodeRef, std::pair<NodeRef, NodeRef>>
+    BzTree::node_split(std::optional<NodeRef> parent, NodeRef node, uint16_t index, const Slice &key, bool rightmost) {
   if (DEBUG_PRINT_SMOS) printf("--- split\n");
   // this might be a child, so we don't know that the keys are sorted
-  auto sorted = copy_out(node);
+  std::vector<RecordRef> &sorted = smo_records;
+  sorted.clear();
+  copy_out(node, &sorted);
 
   // need at least 3 nodes to split
   assert(sorted.size() > 2);
 
-  // find the pivot point, halfway through the key sizes - sep will be the the elevated element
-  uint64_t total_key_len = 0;
-  for (auto [key, val] : sorted) total_key_len += key.size();
-  auto sep = sorted.begin();
-  uint64_t seen_key_len = 0;
-  while (sep != sorted.end()) {
-    seen_key_len += sep++->first.size();
-    if (seen_key_len + seen_key_len > total_key_len) break;
+  // keys that only grow, like timestamps and ids, all go to the rightmost node of each level, so halves split off
+  // it would stay half empty for good - the node takes appends if the key is past all of it, or, for leaves, if the
+  // last record inserted is its largest (a background SMO's key is from when it was queued, it may be passed by now)
+  bool leaf = node_ptr(node)->header.leaf;
+  bool append = false;
+  if (rightmost) {
+    append = key.compare(sorted.back().key) >= 0;
+    const struct Node *n = node_ptr(node);
+    uint16_t record_count = read_status_word(n).record_count;
+    if (!append && leaf && n->header.sorted_count < record_count) {
+      const struct NodeMetadata md = stable_metadata(n, record_count - 1);
+      append = md.visible && record_key(n, md) == sorted.back().key;
+    }
   }
-  // should not be possible since at the last element we must have broke, 2x > x
-  assert(sep != sorted.end());
-  // slightly more possible, so guard it just in case
-  if (sep + 1 == sorted.end()) sep--;
 
-  // now things [0, sep) are left, (sep, end) are right
-  std::vector<std::pair<std::string, std::string>> left(sorted.begin(), sep);
-  std::vector<std::pair<std::string, std::string>> right(sep, sorted.end());
-
-  // create new nodes
-  TOID(struct Node) new_left_oid = copy_in(left);
-  TOID(struct Node) new_right_oid = copy_in(right);
+  size_t sep = 0;
+  if (append) {
+    // fill the left node up to append_free_space, the right gets the rest, and at least the last record
+    uint64_t used = 0;
+    while (sep + 1 < sorted.size()) {
+      used += sizeof(struct NodeMetadata) + sorted[sep].key.size() + sorted[sep].value.size();
+      // the padding copy_in may put after the record, at most
+      if (!leaf || sorted[sep].out_of_line) used += sizeof(uint64_t) - 1;
+      if (used + append_free_space() > body_size()) break;
+      sep++;
+    }
+    if (sep == 0) sep = 1;
+  } else {
+    // find the pivot point, halfway through the key sizes - sep will be the the elevated element
+    uint64_t total_key_len = 0;
+    for (auto &r : sorted) total_key_len += r.key.size();
+    uint64_t seen_key_len = 0;
+    while (sep != sorted.size()) {
+      seen_key_len += sorted[sep++].key.size();
+      if (seen_key_len + seen_key_len > total_key_len) break;
+    }
+    // should not be possible since at the last element we must have broke, 2x > x
+    assert(sep != sorted.size());
+    // slightly more possible, so guard it just in case
+    if (sep + 1 == sorted.size()) sep--;
+  }
 
-  // right needs a dummy first key for scanning
-  right.insert(right.begin(), std::make_pair(left.back().first, ""));
+  // now things [0, sep) are left, [sep, end) are right
+  // create new nodes, at the same level as the old one
+  NodeRef new_left_oid = copy_in(sorted.data(), sep, leaf);
+  NodeRef new_right_oid = copy_in(sorted.data() + sep, sorted.size() - sep, leaf);
 
-  // convert pool offsets of new nodes as strings
-  std::string left_ptr((char*)&new_left_oid.oid.off, 8);
-  std::string right_ptr((char*)&new_right_oid.oid.off, 8);
+  // node words of new nodes as values, these live until the parent is written below
+  uint64_t left_off = new_left_oid.word;
+  uint64_t right_off = new_right_oid.word;
+  Slice left_ptr((char*)&left_off, sizeof(left_off));
+  Slice right_ptr((char*)&right_off, sizeof(right_off));
 
   // convert parent
-  std::vector<std::pair<std::string, std::string>> parent_kv;
+  // the left ptr goes where node was, with the key as the rightmost element of the child,
+  // and the right ptr right after it, also with its rightmost key
+  // inner nodes are sorted and have no deleted records, so the rest of the parent is taken as is
+  std::vector<RecordRef> &parent_kv = smo_parent;
+  parent_kv.clear();
+  RecordRef new_left{sorted[sep - 1].key, left_ptr, false};
+  RecordRef new_right{sorted.back().key, right_ptr, false};
   if (parent.has_value()) {
-    // existing parent, so copy most of the keys
-    parent_kv = copy_out(*parent);
-
-    // find the index of the node in the parent
-    // todo(optimization): this is horrible, please fix this by altering the interface to node_split
-    auto i = parent_kv.begin();
-    while (i != parent_kv.end()) {
-      // make this less questionable, first three bits are used by pmwcas, though, ick
-      if (((*(uint64_t*)i->second.c_str()) & ~0x7) == (node.oid.off & ~0x7)) break;
-      i++;
-    }
-    assert(i != parent_kv.end());
-
-    // replacing i, we want the left ptr with the key as the rightmost element of the child
-    *i = std::make_pair(left.back().first, left_ptr);
-
-    // and then inserted after i, we want the right ptr, whose key is the rightmost element of the child
-    parent_kv.insert(i+1, std::make_pair(right.back().first, right_ptr));
+    const struct Node *p = node_ptr(*parent);
+    const struct NodeMetadata *nmd = reinterpret_cast<const struct NodeMetadata*>(p->body);
+    uint16_t record_count = read_status_word(p).record_count;
+    assert(index < record_count);
+    assert(read_child(p, nmd[index]).word == node.word);
+
+    for (uint16_t i=0; i<index; i++) parent_kv.push_back(record_ref(p, nmd[i]));
+    parent_kv.push_back(new_left);
+    parent_kv.push_back(new_right);
+    for (uint16_t i=index+1; i<record_count; i++) parent_kv.push_back(record_ref(p, nmd[i]));
   } else {
     // new parent, probably new root - in this case we need the first one to have a key of ""
-    parent_kv.push_back(std::make_pair(left.back().first, left_ptr));
-    parent_kv.push_back(std::make_pair(right.back().first, right_ptr));
+    parent_kv.push_back(new_left);
+    parent_kv.push_back(new_right);
   }
-  TOID(struct Node) new_parent = copy_in(parent_kv);
+  NodeRef new_parent = copy_in(parent_kv.data(), parent_kv.size(), false);
   return std::make_pair(new_parent, std::make_pair(new_left_oid, new_right_oid));
 }
 
-std::pair<TOID(struct Node), TOID(struct Node)> BzTree::node_merge(TOID(struct Node) parent,
-    TOID(struct Node) merge_left, TOID(struct Node) merge_right) {
+std::pair<NodeRef, NodeRef> BzTree::node_merge(NodeRef parent,
+    NodeRef merge_left, NodeRef merge_right, uint16_t left_index) {
   if (DEBUG_PRINT_SMOS) printf("--- merge\n");
 
-  // copy out parent for modifying
-  auto parent_kv = copy_out(parent);
-
   // copy out both children - we've kept the right value meaningful, so we can just concat them
-  auto sorted_all = copy_out(merge_left);
-  auto sorted_right = copy_out(merge_right);
-  std::move(sorted_right.begin(), sorted_right.end(), std::back_inserter(sorted_all));
-
-  // find the index of the left node in the parent
-  // todo(optimization): this is horrible, please fix this by altering the interface to node_merge
-  auto i = parent_kv.begin();
-  while (i != parent_kv.end()) {
-    // make this less questionable, first three bits are used by pmwcas, though, ick
-    if (((*(uint64_t*)i->second.c_str()) & ~0x7) == (merge_left.oid.off & ~0x7)) break;
-    i++;
-  }
-  assert(i != parent_kv.end());
+  std::vector<RecordRef> &sorted_all = smo_records;
+  sorted_all.clear();
+  copy_out(merge_left, &sorted_all);
+  copy_out(merge_right, &sorted_all);
 
   // make new child and a str-kinda pointer to it
-  TOID(struct Node) new_child = copy_in(sorted_all);
-  std::string child_ptr((char*)&new_child.oid.off, 8);
-
-  // replace right node with pointer to new child, keeping key
-  i[1] = std::make_pair(i[1].first, child_ptr);
+  NodeRef new_child = copy_in(sorted_all.data(), sorted_all.size(), node_ptr(merge_left)->header.leaf);
+  uint64_t child_off = new_child.word;
+
+  // the new parent is the old one without the left node, and with the right node's record pointing to the
+  // new child, keeping its key
+  const struct Node *p = node_ptr(parent);
+  const struct NodeMetadata *nmd = reinterpret_cast<const struct NodeMetadata*>(p->body);
+  uint16_t record_count = read_status_word(p).record_count;
+  assert(left_index + 1 < record_count);
+  assert(read_child(p, nmd[left_index]).word == merge_left.word);
+
+  std::vector<RecordRef> &parent_kv = smo_parent;
+  parent_kv.clear();
+  for (uint16_t i=0; i<record_count; i++) {
+    if (i == left_index) continue;
+    parent_kv.push_back(record_ref(p, nmd[i]));
+    if (i == left_index + 1) parent_kv.back().value = Slice((char*)&child_off, sizeof(child_off));
+  }
 
-  // delete the left node outright
-  parent_kv.erase(i);
-  
   // all done
-  TOID(struct Node) new_parent = copy_in(parent_kv);
+  NodeRef new_parent = copy_in(parent_kv.data(), parent_kv.size(), false);
   return std::make_pair(new_parent, new_child);
 }
 
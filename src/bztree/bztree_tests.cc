@@ -2,21 +2,25 @@
 #include "common/allocator_internal.h"
 #include "bztree.h"
 #include "include/pmwcas.h"
+#include <numeric>
+#include <set>
 #include <random>
+#include <thread>
 
 namespace pmwcas {
 namespace test {
 
 // most test patterns shamelessly borrowed from lab 3's BTree tests
 
-// for testing: key len is 8 and val len is 8, so 10 keys is 16+16*10+8*10 = 256 bytes exactly
-// then minus two for the free threshold
+// for testing: key len is 7 and val len is 7, so 10 keys is 16+16+8*10+14*10 = 252 bytes
+// (header, fingerprints, metadata, records) then minus two for the free threshold
 #define BZTREE_CAPACITY 8
 
 struct SingleThreadTest {
   BzTree tree;
 
-  SingleThreadTest() {
+  SingleThreadTest(uint32_t node_size = BZTREE_NODE_SIZE, bool dram_inner = false)
+      : tree(node_size, BZTREE_MIN_FREE_SPACE, BZTREE_MAX_DELETED_SPACE, dram_inner) {
     MwCASMetrics::ThreadInitialize();
   }
 
@@ -97,6 +101,53 @@ GTEST_TEST(BzTreeTest, CompactSingleLeaf) {
   }
 }
 
+GTEST_TEST(BzTreeTest, UpdateInPlace) {
+  std::unique_ptr<SingleThreadTest> t(new SingleThreadTest());
+
+  // a leaf worth of records, updated far more often than the leaf has space for new records
+  for (auto i = 0; i < BZTREE_CAPACITY; ++i) ASSERT_TRUE(t->tree.insert(_kid(i), _vid(i)));
+  for (auto round = 0; round < 100; ++round) {
+    for (auto i = 0; i < BZTREE_CAPACITY; ++i) {
+      // same size, then shrinking, then back to the size before
+      std::string v = round % 3 == 0 ? _vid(i + round) : (round % 3 == 1 ? _vid(i).substr(0, 3) : _vid(i));
+      ASSERT_TRUE(t->tree.update(_kid(i), v)) << "update of key=" << _kid(i) << " failed";
+      ASSERT_EQ(*t->tree.lookup(_kid(i)), v) << "key=" << _kid(i) << " wrong value";
+    }
+  }
+
+  // the value is overwritten under a view, and the view can tell
+  // (from another thread, since this one can't call into the tree while it holds the view)
+  auto view = t->tree.lookup_view(_kid(0));
+  ASSERT_TRUE(view.valid());
+  ASSERT_EQ(view.value(), _vid(99));
+  std::string updated = _vid(1000);
+  bool ok = false;
+  std::thread([&]() {
+    MwCASMetrics::ThreadInitialize();
+    ok = t->tree.update(_kid(0), updated);
+  }).join();
+  ASSERT_TRUE(ok);
+  ASSERT_FALSE(view.valid());
+  ASSERT_EQ(view.value(), updated) << "update was not in place";
+}
+
+GTEST_TEST(BzTreeTest, UpdateInPlaceVersionWrap) {
+  std::unique_ptr<SingleThreadTest> t(new SingleThreadTest());
+
+  // more same size updates under a view than the version can count, the view must not look unchanged again
+  // (a single record, so the few updates that go out of place don't get the leaf compacted)
+  ASSERT_TRUE(t->tree.insert(_kid(0), _vid(0)));
+  auto view = t->tree.lookup_view(_kid(0));
+  ASSERT_TRUE(view.valid());
+  bool ok = true;
+  std::thread([&]() {
+    MwCASMetrics::ThreadInitialize();
+    for (auto round = 1; round <= 256 && ok; ++round) ok = t->tree.update(_kid(0), _vid(round));
+  }).join();
+  ASSERT_TRUE(ok);
+  ASSERT_FALSE(view.valid()) << "the version wrapped around";
+}
+
 GTEST_TEST(BzTreeTest, LookupSingleSplit) {
   std::unique_ptr<SingleThreadTest> t(new SingleThreadTest());
 
@@ -182,6 +233,558 @@ GTEST_TEST(BzTreeTest, LookupMultiLevelSplitErase) {
   }
 }
 
+GTEST_TEST(BzTreeTest, SmoWorkers) {
+  std::unique_ptr<SingleThreadTest> t(new SingleThreadTest());
+  auto n = 100 * BZTREE_CAPACITY;
+  t->tree.start_smo_workers(2);
+
+  // the workers split, compact and merge while this thread writes
+  for (auto i = 0; i < n; ++i) ASSERT_TRUE(t->tree.insert(_kid(i), _vid(i)));
+  for (auto i = 0; i < n; i += 3) ASSERT_TRUE(t->tree.erase(_kid(i)));
+  for (auto i = 0; i < n; ++i) {
+    auto v = t->tree.lookup(_kid(i));
+    if (i % 3 == 0) {
+      ASSERT_FALSE(v) << "key=" << _kid(i) << " was erased";
+    } else {
+      ASSERT_TRUE(v) << "key=" << _kid(i) << " is missing";
+      ASSERT_EQ(*v, _vid(i)) << "key=" << _kid(i) << " wrong value";
+    }
+  }
+
+  // and the writers take over again once they're stopped
+  t->tree.stop_smo_workers();
+  for (auto i = 0; i < n; i += 3) ASSERT_TRUE(t->tree.insert(_kid(i), _vid(i)));
+  auto it = t->tree.scan(std::nullopt, std::nullopt);
+  for (auto i = 0; i < n; ++i) {
+    ASSERT_TRUE(it.next());
+    ASSERT_EQ(it.key(), _kid(i));
+    ASSERT_EQ(it.value(), _vid(i));
+  }
+  ASSERT_FALSE(it.next());
+}
+
+GTEST_TEST(BzTreeTest, AppendSplits) {
+  std::unique_ptr<SingleThreadTest> t(new SingleThreadTest());
+  auto n = 100 * BZTREE_CAPACITY;
+
+  // even keys in order fill the left nodes of each split, then the odd ones land in between them
+  for (auto i = 0; i < n; i += 2) ASSERT_TRUE(t->tree.insert(_kid(i), _vid(i)));
+  for (auto i = 1; i < n; i += 2) ASSERT_TRUE(t->tree.insert(_kid(i), _vid(i)));
+  for (auto i = 0; i < n; i += 5) ASSERT_TRUE(t->tree.erase(_kid(i)));
+
+  auto it = t->tree.scan(std::nullopt, std::nullopt);
+  for (auto i = 0; i < n; ++i) {
+    if (i % 5 == 0) {
+      ASSERT_FALSE(t->tree.lookup(_kid(i))) << "key=" << _kid(i) << " was erased";
+      continue;
+    }
+    ASSERT_TRUE(it.next());
+    ASSERT_EQ(it.key(), _kid(i));
+    ASSERT_EQ(it.value(), _vid(i));
+  }
+  ASSERT_FALSE(it.next());
+}
+
+GTEST_TEST(BzTreeTest, EraseReinsertSortedPrefix) {
+  std::unique_ptr<SingleThreadTest> t(new SingleThreadTest());
+
+  // after a split, every leaf is entirely in its sorted prefix
+  for (auto i = 0; i < BZTREE_CAPACITY + 3; ++i) t->tree.insert(_kid(i), _vid(i));
+
+  // erased keys in the sorted prefix must not be found, even though their keys are still there
+  for (auto i = 0; i < BZTREE_CAPACITY + 3; i += 2) {
+    ASSERT_TRUE(t->tree.erase(_kid(i))) << "key=" << _kid(i) << " could not be erased";
+    ASSERT_FALSE(t->tree.lookup(_kid(i))) << "key=" << _kid(i) << " was found after erasing";
+    ASSERT_FALSE(t->tree.erase(_kid(i))) << "key=" << _kid(i) << " was erased twice";
+  }
+
+  // re-inserting them puts them in the unsorted tail, which must shadow the deleted ones
+  for (auto i = 0; i < BZTREE_CAPACITY + 3; i += 2) {
+    ASSERT_TRUE(t->tree.insert(_kid(i), _vid(3 * i))) << "key=" << _kid(i) << " could not be re-inserted";
+  }
+
+  for (auto i = 0; i < BZTREE_CAPACITY + 3; ++i) {
+    auto v = t->tree.lookup(_kid(i));
+    ASSERT_TRUE(v) << "key=" << _kid(i) << " is missing";
+    ASSERT_TRUE(*v == _vid(i % 2 ? i : 3 * i)) << "key=" << _kid(i) << " wrong value";
+  }
+}
+
+GTEST_TEST(BzTreeTest, ScanRange) {
+  std::unique_ptr<SingleThreadTest> t(new SingleThreadTest());
+  auto n = 10 * BZTREE_CAPACITY;
+
+  // insert in a shuffled order so leaves have unsorted tails, and erase every third key
+  std::vector<uint64_t> keys(n);
+  std::iota(keys.begin(), keys.end(), 0);
+  std::mt19937_64 engine(0);
+  std::shuffle(keys.begin(), keys.end(), engine);
+  for (auto k : keys) t->tree.insert(_kid(k), _vid(k));
+  for (auto i = 0; i < n; i += 3) t->tree.erase(_kid(i));
+
+  // full forward scan
+  auto expected = 0;
+  auto it = t->tree.scan(std::nullopt, std::nullopt);
+  while (it.next()) {
+    if (expected % 3 == 0) expected++;
+    ASSERT_EQ(it.key(), _kid(expected)) << "forward scan out of order";
+    ASSERT_EQ(it.value(), _vid(expected)) << "key=" << _kid(expected) << " wrong value";
+    expected++;
+  }
+  ASSERT_EQ(expected, n) << "forward scan ended early";
+
+  // bounded reverse scan with a limit, [k000010, k000050) backwards, at most 20 records
+  auto count = 0;
+  expected = 49;
+  auto rit = t->tree.scan(_kid(10), _kid(50), 20, true);
+  while (rit.next()) {
+    if (expected % 3 == 0) expected--;
+    ASSERT_EQ(rit.key(), _kid(expected)) << "reverse scan out of order";
+    expected--;
+    count++;
+  }
+  ASSERT_EQ(count, 20) << "reverse scan did not stop at the limit";
+
+  // empty range
+  ASSERT_FALSE(t->tree.scan(_kid(n), std::nullopt).next()) << "scan past the last key returned something";
+}
+
+GTEST_TEST(BzTreeTest, LookupLargeNodes) {
+  // 16x the default node size, so each leaf holds roughly 16x as many keys before it splits
+  std::unique_ptr<SingleThreadTest> t(new SingleThreadTest(16 * BZTREE_NODE_SIZE));
+  auto n = 16 * 10 * BZTREE_CAPACITY;
+
+  for (auto i = 0; i < n; ++i) {
+    ASSERT_TRUE(t->tree.insert(_kid(i), _vid(i))) << "insert of key=" << _kid(i) << " failed";
+  }
+  for (auto i = 0; i < n; i += 3) ASSERT_TRUE(t->tree.erase(_kid(i)));
+
+  for (auto i = 0; i < n; ++i) {
+    auto v = t->tree.lookup(_kid(i));
+    if (i % 3 == 0) {
+      ASSERT_FALSE(v) << "key=" << _kid(i) << " was erased";
+    } else {
+      ASSERT_TRUE(v) << "key=" << _kid(i) << " is missing";
+      ASSERT_TRUE(v == _vid(i)) << "key=" << _kid(i) << " wrong value";
+    }
+  }
+}
+
+GTEST_TEST(BzTreeTest, LookupUnsortedTail) {
+  // a large node so that a few hundred inserts stay in the root leaf, all in its unsorted tail,
+  // only the first of which have fingerprints
+  std::unique_ptr<SingleThreadTest> t(new SingleThreadTest(16384));
+  auto n = 300;
+  std::vector<uint64_t> ids(n);
+  std::iota(ids.begin(), ids.end(), 0);
+  std::shuffle(ids.begin(), ids.end(), std::mt19937(7));
+  for (auto i : ids) ASSERT_TRUE(t->tree.insert(_kid(i), _vid(i))) << "insert of key=" << _kid(i) << " failed";
+  for (auto i : ids) ASSERT_FALSE(t->tree.insert(_kid(i), _vid(i))) << "key=" << _kid(i) << " inserted twice";
+  for (auto i = 0; i < n; i += 4) ASSERT_TRUE(t->tree.erase(_kid(i)));
+
+  for (auto i = 0; i < 2 * n; ++i) {
+    auto v = t->tree.lookup(_kid(i));
+    if (i >= n || i % 4 == 0) {
+      ASSERT_FALSE(v) << "key=" << _kid(i) << " should not be there";
+    } else {
+      ASSERT_TRUE(v) << "key=" << _kid(i) << " is missing";
+      ASSERT_EQ(*v, _vid(i)) << "key=" << _kid(i) << " wrong value";
+    }
+  }
+}
+
+GTEST_TEST(BzTreeTest, LookupLargeValues) {
+  std::unique_ptr<SingleThreadTest> t(new SingleThreadTest());
+  auto n = 10 * BZTREE_CAPACITY;
+  // far larger than a node, so these are all out of line, except for the small updates below
+  auto large = [](uint64_t i, char c) { return _vid(i) + std::string(BZTREE_NODE_SIZE + 7 * i, c); };
+
+  // enough to split, so the blobs have to survive being copied into new leaves
+  for (auto i = 0; i < n; ++i) {
+    ASSERT_TRUE(t->tree.insert(_kid(i), large(i, 'a'))) << "insert of key=" << _kid(i) << " failed";
+  }
+  for (auto i = 0; i < n; i += 2) {
+    ASSERT_TRUE(t->tree.update(_kid(i), i % 4 ? _vid(i) : large(i, 'b'))) << "update of key=" << _kid(i) << " failed";
+  }
+  for (auto i = 0; i < n; i += 3) ASSERT_TRUE(t->tree.erase(_kid(i)));
+
+  auto expected = [&](uint64_t i) { return i % 2 ? large(i, 'a') : (i % 4 ? _vid(i) : large(i, 'b')); };
+  for (auto i = 0; i < n; ++i) {
+    auto v = t->tree.lookup(_kid(i));
+    if (i % 3 == 0) {
+      ASSERT_FALSE(v) << "key=" << _kid(i) << " was erased";
+    } else {
+      ASSERT_TRUE(v) << "key=" << _kid(i) << " is missing";
+      ASSERT_TRUE(*v == expected(i)) << "key=" << _kid(i) << " wrong value";
+    }
+  }
+
+  auto it = t->tree.scan(std::nullopt, std::nullopt);
+  for (auto i = 0; i < n; ++i) {
+    if (i % 3 == 0) continue;
+    ASSERT_TRUE(it.next());
+    ASSERT_EQ(it.key(), _kid(i));
+    ASSERT_EQ(it.value(), expected(i)) << "key=" << _kid(i) << " wrong value in scan";
+  }
+  ASSERT_FALSE(it.next());
+}
+
+GTEST_TEST(BzTreeTest, LookupView) {
+  std::unique_ptr<SingleThreadTest> t(new SingleThreadTest());
+  auto n = 10 * BZTREE_CAPACITY;
+  // odd keys get out of line values, so both kinds of records are viewed
+  auto value = [](uint64_t i) { return i % 2 ? _vid(i) + std::string(BZTREE_NODE_SIZE, 'x') : _vid(i); };
+
+  for (auto i = 0; i < n; i += 2) {
+    ASSERT_TRUE(t->tree.insert(_kid(i), value(i))) << "insert of key=" << _kid(i) << " failed";
+  }
+  for (auto i = 1; i < n; i += 2) {
+    ASSERT_TRUE(t->tree.insert(_kid(i), value(i))) << "insert of key=" << _kid(i) << " failed";
+  }
+  for (auto i = 0; i < n; i += 3) ASSERT_TRUE(t->tree.erase(_kid(i)));
+
+  for (auto i = 0; i < n; ++i) {
+    auto view = t->tree.lookup_view(_kid(i));
+    if (i % 3 == 0) {
+      ASSERT_FALSE(view) << "key=" << _kid(i) << " was erased";
+    } else {
+      ASSERT_TRUE(view) << "key=" << _kid(i) << " is missing";
+      ASSERT_EQ(view.value(), value(i)) << "key=" << _kid(i) << " wrong value";
+    }
+  }
+
+  // a moved view keeps the value, and only the last owner unprotects
+  {
+    auto view = t->tree.lookup_view(_kid(1));
+    auto moved = std::move(view);
+    ASSERT_TRUE(moved.found());
+    ASSERT_EQ(moved.value(), value(1));
+  }
+  ASSERT_TRUE(t->tree.update(_kid(1), _vid(1)));
+  ASSERT_EQ(t->tree.lookup_view(_kid(1)).value(), _vid(1));
+}
+
+GTEST_TEST(BzTreeTest, MultiGetInsert) {
+  std::unique_ptr<SingleThreadTest> t(new SingleThreadTest());
+  auto n = 10 * BZTREE_CAPACITY;
+  // every fifth value is out of line, so some records take two descriptor words
+  auto value = [](uint64_t i) { return i % 5 ? _vid(i) : _vid(i) + std::string(BZTREE_NODE_SIZE, 'x'); };
+
+  // a few are in the tree already, and the batch is shuffled and has repeats
+  for (auto i = 0; i < n; i += 7) ASSERT_TRUE(t->tree.insert(_kid(i), "old"));
+  std::vector<std::string> keys, values;
+  for (auto i = 0; i < n; ++i) keys.push_back(_kid(i)), values.push_back(value(i));
+  for (auto i = 0; i < n; i += 11) keys.push_back(_kid(i)), values.push_back("repeat");
+  std::vector<size_t> order(keys.size());
+  std::iota(order.begin(), order.end(), 0);
+  std::shuffle(order.begin(), order.end(), std::mt19937(42));
+
+  std::vector<std::pair<Slice, Slice>> batch;
+  for (auto j : order) batch.emplace_back(keys[j], values[j]);
+  auto inserted = t->tree.multi_insert(batch);
+  ASSERT_EQ(inserted.size(), batch.size());
+  // the first of repeated keys in batch order wins
+  std::set<std::string> seen;
+  std::vector<bool> first(batch.size());
+  for (size_t b = 0; b < batch.size(); ++b) first[b] = seen.insert(keys[order[b]]).second;
+  for (size_t b = 0; b < batch.size(); ++b) {
+    auto j = order[b];
+    bool expected = first[b] && std::stoul(keys[j].substr(1)) % 7 != 0;
+    ASSERT_EQ(inserted[b], expected) << "key=" << keys[j];
+  }
+
+  // gets in reverse, with some keys that were never inserted
+  std::vector<std::string> get_keys;
+  for (auto i = n + 10; i-- > 0;) get_keys.push_back(_kid(i));
+  std::vector<Slice> get_batch(get_keys.begin(), get_keys.end());
+  auto got = t->tree.multi_get(get_batch);
+  ASSERT_EQ(got.size(), get_batch.size());
+  for (size_t b = 0; b < got.size(); ++b) {
+    auto i = n + 10 - 1 - b;
+    if (i >= (size_t)n) {
+      ASSERT_FALSE(got[b]) << "key=" << _kid(i) << " was never inserted";
+    } else {
+      ASSERT_TRUE(got[b]) << "key=" << _kid(i) << " is missing";
+      auto expected = i % 7 ? value(i) : "old";
+      // a repeat may have been the first copy of its key in the batch
+      if (i % 11 == 0 && *got[b] == "repeat") expected = "repeat";
+      ASSERT_EQ(*got[b], expected) << "key=" << _kid(i) << " wrong value";
+    }
+  }
+}
+
+GTEST_TEST(BzTreeTest, BulkLoad) {
+  std::unique_ptr<SingleThreadTest> t(new SingleThreadTest());
+  auto n = 100 * BZTREE_CAPACITY;
+  // every fifth value is out of line
+  auto value = [](uint64_t i) { return i % 5 ? _vid(i) : _vid(i) + std::string(BZTREE_NODE_SIZE, 'x'); };
+
+  // from even ids, so there's room to insert the odd ones after
+  uint64_t i = 0;
+  std::string key, val;
+  auto next = [&](Slice *k, Slice *v) {
+    if (i >= (uint64_t)n) return false;
+    key = _kid(i), val = value(i), i += 2;
+    *k = key, *v = val;
+    return true;
+  };
+  ASSERT_TRUE(t->tree.bulk_load(next, 0.7));
+
+  // a loaded tree isn't empty anymore
+  i = 0;
+  ASSERT_FALSE(t->tree.bulk_load(next));
+
+  for (auto j = 1; j < n; j += 2) {
+    ASSERT_TRUE(t->tree.insert(_kid(j), value(j))) << "insert of key=" << _kid(j) << " failed";
+  }
+  for (auto j = 0; j < n; j += 3) ASSERT_TRUE(t->tree.erase(_kid(j)));
+
+  auto it = t->tree.scan(std::nullopt, std::nullopt);
+  for (auto j = 0; j < n; ++j) {
+    if (j % 3 == 0) {
+      ASSERT_FALSE(t->tree.lookup(_kid(j))) << "key=" << _kid(j) << " was erased";
+      continue;
+    }
+    auto v = t->tree.lookup(_kid(j));
+    ASSERT_TRUE(v) << "key=" << _kid(j) << " is missing";
+    ASSERT_EQ(*v, value(j)) << "key=" << _kid(j) << " wrong value";
+    ASSERT_TRUE(it.next());
+    ASSERT_EQ(it.key(), _kid(j));
+  }
+  ASSERT_FALSE(it.next());
+}
+
+GTEST_TEST(BzTreeTest, DramInnerNodes) {
+  std::unique_ptr<SingleThreadTest> t(new SingleThreadTest(BZTREE_NODE_SIZE, true));
+  auto n = 100 * BZTREE_CAPACITY;
+  auto value = [](uint64_t i) { return i % 5 ? _vid(i) : _vid(i) + std::string(BZTREE_NODE_SIZE, 'x'); };
+
+  // shuffled, and then erased, so leaves split, compact and merge under inner nodes in dram
+  std::vector<uint64_t> ids(n);
+  std::iota(ids.begin(), ids.end(), 0);
+  std::shuffle(ids.begin(), ids.end(), std::mt19937(42));
+  for (auto j : ids) ASSERT_TRUE(t->tree.insert(_kid(j), value(j))) << "insert of key=" << _kid(j) << " failed";
+  for (auto j = 0; j < n; j += 3) ASSERT_TRUE(t->tree.erase(_kid(j)));
+  for (auto j = 1; j < n; j += 3) ASSERT_TRUE(t->tree.update(_kid(j), _vid(j + 1)));
+
+  auto it = t->tree.scan(std::nullopt, std::nullopt);
+  for (auto j = 0; j < n; ++j) {
+    if (j % 3 == 0) {
+      ASSERT_FALSE(t->tree.lookup(_kid(j))) << "key=" << _kid(j) << " was erased";
+      continue;
+    }
+    auto v = t->tree.lookup(_kid(j));
+    ASSERT_TRUE(v) << "key=" << _kid(j) << " is missing";
+    ASSERT_EQ(*v, j % 3 == 1 ? _vid(j + 1) : value(j)) << "key=" << _kid(j) << " wrong value";
+    ASSERT_TRUE(it.next());
+    ASSERT_EQ(it.key(), _kid(j));
+  }
+  ASSERT_FALSE(it.next());
+}
+
+#ifdef PMDK
+// only a tree in a pool can be opened again
+GTEST_TEST(BzTreeTest, DramInnerNodesReopen) {
+  MwCASMetrics::ThreadInitialize();
+  auto n = 100 * BZTREE_CAPACITY;
+  auto value = [](uint64_t i) { return i % 5 ? _vid(i) : _vid(i) + std::string(BZTREE_NODE_SIZE, 'x'); };
+
+  std::unique_ptr<BzTree> tree(new BzTree(BZTREE_NODE_SIZE, BZTREE_MIN_FREE_SPACE, BZTREE_MAX_DELETED_SPACE, true));
+  for (auto j = 0; j < n; j += 2) ASSERT_TRUE(tree->insert(_kid(j), value(j)));
+  for (auto j = 0; j < n; j += 6) ASSERT_TRUE(tree->erase(_kid(j)));
+
+  // the inner nodes go away with the tree, and only the leaves are left in the pool to open it from
+  tree.reset();
+  tree.reset(new BzTree(BZTREE_NODE_SIZE, BZTREE_MIN_FREE_SPACE, BZTREE_MAX_DELETED_SPACE, true));
+  for (auto j = 1; j < n; j += 2) ASSERT_TRUE(tree->insert(_kid(j), value(j)));
+
+  auto it = tree->scan(std::nullopt, std::nullopt);
+  for (auto j = 0; j < n; ++j) {
+    if (j % 6 == 0) {
+      ASSERT_FALSE(tree->lookup(_kid(j))) << "key=" << _kid(j) << " was erased";
+      continue;
+    }
+    auto v = tree->lookup(_kid(j));
+    ASSERT_TRUE(v) << "key=" << _kid(j) << " is missing";
+    ASSERT_EQ(*v, value(j)) << "key=" << _kid(j) << " wrong value";
+    ASSERT_TRUE(it.next());
+    ASSERT_EQ(it.key(), _kid(j));
+  }
+  ASSERT_FALSE(it.next());
+
+  tree->destroy();
+  Thread::ClearRegistry();
+}
+
+GTEST_TEST(BzTreeTest, Reopen) {
+  MwCASMetrics::ThreadInitialize();
+  auto n = 100 * BZTREE_CAPACITY;
+  auto check = [&](BzTree *tree) {
+    for (auto j = 0; j < n; ++j) {
+      auto v = tree->lookup(_kid(j));
+      if (j % 6 == 0) {
+        ASSERT_FALSE(v) << "key=" << _kid(j) << " was erased";
+      } else {
+        ASSERT_TRUE(v) << "key=" << _kid(j) << " is missing";
+        ASSERT_EQ(*v, _vid(j)) << "key=" << _kid(j) << " wrong value";
+      }
+    }
+  };
+
+  std::unique_ptr<BzTree> tree(new BzTree(BZTREE_NODE_SIZE, BZTREE_MIN_FREE_SPACE, BZTREE_MAX_DELETED_SPACE));
+  for (auto j = 0; j < n; j += 2) ASSERT_TRUE(tree->insert(_kid(j), _vid(j)));
+  for (auto j = 0; j < n; j += 6) ASSERT_TRUE(tree->erase(_kid(j)));
+
+  // the whole tree is in the pool, so it's opened as it was, and keeps working
+  tree.reset();
+  tree.reset(new BzTree(BZTREE_NODE_SIZE, BZTREE_MIN_FREE_SPACE, BZTREE_MAX_DELETED_SPACE));
+  for (auto j = 1; j < n; j += 2) ASSERT_TRUE(tree->insert(_kid(j), _vid(j)));
+  check(tree.get());
+
+  tree.reset();
+  tree.reset(new BzTree(BZTREE_NODE_SIZE, BZTREE_MIN_FREE_SPACE, BZTREE_MAX_DELETED_SPACE));
+  check(tree.get());
+
+  tree->destroy();
+  Thread::ClearRegistry();
+}
+
+GTEST_TEST(BzTreeTest, ReopenDirtyChildren) {
+  MwCASMetrics::ThreadInitialize();
+  auto n = 100 * BZTREE_CAPACITY;
+  std::unique_ptr<BzTree> tree(new BzTree(BZTREE_NODE_SIZE, BZTREE_MIN_FREE_SPACE, BZTREE_MAX_DELETED_SPACE));
+  for (auto j = 0; j < n; j += 2) ASSERT_TRUE(tree->insert(_kid(j), _vid(j)));
+  tree.reset();
+
+  // the pmwcas that swapped a child in can leave the child ptr dirty in the pool, which must not make the
+  // subtree under it look unreachable when the pool is opened again
+  PMEMobjpool *pop = reinterpret_cast<PMDKAllocator*>(Allocator::Get())->GetPool();
+  struct BzPMDKRootObj *rootobj = D_RW(POBJ_ROOT(pop, struct BzPMDKRootObj));
+  ASSERT_GT(D_RO(rootobj->metadata)->height, 1u);
+  struct Node *root = reinterpret_cast<struct Node*>((char*)pop + D_RO(rootobj->metadata)->root_node.word);
+  const struct NodeMetadata *nmd = reinterpret_cast<const struct NodeMetadata*>(root->body);
+  for (uint16_t i = 0; i < root->header.status_word.record_count; ++i) {
+    if (!nmd[i].visible) continue;
+    *reinterpret_cast<uint64_t*>(&root->body[nmd[i].offset + nmd[i].key_len]) |= Descriptor::kDirtyFlag;
+  }
+
+  // the nodes of the tree weren't freed, so the new ones don't overwrite them
+  tree.reset(new BzTree(BZTREE_NODE_SIZE, BZTREE_MIN_FREE_SPACE, BZTREE_MAX_DELETED_SPACE));
+  for (auto j = 1; j < n; j += 2) ASSERT_TRUE(tree->insert(_kid(j), _vid(j)));
+  for (auto j = 0; j < n; ++j) {
+    auto v = tree->lookup(_kid(j));
+    ASSERT_TRUE(v) << "key=" << _kid(j) << " is missing";
+    ASSERT_EQ(*v, _vid(j)) << "key=" << _kid(j) << " wrong value";
+  }
+
+  tree->destroy();
+  Thread::ClearRegistry();
+}
+
+GTEST_TEST(BzTreeTest, ReopenTornUpdate) {
+  MwCASMetrics::ThreadInitialize();
+  std::unique_ptr<BzTree> tree(new BzTree(BZTREE_NODE_SIZE, BZTREE_MIN_FREE_SPACE, BZTREE_MAX_DELETED_SPACE));
+  for (auto j = 0; j < 3; ++j) ASSERT_TRUE(tree->insert(_kid(j), _vid(j)));
+  tree.reset();
+
+  // make the pool look like the process died in the middle of an in-place update of every record: the value is
+  // torn, the version odd, and the old value in the UpdateLog - the pmwcas that made the version odd can leave
+  // its words dirty in the pool, here both for the first record, and only one of them for the others
+  PMEMobjpool *pop = reinterpret_cast<PMDKAllocator*>(Allocator::Get())->GetPool();
+  struct BzPMDKRootObj *rootobj = D_RW(POBJ_ROOT(pop, struct BzPMDKRootObj));
+  uint64_t leaf_word = D_RO(rootobj->metadata)->root_node.word;
+  struct Node *leaf = reinterpret_cast<struct Node*>((char*)pop + leaf_word);
+  uint64_t *nmd = reinterpret_cast<uint64_t*>(leaf->body);
+  struct UpdateLog *log = D_RW(rootobj->update_log);
+  for (uint16_t i = 0; i < 3; ++i) {
+    struct NodeMetadata md = *reinterpret_cast<struct NodeMetadata*>(&nmd[i]);
+    struct NodeMetadata odd = md;
+    odd.version++;
+    char *value = &leaf->body[md.offset + md.key_len];
+    uint32_t len = md.total_len - md.key_len;
+
+    auto *entry = reinterpret_cast<struct UpdateLogEntry*>(&log->entries[i * log->entry_size]);
+    entry->node = leaf_word;
+    entry->index = i;
+    memcpy(entry->value, value, len);
+    memset(value, 'x', len);
+    entry->metadata = *(uint64_t*)&md | (i != 1 ? Descriptor::kDirtyFlag : 0);
+    nmd[i] = *(uint64_t*)&odd | (i != 2 ? Descriptor::kDirtyFlag : 0);
+  }
+
+  // the old values are back, and the records can be updated again
+  tree.reset(new BzTree(BZTREE_NODE_SIZE, BZTREE_MIN_FREE_SPACE, BZTREE_MAX_DELETED_SPACE));
+  for (auto j = 0; j < 3; ++j) {
+    auto v = tree->lookup(_kid(j));
+    ASSERT_TRUE(v) << "key=" << _kid(j) << " is missing";
+    ASSERT_EQ(*v, _vid(j)) << "key=" << _kid(j) << " wrong value";
+    ASSERT_TRUE(tree->update(_kid(j), _vid(j + 10))) << "update of key=" << _kid(j) << " failed";
+    ASSERT_EQ(*tree->lookup(_kid(j)), _vid(j + 10)) << "key=" << _kid(j) << " wrong value";
+  }
+
+  tree->destroy();
+  Thread::ClearRegistry();
+}
+#endif  // PMDK
+
+GTEST_TEST(BzTreeTest, BulkLoadUnsorted) {
+  std::unique_ptr<SingleThreadTest> t(new SingleThreadTest());
+  std::vector<std::string> keys = {_kid(1), _kid(2), _kid(4), _kid(3)};
+  size_t i = 0;
+  auto next = [&](Slice *k, Slice *v) {
+    if (i >= keys.size()) return false;
+    *k = keys[i], *v = keys[i];
+    i++;
+    return true;
+  };
+  ASSERT_FALSE(t->tree.bulk_load(next));
+
+  // nothing was loaded, so the tree still takes a load
+  keys.pop_back();
+  i = 0;
+  ASSERT_TRUE(t->tree.bulk_load(next));
+  ASSERT_TRUE(t->tree.lookup(_kid(4)));
+  ASSERT_FALSE(t->tree.lookup(_kid(3)));
+}
+
+GTEST_TEST(BzTreeTest, BinaryKeysAndValues) {
+  std::unique_ptr<SingleThreadTest> t(new SingleThreadTest());
+  auto n = 10 * BZTREE_CAPACITY;
+
+  // big endian integers are full of zero bytes, and sort numerically by memcmp
+  auto key = [](uint32_t i) {
+    char buf[4] = {(char)(i >> 24), (char)(i >> 16), (char)(i >> 8), (char)i};
+    return std::string(buf, 4);
+  };
+  auto value = [](uint32_t i) { return std::string("\0v\0", 3) + std::to_string(i); };
+
+  // insert in a scrambled order, the keys are multiples of 256 so the low byte is always zero
+  for (auto i = 0; i < n; ++i) {
+    uint32_t j = (i * 37) % n;
+    ASSERT_TRUE(t->tree.insert(key(j << 8), value(j))) << "insert of key=" << j << " failed";
+  }
+  // a key that is a prefix of another one sorts before it
+  ASSERT_TRUE(t->tree.insert(key(0).substr(0, 3), "prefix"));
+
+  for (auto i = 0; i < n; ++i) {
+    auto v = t->tree.lookup(key(i << 8));
+    ASSERT_TRUE(v) << "key=" << i << " is missing";
+    ASSERT_TRUE(*v == value(i)) << "key=" << i << " wrong value";
+  }
+  ASSERT_FALSE(t->tree.lookup(key(1))) << "found a key that differs only in a zero byte";
+  ASSERT_TRUE(t->tree.lookup(key(0).substr(0, 3)) == std::string("prefix"));
+
+  auto it = t->tree.scan(std::nullopt, std::nullopt);
+  ASSERT_TRUE(it.next());
+  ASSERT_TRUE(it.key() == key(0).substr(0, 3)) << "the prefix key is not first";
+  for (auto i = 0; i < n; ++i) {
+    ASSERT_TRUE(it.next());
+    ASSERT_TRUE(it.key() == key(i << 8)) << "scan out of order at key=" << i;
+    ASSERT_TRUE(it.value() == value(i)) << "key=" << i << " wrong value in scan";
+  }
+  ASSERT_FALSE(it.next());
+}
+
 GTEST_TEST(BzTreeTest, LookupRandomNonRepeating) {
   std::unique_ptr<SingleThreadTest> t(new SingleThreadTest());
   auto n = 10 * BZTREE_CAPACITY;
@@ -408,7 +408,7 @@ class PMDKAllocator : IAllocator {
                                                      const char *layout_name,
                                                      uint64_t pool_size) {
     return [pool_name, layout_name, pool_size](IAllocator *&allocator) {
-      int n = posix_memalign(reinterpret_cast<void **>(&allocator), kCacheLineSize, sizeof(DefaultAllocator));
+      int n = posix_memalign(reinterpret_cast<void **>(&allocator), kCacheLineSize, sizeof(PMDKAllocator));
       if (n || !allocator) return Status::Corruption("Out of memory");
 
       PMEMobjpool *tmp_pool;
@@ -475,6 +475,14 @@ class PMDKAllocator : IAllocator {
     pmemobj_persist(pop, ptr, size);
   }
 
+  void FlushPtr(const void *ptr, uint64_t size){
+    pmemobj_flush(pop, ptr, size);
+  }
+
+  void Drain(){
+    pmemobj_drain(pop);
+  }
+
   void CAlloc(void **mem, size_t count, size_t size) override {
     // not implemented
   }
@@ -24,6 +24,7 @@ struct MwCASMetrics {
     bailed_help_count += other.bailed_help_count;
 
     descriptor_alloc_count += other.descriptor_alloc_count;
+    descriptor_steal_count += other.descriptor_steal_count;
     return *this;
   }
 
@@ -37,6 +38,7 @@ struct MwCASMetrics {
     bailed_help_count -= other.bailed_help_count;
 
     descriptor_alloc_count -= other.descriptor_alloc_count;
+    descriptor_steal_count -= other.descriptor_steal_count;
     return *this;
   }
 
@@ -57,7 +59,8 @@ struct MwCASMetrics {
         descriptor_scavenge_count(0),
         help_attempt_count(0),
         bailed_help_count(0),
-        descriptor_alloc_count(0) {
+        descriptor_alloc_count(0),
+        descriptor_steal_count(0) {
   }
 
   uint64_t GetUpdateAttemptCount() {
@@ -79,6 +82,7 @@ struct MwCASMetrics {
     std::cout << "> BailedHelpAttempts " << bailed_help_count << std::endl;
     std::cout << "> DecsriptorAllocations " <<
       descriptor_alloc_count << std::endl;
+    std::cout << "> DescriptorSteals " << descriptor_steal_count << std::endl;
   }
 
   // Initialize the global CoreLocal container that encapsulates an array
@@ -134,6 +138,10 @@ struct MwCASMetrics {
     if (enabled) ++MyMetric()->descriptor_alloc_count;
   }
 
+  inline static void AddDescriptorSteal() {
+    if (enabled) ++MyMetric()->descriptor_steal_count;
+  }
+
   inline static void Sum(MwCASMetrics &sum) {
     for (uint32_t i = 0; (i < instance.NumberOfObjects()) && enabled; ++i) {
       auto *thread_metric = *instance.GetObject(i);
@@ -159,7 +167,7 @@ struct MwCASMetrics {
   uint64_t bailed_help_count;
 
   uint64_t descriptor_alloc_count;
-  uint64_t padding;
+  uint64_t descriptor_steal_count;
 };
 
 }  // namespace pmwcas
@@ -5,6 +5,10 @@
 #include <Windows.h>
 #undef ERROR // Avoid collision of ERROR definition in Windows.h with glog
 #endif
+#include <algorithm>
+#include <mutex>
+#include <thread>
+#include <vector>
 #include "include/pmwcas.h"
 #include "mwcas/mwcas.h"
 #include "util/atomics.h"
@@ -14,10 +18,88 @@ namespace pmwcas {
 bool MwCASMetrics::enabled = false;
 CoreLocal<MwCASMetrics*> MwCASMetrics::instance;
 
+namespace {
+
+/// Identifies the thread holding a partition, see DescriptorPartition::owner.
+/// A thread gets a token the first time it needs one and hands it on when it
+/// exits. The generation is odd while a thread has the token, so a partition
+/// still held under an older generation belongs to a thread that exited.
+/// Tokens are never freed, there are only as many as threads were ever alive
+/// at once.
+struct OwnerToken {
+  std::atomic<uint64_t> generation;
+};
+
+/// The owner value keeps the low bits of the generation above the token's
+/// address. A generation that wrapped around only makes a partition look held
+/// when it isn't, which is safe.
+const uint32_t kOwnerGenerationShift = 48;
+
+std::mutex owner_token_mutex;
+std::vector<OwnerToken*>* free_owner_tokens = new std::vector<OwnerToken*>;
+
+struct ThreadOwner {
+  ThreadOwner() {
+    std::lock_guard<std::mutex> guard(owner_token_mutex);
+    if(free_owner_tokens->empty()) {
+      token = new OwnerToken;
+      token->generation = 0;
+    } else {
+      token = free_owner_tokens->back();
+      free_owner_tokens->pop_back();
+    }
+    RAW_CHECK(((uint64_t)token >> kOwnerGenerationShift) == 0,
+              "owner token address too high");
+    uint64_t generation = token->generation.fetch_add(1) + 1;
+    value = (uint64_t)token | (generation << kOwnerGenerationShift);
+  }
+
+  ~ThreadOwner() {
+    // whatever this thread held is up for grabs from now on
+    token->generation.fetch_add(1, std::memory_order_release);
+    std::lock_guard<std::mutex> guard(owner_token_mutex);
+    free_owner_tokens->push_back(token);
+  }
+
+  OwnerToken* token;
+  uint64_t value;
+};
+
+thread_local ThreadOwner thread_owner;
+
+/// Whether [owner] is a thread that is still alive
+bool IsLiveOwner(uint64_t owner) {
+  if(owner == 0) return false;
+  OwnerToken* token =
+      (OwnerToken*)(owner & ((1ull << kOwnerGenerationShift) - 1));
+  uint64_t generation = token->generation.load(std::memory_order_acquire);
+  return (owner >> kOwnerGenerationShift) ==
+      ((generation << kOwnerGenerationShift) >> kOwnerGenerationShift);
+}
+
+std::atomic<uint64_t> next_pool_id(1);
+
+/// Free descriptors a partition keeps to itself at most, small enough that
+/// more threads than partitions don't keep all of them away from each other
+const uint32_t kPartitionFreeListSize = 16;
+
+/// The partition this thread holds in the pool it last allocated from
+thread_local uint64_t tls_pool_id = 0;
+thread_local DescriptorPartition* tls_part = nullptr;
+
+}  // namespace
+
 DescriptorPartition::DescriptorPartition(EpochManager* epoch,
     DescriptorPool* pool)
     : desc_pool(pool), allocated_desc(0) {
   free_list = nullptr;
+  free_count = 0;
+  free_keep = std::max(1u, std::min(pool->GetDescPerPartition() / 4,
+                                    kPartitionFreeListSize));
+  shared_list = nullptr;
+  desc_count = 0;
+  owner = 0;
+  next_overflow = nullptr;
   garbage_list = new GarbageListUnsafe;
   auto s = garbage_list->Initialize(epoch, pool->GetDescPerPartition());
   RAW_CHECK(s.ok(), "garbage list initialization failure");
@@ -28,13 +110,73 @@ DescriptorPartition::~DescriptorPartition() {
   delete garbage_list;
 }
 
+void DescriptorPartition::Free(Descriptor* desc) {
+  if(free_count < FreeListSize()) {
+    desc->next_ptr_ = free_list;
+    free_list = desc;
+    ++free_count;
+  } else {
+    PushShared(desc, desc);
+  }
+}
+
+void DescriptorPartition::FreeList(Descriptor* head) {
+  uint32_t keep = FreeListSize();
+  while(head && free_count < keep) {
+    Descriptor* next = head->next_ptr_;
+    head->next_ptr_ = free_list;
+    free_list = head;
+    ++free_count;
+    head = next;
+  }
+  if(head) {
+    Descriptor* tail = head;
+    while(tail->next_ptr_) {
+      tail = tail->next_ptr_;
+    }
+    PushShared(head, tail);
+  }
+}
+
+uint32_t DescriptorPartition::FreeListSize() {
+  return desc_pool->HasStarvingThreads() ? 1 : free_keep;
+}
+
+void DescriptorPartition::ShareFreeList(uint32_t keep) {
+  Descriptor** head = &free_list;
+  for(uint32_t i = 0; i < keep && *head; ++i) {
+    head = &(*head)->next_ptr_;
+  }
+  if(!*head) return;
+  Descriptor* tail = *head;
+  uint32_t count = 1;
+  for(; tail->next_ptr_; tail = tail->next_ptr_) {
+    ++count;
+  }
+  PushShared(*head, tail);
+  *head = nullptr;
+  free_count -= count;
+}
+
+void DescriptorPartition::PushShared(Descriptor* head, Descriptor* tail) {
+  Descriptor* old_head = shared_list.load(std::memory_order_relaxed);
+  do {
+    tail->next_ptr_ = old_head;
+  } while(!shared_list.compare_exchange_weak(old_head, head,
+      std::memory_order_release, std::memory_order_relaxed));
+}
+
 DescriptorPool::DescriptorPool(
     uint32_t requested_pool_size, uint32_t requested_partition_count, bool enable_stats)
     : pool_size_(0),
       desc_per_partition_(0),
       partition_count_(0),
       partition_table_(nullptr),
-      next_partition_(0) {
+      next_partition_(0),
+      overflow_partitions_(nullptr),
+      starving_(0),
+      id_(next_pool_id++),
+      recovery_micros_(0) {
 
   MwCASMetrics::enabled = enable_stats;
   if (enable_stats) {
@@ -88,7 +230,9 @@ DescriptorPool::DescriptorPool(
 }
 
 #ifdef PMEM
-void DescriptorPool::Recovery(bool enable_stats) {
+void DescriptorPool::Recovery(bool enable_stats, uint32_t recovery_threads,
+                              Descriptor::FreeCallback free_callback) {
+  uint64_t start = Environment::Get()->NowMicros();
   MwCASMetrics::enabled = enable_stats;
 
   auto s = MwCASMetrics::Initialize();
@@ -98,6 +242,12 @@ void DescriptorPool::Recovery(bool enable_stats) {
   s = epoch_.Initialize();
   RAW_CHECK(s.ok(), "epoch initialization failure");
 
+  // the partitions and whoever held them went away with the process
+  next_partition_ = 0;
+  overflow_partitions_ = nullptr;
+  starving_ = 0;
+  id_ = next_pool_id++;
+
   RAW_CHECK(partition_count_ > 0, "invalid partition count");
   partition_table_ = (DescriptorPartition *) malloc(sizeof(DescriptorPartition) * partition_count_);
   RAW_CHECK(nullptr != partition_table_, "out of memory");
@@ -108,9 +258,10 @@ void DescriptorPool::Recovery(bool enable_stats) {
 
   RAW_CHECK(descriptors_, "invalid descriptor array pointer");
   RAW_CHECK(pool_size_ > 0, "invalid pool size");
+  uint64_t adjust_offset = 0;
 #ifdef PMDK
   auto new_pmdk_pool = reinterpret_cast<PMDKAllocator *>(Allocator::Get())->GetPool();
-  uint64_t adjust_offset = (uint64_t) new_pmdk_pool - pmdk_pool_;
+  adjust_offset = (uint64_t) new_pmdk_pool - pmdk_pool_;
   descriptors_ = reinterpret_cast<Descriptor *>((uint64_t) descriptors_ + adjust_offset);
 #else
   Metadata *metadata = (Metadata*)((uint64_t)this - sizeof(Metadata));
@@ -121,118 +272,175 @@ void DescriptorPool::Recovery(bool enable_stats) {
 #endif  // PMEM
 
   // begin recovery process
-  // If it is an existing pool, see if it has anything in it
-  uint64_t in_progress_desc = 0, redo_words = 0, undo_words = 0;
+  // If it is an existing pool, see if it has anything in it. A new pool comes
+  // with everything zeroed, so its first descriptor is invalid.
+  RecoveryCounts counts{{0}, {0}, {0}};
   if (descriptors_[0].status_ != Descriptor::kStatusInvalid) {
+    // Partitions are handed out to the threads one at a time, so a few
+    // partitions with long descriptors don't hold up the rest. Descriptors in
+    // different partitions may share words, but a word can only point to one
+    // descriptor at a time, and only that descriptor's partition writes it;
+    // the others only see a value that isn't theirs, before or after.
+    if (recovery_threads == 0) {
+      recovery_threads = Environment::Get()->GetCoreCount();
+    }
+    recovery_threads = std::max(1u, std::min(recovery_threads, partition_count_));
 
-    // Must not be a new pool which comes with everything zeroed
-    for (uint32_t i = 0; i < pool_size_; ++i) {
-      auto &desc = descriptors_[i];
-
-      if (desc.status_ == Descriptor::kStatusInvalid) {
-        // Must be a new pool - comes with everything zeroed but better
-        // find this as we look at the first descriptor.
-        RAW_CHECK(i == 0, "corrupted descriptor pool/data area");
-        break;
+    std::atomic<uint32_t> next_partition(0);
+    auto recover = [&]() {
+      for (uint32_t p = next_partition++; p < partition_count_; p = next_partition++) {
+        RecoverPartition(p, adjust_offset, free_callback, &counts);
       }
+    };
+    std::vector<std::thread> threads;
+    for (uint32_t i = 1; i < recovery_threads; ++i) {
+      threads.emplace_back(recover);
+    }
+    recover();
+    for (auto &thread : threads) {
+      thread.join();
+    }
 
-      desc.assert_valid_status();
+    LOG(INFO) << "Found " << counts.in_progress_desc.load() <<
+              " in-progress descriptors, rolled forward " << counts.redo_words.load() <<
+              " words, rolled back " << counts.undo_words.load() << " words" <<
+              " with " << recovery_threads << " threads";
+  }
 #ifdef PMDK
-      // Let's set the real addresses first
-      for (int w = 0; w < desc.count_; ++w) {
-        auto &word = desc.words_[w];
-        if((uint64_t)word.address_ == Descriptor::kAllocNullAddress) {
-          continue;
-        }
-        word.address_ = (uint64_t *) ((uint64_t) word.address_ + adjust_offset);
-      }
+  // Set the new pmdk_pool addr
+  pmdk_pool_ = (uint64_t) reinterpret_cast<PMDKAllocator *>(Allocator::Get())->GetPool();
 #endif
 
-      // Otherwise do recovery
-      uint32_t status = desc.status_ & ~Descriptor::kStatusDirtyFlag;
-      if (status == Descriptor::kStatusFinished) {
-        continue;
-      } else if (status == Descriptor::kStatusUndecided ||
-          status == Descriptor::kStatusFailed) {
-        in_progress_desc++;
-        for (int w = 0; w < desc.count_; ++w) {
-          auto &word = desc.words_[w];
-          if((uint64_t)word.address_ == Descriptor::kAllocNullAddress){
-            continue;
-          }
-          uint64_t val = Descriptor::CleanPtr(*word.address_);
-#ifdef PMDK
-          val += adjust_offset;
-#endif
-          if (val == (uint64_t) &desc || val == (uint64_t) &word) {
-            // If it's a CondCAS descriptor, then MwCAS descriptor wasn't
-            // installed/persisted, i.e., new value (succeeded) or old value
-            // (failed) wasn't installed on the field. If it's an MwCAS
-            // descriptor, then the final value didn't make it to the field
-            // (status is Undecided). In both cases we should roll back to old
-            // value.
-            *word.address_ = word.old_value_;
-#ifdef PMEM
-            word.PersistAddress();
+  InitDescriptors();
+
+  recovery_micros_ = Environment::Get()->NowMicros() - start;
+  LOG(INFO) << "Recovered descriptor pool in " << recovery_micros_ << " us";
+}
+
+void DescriptorPool::RecoverPartition(uint32_t partition, uint64_t adjust_offset,
+                                      Descriptor::FreeCallback free_callback,
+                                      RecoveryCounts* counts) {
+#ifndef PMDK
+  MARK_UNREFERENCED(free_callback);
 #endif
-            undo_words++;
-            LOG(INFO) << "Applied old value 0x" << std::hex
-                      << word.old_value_ << " at 0x" << word.address_;
-          }
-        }
-      } else {
-        RAW_CHECK(status == Descriptor::kStatusSucceeded, "invalid status");
-        in_progress_desc++;
+  uint64_t in_progress_desc = 0, redo_words = 0, undo_words = 0;
+  Descriptor* partition_descriptors = descriptors_ + partition * desc_per_partition_;
 
-        for (int w = 0; w < desc.count_; ++w) {
-          auto &word = desc.words_[w];
+  for (uint32_t i = 0; i < desc_per_partition_; ++i) {
+    auto &desc = partition_descriptors[i];
 
-          if((uint64_t)word.address_ == Descriptor::kAllocNullAddress){
-            continue;
-          }
-          uint64_t val = Descriptor::CleanPtr(*word.address_);
+    // Only the very first descriptor of the pool tells a new pool apart, and
+    // that was checked before, so anything invalid here is corrupted.
+    RAW_CHECK(desc.status_ != Descriptor::kStatusInvalid,
+              "corrupted descriptor pool/data area");
+
+    desc.assert_valid_status();
+    uint32_t status = desc.status_ & ~Descriptor::kStatusDirtyFlag;
 #ifdef PMDK
-          val += adjust_offset;
-#endif
-          RAW_CHECK(val != (uint64_t) &word, "invalid field value");
+    // Let's set the real addresses first
+    for (int w = 0; w < desc.count_; ++w) {
+      auto &word = desc.words_[w];
+      if((uint64_t)word.address_ == Descriptor::kAllocNullAddress) {
+        continue;
+      }
+      word.address_ = (uint64_t *) ((uint64_t) word.address_ + adjust_offset);
+      // Words that were not in the pool were in volatile memory, which
+      // went away with the process, so there is nothing to recover there.
+      if(OID_IS_NULL(pmemobj_oid(word.address_))) {
+        word.address_ = (uint64_t *) Descriptor::kAllocNullAddress;
+      }
+    }
 
-          if (val == (uint64_t) &desc) {
-            *word.address_ = word.new_value_;
-#ifdef PMEM
-            word.PersistAddress();
+    // New values still held by a descriptor that did not succeed were never
+    // installed (this includes a Finished one that never got to its MwCAS),
+    // so nothing else refers to them. Succeeded and failed MwCASes empty
+    // their slots before the descriptor is reused, see DeallocateMemory().
+    if (free_callback && status != Descriptor::kStatusSucceeded) {
+      for (int w = 0; w < desc.count_; ++w) {
+        auto &word = desc.words_[w];
+        if (word.recycle_policy_ == Descriptor::kRecycleNewOnFailure &&
+            word.new_value_ != Descriptor::kNewValueReserved) {
+          free_callback(&word.new_value_, (void*)word.new_value_);
+        }
+      }
+    }
 #endif
-            redo_words++;
-            LOG(INFO) << "Applied new value 0x" << std::hex
-                      << word.new_value_ << " at 0x" << word.address_;
-          }
+
+    // Otherwise do recovery. Words are read and written atomically, since
+    // the threads recovering other partitions may look at the same words.
+    if (status == Descriptor::kStatusFinished) {
+      continue;
+    } else if (status == Descriptor::kStatusUndecided ||
+        status == Descriptor::kStatusFailed) {
+      in_progress_desc++;
+      for (int w = 0; w < desc.count_; ++w) {
+        auto &word = desc.words_[w];
+        if((uint64_t)word.address_ == Descriptor::kAllocNullAddress){
+          continue;
+        }
+        uint64_t val = Descriptor::CleanPtr(
+            __atomic_load_n(word.address_, __ATOMIC_RELAXED));
+        val += adjust_offset;
+        if (val == (uint64_t) &desc || val == (uint64_t) &word) {
+          // If it's a CondCAS descriptor, then MwCAS descriptor wasn't
+          // installed/persisted, i.e., new value (succeeded) or old value
+          // (failed) wasn't installed on the field. If it's an MwCAS
+          // descriptor, then the final value didn't make it to the field
+          // (status is Undecided). In both cases we should roll back to old
+          // value.
+          __atomic_store_n(word.address_, word.old_value_, __ATOMIC_RELAXED);
+          NVRAM::FlushAsync(sizeof(uint64_t), word.address_);
+          undo_words++;
+          LOG(INFO) << "Applied old value 0x" << std::hex
+                    << word.old_value_ << " at 0x" << word.address_;
         }
       }
+    } else {
+      RAW_CHECK(status == Descriptor::kStatusSucceeded, "invalid status");
+      in_progress_desc++;
 
       for (int w = 0; w < desc.count_; ++w) {
-       if((uint64_t)desc.words_[w].address_ == Descriptor::kAllocNullAddress){
-         continue;
-       }
-       int64_t val = *desc.words_[w].address_;
-
-        RAW_CHECK((val & ~Descriptor::kDirtyFlag) !=
-            ((int64_t) &desc | Descriptor::kMwCASFlag),
-                  "invalid word value");
-        RAW_CHECK((val & ~Descriptor::kDirtyFlag) !=
-            ((int64_t) &desc | Descriptor::kCondCASFlag),
-                  "invalid word value");
+        auto &word = desc.words_[w];
+
+        if((uint64_t)word.address_ == Descriptor::kAllocNullAddress){
+          continue;
+        }
+        uint64_t val = Descriptor::CleanPtr(
+            __atomic_load_n(word.address_, __ATOMIC_RELAXED));
+        val += adjust_offset;
+        RAW_CHECK(val != (uint64_t) &word, "invalid field value");
+
+        if (val == (uint64_t) &desc) {
+          __atomic_store_n(word.address_, word.new_value_, __ATOMIC_RELAXED);
+          NVRAM::FlushAsync(sizeof(uint64_t), word.address_);
+          redo_words++;
+          LOG(INFO) << "Applied new value 0x" << std::hex
+                    << word.new_value_ << " at 0x" << word.address_;
+        }
       }
     }
 
-    LOG(INFO) << "Found " << in_progress_desc <<
-              " in-progress descriptors, rolled forward " << redo_words <<
-              " words, rolled back " << undo_words << " words";
+    for (int w = 0; w < desc.count_; ++w) {
+      if((uint64_t)desc.words_[w].address_ == Descriptor::kAllocNullAddress){
+        continue;
+      }
+      int64_t val = __atomic_load_n(desc.words_[w].address_, __ATOMIC_RELAXED);
+
+      RAW_CHECK((val & ~Descriptor::kDirtyFlag) !=
+          ((int64_t) &desc | Descriptor::kMwCASFlag),
+                "invalid word value");
+      RAW_CHECK((val & ~Descriptor::kDirtyFlag) !=
+          ((int64_t) &desc | Descriptor::kCondCASFlag),
+                "invalid word value");
+    }
   }
-#ifdef PMDK
-  // Set the new pmdk_pool addr
-  pmdk_pool_ = (uint64_t) reinterpret_cast<PMDKAllocator *>(Allocator::Get())->GetPool();
-#endif
 
-  InitDescriptors();
+  // One wait for all the words this partition rolled back or forward
+  NVRAM::Drain();
+
+  counts->in_progress_desc += in_progress_desc;
+  counts->redo_words += redo_words;
+  counts->undo_words += undo_words;
 }
 #endif
 
@@ -251,45 +459,211 @@ void DescriptorPool::InitDescriptors() {
     for (uint32_t d = 0; d < desc_per_partition_; ++d) {
       Descriptor *desc = descriptors_ + i * desc_per_partition_ + d;
       new (desc) Descriptor(p);
-      desc->next_ptr_ = p->free_list;
-      p->free_list = desc;
+      p->Free(desc);
     }
+    p->desc_count = desc_per_partition_;
   }
 }
 
 DescriptorPool::~DescriptorPool() {
+  // Overflow partitions only live as long as the pool object, a recovery
+  // starts without any
+  DescriptorPartition* p = overflow_partitions_.load(std::memory_order_acquire);
+  while(p) {
+    DescriptorPartition* next = p->next_overflow;
+    p->~DescriptorPartition();
+    free(p);
+    p = next;
+  }
   MwCASMetrics::Uninitialize();
 }
 
-Descriptor* DescriptorPool::AllocateDescriptor(Descriptor::AllocateCallback ac,
-    Descriptor::FreeCallback fc) {
-  thread_local DescriptorPartition* tls_part = nullptr;
-  if(!tls_part) {
-    // Sometimes e.g., benchmark data loading will create new threads when
-    // starting real work. So % partition_count_ here is safe. This is so far
-    // the only safe case allowed.
-    auto index = next_partition_.fetch_add(1, std::memory_order_seq_cst) %
-      partition_count_;
+template <typename Func>
+void DescriptorPool::ForEachPartition(uint32_t start, Func func) {
+  for(uint32_t i = 0; i < partition_count_; ++i) {
+    if(func(&partition_table_[(start + i) % partition_count_])) return;
+  }
+  DescriptorPartition* p = overflow_partitions_.load(std::memory_order_acquire);
+  for(; p; p = p->next_overflow) {
+    if(func(p)) return;
+  }
+}
 
-    // TODO: Currently we actually require strictly TLS partitions - there is no
-    // CC whatsoever for partitions.
-    tls_part = &partition_table_[index];
+DescriptorPartition* DescriptorPool::AcquirePartition() {
+  uint64_t me = thread_owner.value;
+  DescriptorPartition* found = nullptr;
 
-    // Track the partition pointer handed out to this thread.
-    Thread::RegisterTls((uint64_t*)&tls_part, (uint64_t)nullptr);
+  // One this thread got before, and kept while it used another pool
+  ForEachPartition(0, [&](DescriptorPartition* p) -> bool {
+    if(p->owner.load(std::memory_order_relaxed) != me) return false;
+    found = p;
+    return true;
+  });
+  if(found) return found;
+
+  // One that no live thread holds, starting round-robin so that the threads
+  // spread over the table
+  uint32_t start = next_partition_.fetch_add(1, std::memory_order_relaxed) %
+    partition_count_;
+  ForEachPartition(start, [&](DescriptorPartition* p) -> bool {
+    uint64_t owner = p->owner.load(std::memory_order_acquire);
+    if(IsLiveOwner(owner) || !p->owner.compare_exchange_strong(owner, me,
+        std::memory_order_acq_rel)) {
+      return false;
+    }
+    found = p;
+    return true;
+  });
+  if(found) return found;
+
+  // More threads than partitions: a new one, which starts out empty and steals
+  found = (DescriptorPartition*)malloc(sizeof(DescriptorPartition));
+  RAW_CHECK(nullptr != found, "out of memory");
+  new(found) DescriptorPartition(&epoch_, this);
+  found->owner = me;
+  DescriptorPartition* head =
+    overflow_partitions_.load(std::memory_order_relaxed);
+  do {
+    found->next_overflow = head;
+  } while(!overflow_partitions_.compare_exchange_weak(head, found,
+      std::memory_order_release, std::memory_order_relaxed));
+  return found;
+}
+
+void DescriptorPool::ReleasePartition() {
+  uint64_t me = thread_owner.value;
+  ForEachPartition(0, [&](DescriptorPartition* p) -> bool {
+    if(p->owner.load(std::memory_order_relaxed) != me) return false;
+    p->owner.store(0, std::memory_order_release);
+    return true;
+  });
+  if(tls_pool_id == id_) {
+    tls_pool_id = 0;
+    tls_part = nullptr;
   }
+}
+
+bool DescriptorPool::StealDescriptors(DescriptorPartition* part) {
+  // The garbage list can't take more than this, the rest of ours are in use
+  // or waiting for the epoch to move on
+  uint32_t room = desc_per_partition_ -
+    part->desc_count.load(std::memory_order_relaxed);
+  if(room == 0) return false;
+
+  uint64_t me = thread_owner.value;
+  uint32_t start = next_partition_.load(std::memory_order_relaxed) %
+    partition_count_;
+  bool stolen = false;
+  ForEachPartition(start, [&](DescriptorPartition* victim) -> bool {
+    if(victim == part) return false;
+
+    // A partition nobody holds only shares what it has once somebody makes it,
+    // including whatever its garbage list can give back by now
+    uint64_t owner = victim->owner.load(std::memory_order_acquire);
+    if(!IsLiveOwner(owner) && victim->owner.compare_exchange_strong(owner, me,
+        std::memory_order_acq_rel)) {
+      victim->garbage_list->Scavenge();
+      victim->ShareFreeList(0);
+      victim->owner.store(0, std::memory_order_release);
+    }
+
+    Descriptor* head = victim->shared_list.exchange(nullptr,
+      std::memory_order_acquire);
+    if(!head) return false;
+
+    // Half of them, the first [take] come here and the rest go back
+    uint32_t count = 0;
+    for(Descriptor* d = head; d; d = d->next_ptr_) {
+      ++count;
+    }
+    uint32_t take = std::min((count + 1) / 2, room);
+    Descriptor* tail = head;
+    tail->owner_partition_ = part;
+    for(uint32_t i = 1; i < take; ++i) {
+      tail = tail->next_ptr_;
+      tail->owner_partition_ = part;
+    }
+    Descriptor* rest = tail->next_ptr_;
+    if(rest) {
+      Descriptor* rest_tail = rest;
+      while(rest_tail->next_ptr_) {
+        rest_tail = rest_tail->next_ptr_;
+      }
+      victim->PushShared(rest, rest_tail);
+    }
+    tail->next_ptr_ = nullptr;
+    part->FreeList(head);
+    victim->desc_count.fetch_sub(take, std::memory_order_relaxed);
+    part->desc_count.fetch_add(take, std::memory_order_relaxed);
+    stolen = true;
+    return true;
+  });
+  return stolen;
+}
+
+Descriptor* DescriptorPool::RefillPartition(DescriptorPartition* part) {
+  bool starving = false;
+  while(!part->free_list) {
+    // Whatever is left of what this partition shared, unless that was for a
+    // thread that is starving
+    if(starving || !HasStarvingThreads()) {
+      Descriptor* shared = part->shared_list.exchange(nullptr,
+        std::memory_order_acquire);
+      if(shared) {
+        part->FreeList(shared);
+        break;
+      }
+    }
 
-  Descriptor* desc = tls_part->free_list;
-  while(!desc) {
     // See if we can scavenge some descriptors from the garbage list
-    tls_part->garbage_list->GetEpoch()->BumpCurrentEpoch();
-    auto scavenged = tls_part->garbage_list->Scavenge();
-    tls_part->allocated_desc -= scavenged;
-    desc = tls_part->free_list;
-    RAW_CHECK(scavenged > 0 || !desc, "scavenged but still not descriptor");
+    part->garbage_list->GetEpoch()->BumpCurrentEpoch();
+    auto scavenged = part->garbage_list->Scavenge();
+    part->allocated_desc -= scavenged;
     MwCASMetrics::AddDescriptorScavenge();
+    if(part->free_list) break;
+
+    // Rather than waiting for the epoch to free ours, take some of another's
+    if(StealDescriptors(part)) {
+      MwCASMetrics::AddDescriptorSteal();
+      break;
+    }
+
+    // Nobody shares anything: as this thread holds the epoch back, what the
+    // others have in their garbage lists from before is all it can get, so it
+    // asks them for that (see AllocateDescriptor())
+    if(!starving) {
+      starving = true;
+      starving_.fetch_add(1, std::memory_order_relaxed);
+    }
+    std::this_thread::yield();
+  }
+  if(starving) {
+    starving_.fetch_sub(1, std::memory_order_relaxed);
+  }
+  return part->free_list;
+}
+
+Descriptor* DescriptorPool::AllocateDescriptor(Descriptor::AllocateCallback ac,
+    Descriptor::FreeCallback fc) {
+  // The thread keeps its partition until it exits (or releases it), the pool
+  // id tells if the cached one is still of this pool
+  if(tls_pool_id != id_) {
+    tls_part = AcquirePartition();
+    tls_pool_id = id_;
   }
-  tls_part->free_list = desc->next_ptr_;
+
+  DescriptorPartition* part = tls_part;
+  if(starving_.load(std::memory_order_relaxed)) {
+    // Some thread ran dry, share whatever the epoch lets go of by now
+    part->garbage_list->Scavenge();
+    part->ShareFreeList(1);
+  }
+  Descriptor* desc = part->free_list;
+  if(!desc) {
+    desc = RefillPartition(part);
+  }
+  part->free_list = desc->next_ptr_;
+  --part->free_count;
 
   MwCASMetrics::AddDescriptorAlloc();
   RAW_CHECK(desc, "null descriptor pointer");
@@ -357,6 +731,28 @@ uint32_t Descriptor::AllocateAndAddEntry(uint64_t* addr, uint64_t oldval,
   return insertpos;
 }
 
+#ifdef PMDK
+void* Descriptor::AllocateNewValue(uint32_t index, size_t size,
+      uint64_t type_num) {
+  RAW_CHECK(index < count_, "invalid word index");
+  auto& word = words_[index];
+  RAW_CHECK(word.recycle_policy_ == kRecycleNewOnFailure &&
+      word.new_value_ == kNewValueReserved, "word cannot own a new value");
+  // Recovery has to see this word, with its slot still empty, before the
+  // allocation lands in it; a reused descriptor may otherwise still look like
+  // its last, succeeded, MwCAS.
+  NVRAM::Flush(sizeof(Descriptor), this);
+
+  auto pop = reinterpret_cast<PMDKAllocator*>(Allocator::Get())->GetPool();
+  struct pobj_action actions[2];
+  PMEMoid oid = pmemobj_reserve(pop, &actions[0], size, type_num);
+  RAW_CHECK(!OID_IS_NULL(oid), "allocation failed");
+  pmemobj_set_value(pop, &actions[1], &word.new_value_, oid.off);
+  pmemobj_publish(pop, actions, 2);
+  return pmemobj_direct(oid);
+}
+#endif
+
 int Descriptor::GetInsertPosition(uint64_t* addr) {
   DCHECK(uint64_t(addr) % sizeof(uint64_t) == 0);
   RAW_CHECK(count_ < DESC_CAP, "too many words");
@@ -704,8 +1100,10 @@ retry_entry:
 #endif
 
   // Persist all target fields if we successfully installed mwcas descriptor on
-  // all fields.
+  // all fields. They are flushed as one batch, and the dirty bits cleared once
+  // all of them are durable.
   if(my_status == kStatusSucceeded) {
+    NVRAM::FlushBatch<DESC_CAP> batch;
     for (uint32_t i = 0; i < count_; ++i) {
       WordDescriptor* wd = &words_[i];
       if((uint64_t)wd->address_ == Descriptor::kAllocNullAddress){
@@ -713,10 +1111,17 @@ retry_entry:
       }
       uint64_t val = *wd->address_;
       if(val == descptr) {
-        wd->PersistAddress();
-        CompareExchange64(wd->address_, descptr & ~kDirtyFlag, descptr);
+        batch.Add(wd->address_);
       }
     }
+    batch.Drain();
+    for (uint32_t i = 0; i < count_; ++i) {
+      WordDescriptor* wd = &words_[i];
+      if((uint64_t)wd->address_ == Descriptor::kAllocNullAddress){
+        continue;
+      }
+      CompareExchange64(wd->address_, descptr & ~kDirtyFlag, descptr);
+    }
   }
 
   // Switch to the final state, the MwCAS concludes after this point
@@ -730,6 +1135,9 @@ retry_entry:
   status_ &= ~kStatusDirtyFlag;
   // No need to flush again, recovery does not care about the dirty bit
 
+  // Install all the final values, then flush them as one batch, and clear the
+  // dirty bits once all of them are durable. The batch skips lines it already
+  // flushed, so every store has to be done before the first flush is issued.
   bool succeeded = (status_ == kStatusSucceeded);
   for(uint32_t i = 0; i < count_; i++) {
     WordDescriptor* wd = &words_[i];
@@ -743,8 +1151,22 @@ retry_entry:
       // Retry if someone else already cleared the dirty bit
       CompareExchange64(wd->address_, val, clean_descptr);
     }
-    wd->PersistAddress();
-    RAW_CHECK(val & kDirtyFlag, "invalid final value");
+  }
+  NVRAM::FlushBatch<DESC_CAP> batch;
+  for(uint32_t i = 0; i < count_; i++) {
+    WordDescriptor* wd = &words_[i];
+    if((uint64_t)wd->address_ == Descriptor::kAllocNullAddress){
+      continue;
+    }
+    batch.Add(wd->address_);
+  }
+  batch.Drain();
+  for(uint32_t i = 0; i < count_; i++) {
+    WordDescriptor* wd = &words_[i];
+    if((uint64_t)wd->address_ == Descriptor::kAllocNullAddress){
+      continue;
+    }
+    uint64_t val = (succeeded ? wd->new_value_ : wd->old_value_) | kDirtyFlag;
     CompareExchange64(wd->address_, val & ~kDirtyFlag, val);
   }
 
@@ -828,14 +1250,19 @@ retry_entry:
   // Persist all target fields if we successfully installed mwcas descriptor on
   // all fields.
   if(my_status == kStatusSucceeded) {
+    NVRAM::FlushBatch<DESC_CAP> batch;
     for (uint32_t i = 0; i < count_; ++i) {
       WordDescriptor* wd = &words_[i];
       uint64_t val = *wd->address_;
       if(val == descptr) {
-        wd->PersistAddress();
-        CompareExchange64(wd->address_, descptr & ~kDirtyFlag, descptr);
+        batch.Add(wd->address_);
       }
     }
+    batch.Drain();
+    for (uint32_t i = 0; i < count_; ++i) {
+      WordDescriptor* wd = &words_[i];
+      CompareExchange64(wd->address_, descptr & ~kDirtyFlag, descptr);
+    }
   }
 
   // The compare exchange below will determine whether the mwcas will roll
@@ -904,6 +1331,9 @@ Status Descriptor::Abort() {
 }
 
 void Descriptor::DeallocateMemory() {
+#ifdef PMDK
+  bool drain = false;
+#endif
   // Free the memory associated with the descriptor if needed
   for(uint32_t i = 0; i < count_; ++i) {
     auto& word = words_[i];
@@ -935,14 +1365,28 @@ void Descriptor::DeallocateMemory() {
       case kRecycleNewOnFailure:
         if(status != kStatusSucceeded) {
           if(word.new_value_ != kNewValueReserved) {
-            free_callback_(nullptr, (void*)word.new_value_);
+            free_callback_(&word.new_value_, (void*)word.new_value_);
           }
         }
+#ifdef PMDK
+        else if(word.new_value_ != kNewValueReserved) {
+          // The new value is installed now, so Recovery() must not free it
+          // after this descriptor is reused and no longer says Succeeded.
+          word.new_value_ = kNewValueReserved;
+          NVRAM::FlushAsync(sizeof(uint64_t), &word.new_value_);
+          drain = true;
+        }
+#endif
         break;
       default:
         LOG(FATAL) << "invalid recycle policy";
     }
   }
+#ifdef PMDK
+  if(drain) {
+    NVRAM::Drain();
+  }
+#endif
   count_ = 0;
 }
 
@@ -955,8 +1399,7 @@ void Descriptor::FreeDescriptor(void* context, void* desc) {
 
   RAW_CHECK(desc_to_free->status_ == kStatusFinished, "invalid status");
 
-  desc_to_free->next_ptr_ = desc_to_free->owner_partition_->free_list;
-  desc_to_free->owner_partition_->free_list = desc_to_free;
+  desc_to_free->owner_partition_->Free(desc_to_free);
 }
 
 } // namespace pmwcas
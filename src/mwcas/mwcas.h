@@ -115,7 +115,8 @@ public:
   /// Garbage list recycle policy: free only [old value] if succeeded
   static const uint32_t kRecycleOldOnSuccess = 0x4;
 
-  /// Garbage list recycle policy: free only [new value] if succeeded
+  /// Garbage list recycle policy: free only [new value] if succeeded. The
+  /// free callback gets the slot of [new value] in the descriptor as context.
   static const uint32_t kRecycleNewOnFailure = 0x5;
 
   /// Recycle and installation policy: neither install nor recycle
@@ -169,7 +170,7 @@ public:
 #ifdef PMEM
     /// Persist the content of address_
     inline void PersistAddress() {
-      NVRAM::Flush(sizeof(uint64_t*), (void*)&address_);
+      NVRAM::Flush(sizeof(uint64_t), (void*)address_);
     }
 #endif
 
@@ -230,9 +231,22 @@ public:
     return AddEntry(addr, oldval, kNewValueReserved, recycle_policy);
   }
 
+#ifdef PMDK
+  /// Allocate [size] bytes of type [type_num] from the PMDK pool into the new
+  /// value of word [index], reserved with kRecycleNewOnFailure, as the pool
+  /// offset of the allocation. The allocation and storing its offset are one
+  /// failure-atomic step, so from then on the descriptor owns the memory: it
+  /// is freed through the free callback if the MwCAS fails, and by Recovery()
+  /// if the process crashes before it succeeds. Returns the memory's address.
+  void* AllocateNewValue(uint32_t index, size_t size, uint64_t type_num);
+#endif
+
   /// Abort the MwCAS operation, can be used only before the operation starts.
   Status Abort();
 
+  /// Value signifying an internal reserved value for a new entry
+  static const uint64_t kNewValueReserved = ~0ull;
+
 private:
 #if defined(GOOGLE_FRAMEWORK) && defined(APPS)
   /// Allow tests to access privates for failure injection purposes.
@@ -240,9 +254,7 @@ private:
 #endif
 
   friend class DescriptorPool;
-
-  /// Value signifying an internal reserved value for a new entry
-  static const uint64_t kNewValueReserved = ~0ull;
+  friend struct DescriptorPartition;
 
   /// Internal helper function to conduct a double-compare, single-swap
   /// operation on an target field depending on the value of the status_ field
@@ -403,6 +415,11 @@ private:
 /// A partitioned pool of Descriptors used for fast allocation of descriptors.
 /// The pool of descriptors will be bounded by the number of threads actively
 /// performing an mwcas operation.
+///
+/// A partition is held by one thread at a time (see DescriptorPool::
+/// AcquirePartition), which is the only one touching its free and garbage
+/// lists. The free list only keeps a few descriptors, the others go to the
+/// shared list instead, for threads whose own partition ran dry.
 struct alignas(kCacheLineSize)DescriptorPartition {
 
   DescriptorPartition() = delete;
@@ -410,9 +427,49 @@ struct alignas(kCacheLineSize)DescriptorPartition {
 
   ~DescriptorPartition();
 
-  /// Pointer to the free list head (currently managed by lock-free list)
+  /// Puts a free descriptor of this partition back, on the free list unless
+  /// that has enough already
+  void Free(Descriptor* desc);
+
+  /// Same as Free(), for the list of descriptors starting at [head]
+  void FreeList(Descriptor* head);
+
+  /// Moves all but the first [keep] of the free list to the shared list
+  void ShareFreeList(uint32_t keep);
+
+  /// How many descriptors the free list holds at most right now
+  uint32_t FreeListSize();
+
+  /// Pushes the descriptors [head] to [tail] onto the shared list
+  void PushShared(Descriptor* head, Descriptor* tail);
+
+  /// Pointer to the free list head, only used by the thread holding the
+  /// partition
   Descriptor *free_list;
 
+  /// Number of descriptors on the free list
+  uint32_t free_count;
+
+  /// How many the free list holds before Free() shares the rest, unless a
+  /// thread is starving
+  uint32_t free_keep;
+
+  /// Free descriptors any thread may take, see DescriptorPool::
+  /// StealDescriptors. Only ever pushed to or emptied as a whole, so there is
+  /// no ABA.
+  std::atomic<Descriptor*> shared_list;
+
+  /// Number of descriptors this partition is the home of (free, shared, in use
+  /// or in the garbage list), at most the garbage list's capacity
+  std::atomic<uint32_t> desc_count;
+
+  /// The thread holding this partition, 0 if none, see DescriptorPool::
+  /// AcquirePartition
+  std::atomic<uint64_t> owner;
+
+  /// The next partition made when all the others were held
+  DescriptorPartition* next_overflow;
+
   /// Back pointer to the owner pool
   DescriptorPool* desc_pool;
 
@@ -441,18 +498,64 @@ private:
   /// Descriptor partitions (per thread)
   DescriptorPartition* partition_table_;
 
-  /// The next partition to assign (round-robin) for a new thread joining the
-  /// pmwcas library.
+  /// The partition a new thread joining the pmwcas library tries first, so
+  /// that they spread (round-robin) over the table
   std::atomic<uint32_t> next_partition_;
 
+  /// Partitions made for threads that found all the others held, which start
+  /// out empty and steal, see AcquirePartition()
+  std::atomic<DescriptorPartition*> overflow_partitions_;
+
+  /// Number of threads that found no descriptor anywhere, see
+  /// RefillPartition(). While there are any, the others share all they can.
+  std::atomic<uint32_t> starving_;
+
+  /// Tells this pool apart from any other pool at the same address, for the
+  /// threads' cached partitions
+  uint64_t id_;
+
   /// Epoch manager controling garbage/access to descriptors.
   EpochManager epoch_;
 
   /// Track the pmdk pool for recovery purpose
   uint64_t pmdk_pool_;
 
+  /// How long the last Recovery() took, in microseconds
+  uint64_t recovery_micros_;
+
   void InitDescriptors();
 
+  /// The partition the calling thread holds, one it takes over from a thread
+  /// that exited or never came, or a new overflow partition
+  DescriptorPartition* AcquirePartition();
+
+  /// Fills the empty free list of [part], spinning until it can
+  Descriptor* RefillPartition(DescriptorPartition* part);
+
+  /// Moves half of the shared descriptors of another partition to [part],
+  /// first sharing the free lists of partitions that no thread holds. Returns
+  /// false if there were none to steal.
+  bool StealDescriptors(DescriptorPartition* part);
+
+  /// Calls [func] on every partition, overflow ones included, starting from
+  /// partition table entry [start]
+  template <typename Func>
+  void ForEachPartition(uint32_t start, Func func);
+
+#ifdef PMEM
+  /// Word counts of a recovery, summed over the threads that do it
+  struct RecoveryCounts {
+    std::atomic<uint64_t> in_progress_desc;
+    std::atomic<uint64_t> redo_words;
+    std::atomic<uint64_t> undo_words;
+  };
+
+  /// Rolls the descriptors of one partition back or forward, see Recovery()
+  void RecoverPartition(uint32_t partition, uint64_t adjust_offset,
+                        Descriptor::FreeCallback free_callback,
+                        RecoveryCounts* counts);
+#endif
+
  public:
   /// Metadata that prefixes the actual pool of descriptors for persistence
   struct Metadata {
@@ -474,13 +577,27 @@ private:
   }
 
 #ifdef PMEM
-  void Recovery(bool enable_stats);
+  /// Re-initializes an existing pool after a restart, and brings every word
+  /// an in-flight descriptor points to back to its old or new value. The
+  /// partitions are recovered in parallel by [recovery_threads] threads (0 for
+  /// one per core). With PMDK, the new values of kRecycleNewOnFailure words
+  /// that were never installed are passed to [free_callback], with the slot
+  /// holding them as the context (see Descriptor::AllocateNewValue).
+  void Recovery(bool enable_stats, uint32_t recovery_threads = 0,
+                Descriptor::FreeCallback free_callback = nullptr);
 #endif
 
+  /// Time taken by the last Recovery() in microseconds, 0 for a new pool
+  inline uint64_t GetRecoveryMicros() { return recovery_micros_; }
+
   ~DescriptorPool();
 
   inline uint32_t GetDescPerPartition() { return desc_per_partition_; }
 
+  inline bool HasStarvingThreads() {
+    return starving_.load(std::memory_order_relaxed) > 0;
+  }
+
   /// Returns a pointer to the epoch manager associated with this pool.
   /// MwcTargetField::GetValue() needs it.
   EpochManager* GetEpoch() {
@@ -490,6 +607,11 @@ private:
   // Get a free descriptor from the pool.
   Descriptor* AllocateDescriptor(Descriptor::AllocateCallback ac,
     Descriptor::FreeCallback fc);
+
+  /// Lets go of the partition the calling thread holds, if any, which a thread
+  /// exiting does anyway. Its descriptors must all be free or in the garbage
+  /// list, which the next thread to hold the partition takes over.
+  void ReleasePartition();
   
   // Allocate a free descriptor from the pool using default allocate and
   // free callbacks.
@@ -534,6 +656,23 @@ public:
 #endif
   }
 
+  /// Single-word compare and swap that doesn't need a descriptor. Changes the
+  /// word from [old_value] to [new_value] and returns true if it did. It is
+  /// durable the same way a one-word MwCAS is: the new value is installed with
+  /// the dirty flag, flushed, and then the flag is cleared, and readers that
+  /// see the flag (GetValue) flush the word before they use the value. There
+  /// is nothing to recover, so no descriptor, epoch protection or descriptor
+  /// flush is needed. Both values must be clean. If the word holds an MwCAS
+  /// descriptor the CAS fails, and GetValue helps it along when the caller
+  /// reads the word again.
+  inline bool CAS(T old_value, T new_value) {
+#ifdef PMEM
+    return PersistentCAS((uint64_t)old_value, (uint64_t)new_value);
+#else
+    return VolatileCAS((uint64_t)old_value, (uint64_t)new_value);
+#endif
+  }
+
   /// Returns true if the given word does not have any internal management
   /// flags set, false otherwise.
   static inline bool IsCleanPtr(uint64_t ptr) {
@@ -655,12 +794,52 @@ private:
     }
     return val;
   }
+
+  /// The volatile variant of CAS().
+  inline bool VolatileCAS(uint64_t old_value, uint64_t new_value) {
+    RAW_CHECK(IsCleanPtr(old_value) && IsCleanPtr(new_value),
+        "flags set on CAS value");
+    if(CompareExchange64((uint64_t*)&value_, new_value, old_value) ==
+        old_value) {
+      MwCASMetrics::AddSucceededUpdate();
+      return true;
+    }
+    MwCASMetrics::AddFailedUpdate();
+    return false;
+  }
 #endif
 
 #ifdef PMEM
+  // The persistent variant of CAS().
+  inline bool PersistentCAS(uint64_t old_value, uint64_t new_value) {
+    RAW_CHECK(IsCleanPtr(old_value) && IsCleanPtr(new_value),
+        "flags set on CAS value");
+
+  retry:
+    uint64_t val = CompareExchange64((uint64_t*)&value_,
+        new_value | kDirtyFlag, old_value);
+    if(val == old_value) {
+      PersistValue();
+      CompareExchange64((uint64_t*)&value_, new_value, new_value | kDirtyFlag);
+      MwCASMetrics::AddSucceededUpdate();
+      return true;
+    }
+
+    // A value that is only dirty is the value all the same once it's durable,
+    // so it may still be the expected one
+    if((val & kDirtyFlag) && !(val & kDescriptorMask)) {
+      PersistValue();
+      CompareExchange64((uint64_t*)&value_, val & ~kDirtyFlag, val);
+      if((val & ~kDirtyFlag) == old_value) goto retry;
+    }
+    MwCASMetrics::AddFailedUpdate();
+    return false;
+  }
+
   // The persistent variant of GetValue().
   T GetValuePersistent(EpochManager* epoch) {
     MwCASMetrics::AddRead();
+    NVRAM::Touch(sizeof(uint64_t), (const void*)&value_);
     EpochGuard guard(epoch, !epoch->IsProtected());
 
 retry:
@@ -706,6 +885,7 @@ retry:
   // The "protected" variant of GetPersistValue().
   T GetValueProtectedPersistent() {
     MwCASMetrics::AddRead();
+    NVRAM::Touch(sizeof(uint64_t), (const void*)&value_);
 
   retry:
     uint64_t val = (uint64_t)value_;
@@ -3,6 +3,7 @@
 
 #include <gtest/gtest.h>
 #include <stdlib.h>
+#include <vector>
 #include "common/allocator_internal.h"
 #include "include/pmwcas.h"
 #include "include/environment.h"
@@ -180,6 +181,99 @@ GTEST_TEST(PMwCASTest, SingleThreadedConflict) {
   Thread::ClearRegistry(true);
 }
 
+GTEST_TEST(PMwCASTest, SingleWordCAS) {
+  auto thread_count = Environment::Get()->GetCoreCount();
+  std::unique_ptr<pmwcas::DescriptorPool> pool(
+    new pmwcas::DescriptorPool(kDescriptorPoolSize, thread_count));
+  PMwCASPtr test_array[kTestArraySize];
+
+  for (uint32_t i = 0; i < kTestArraySize; ++i) {
+    test_array[i] = 0ull;
+  }
+
+  // No descriptor, and no epoch protection
+  EXPECT_TRUE(test_array[0].CAS(0ull, 1ull));
+  EXPECT_EQ(1ull, *((uint64_t*)&test_array[0]));
+  EXPECT_FALSE(test_array[0].CAS(0ull, 2ull));
+  EXPECT_EQ(1ull, *((uint64_t*)&test_array[0]));
+
+  // A word last changed by an MwCAS, and one changed in the same MwCAS
+  // by CAS afterwards
+  pool.get()->GetEpoch()->Protect();
+  Descriptor* descriptor = pool->AllocateDescriptor();
+  EXPECT_NE(nullptr, descriptor);
+  descriptor->AddEntry((uint64_t*)&test_array[0], 1ull, 2ull);
+  descriptor->AddEntry((uint64_t*)&test_array[1], 0ull, 2ull);
+  EXPECT_TRUE(descriptor->MwCAS());
+  pool.get()->GetEpoch()->Unprotect();
+
+  EXPECT_TRUE(test_array[1].CAS(2ull, 3ull));
+  EXPECT_EQ(2ull, test_array[0].GetValue(pool->GetEpoch()));
+  EXPECT_EQ(3ull, test_array[1].GetValue(pool->GetEpoch()));
+
+#ifdef PMEM
+  // A dirty value from a CAS that didn't clear its flag yet is read as
+  // the value, and can be swapped as the value
+  *((uint64_t*)&test_array[2]) = 4ull | Descriptor::kDirtyFlag;
+  EXPECT_FALSE(test_array[2].CAS(0ull, 5ull));
+  EXPECT_EQ(4ull, *((uint64_t*)&test_array[2]));
+  *((uint64_t*)&test_array[2]) = 4ull | Descriptor::kDirtyFlag;
+  EXPECT_TRUE(test_array[2].CAS(4ull, 5ull));
+  EXPECT_EQ(5ull, test_array[2].GetValue(pool->GetEpoch()));
+#endif
+
+  Thread::ClearRegistry(true);
+}
+
+GTEST_TEST(PMwCASTest, MoreThreadsThanPartitions) {
+  // Two partitions for eight threads at once, twice, so the second round
+  // takes over the partitions the first one left behind
+  const uint32_t kThreads = 8;
+  const uint32_t kUpdates = 2000;
+  std::unique_ptr<pmwcas::DescriptorPool> pool(
+    new pmwcas::DescriptorPool(kDescriptorPoolSize, 2));
+  PMwCASPtr test_array[kThreads * 2];
+
+  for (uint32_t round = 0; round < 2; ++round) {
+    for (uint32_t i = 0; i < kThreads * 2; ++i) {
+      test_array[i] = 0ull;
+    }
+    // Thread, not std::thread, so that joining resets the exited threads' TLS
+    std::vector<std::unique_ptr<Thread>> threads;
+    for (uint32_t t = 0; t < kThreads; ++t) {
+      threads.emplace_back(new Thread([&, t]() {
+        uint64_t* words = (uint64_t*)&test_array[t * 2];
+        for (uint64_t i = 0; i < kUpdates; ++i) {
+          pool->GetEpoch()->Protect();
+          Descriptor* descriptor = pool->AllocateDescriptor();
+          ASSERT_NE(nullptr, descriptor);
+          descriptor->AddEntry(&words[0], i, i + 1);
+          descriptor->AddEntry(&words[1], i, i + 1);
+          ASSERT_TRUE(descriptor->MwCAS());
+          pool->GetEpoch()->Unprotect();
+        }
+      }));
+    }
+    for (auto& thread : threads) {
+      thread->join();
+    }
+
+    for (uint32_t i = 0; i < kThreads * 2; ++i) {
+      EXPECT_EQ(kUpdates, test_array[i].GetValue(pool->GetEpoch()));
+    }
+  }
+
+  // This thread never had a partition, and gives the one it gets back
+  pool->GetEpoch()->Protect();
+  Descriptor* descriptor = pool->AllocateDescriptor();
+  descriptor->AddEntry((uint64_t*)&test_array[0], kUpdates, 0ull);
+  EXPECT_TRUE(descriptor->MwCAS());
+  pool->GetEpoch()->Unprotect();
+  pool->ReleasePartition();
+
+  Thread::ClearRegistry(true);
+}
+
 #ifdef PMEM
 GTEST_TEST(PMwCASTest, SingleThreadedRecovery) {
   auto thread_count = Environment::Get()->GetCoreCount();
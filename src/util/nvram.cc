@@ -6,7 +6,14 @@
 namespace pmwcas {
 #ifdef PMEM
 uint64_t NVRAM::write_delay_cycles = 0;
+uint64_t NVRAM::fence_delay_cycles = 0;
+uint64_t NVRAM::read_delay_cycles = 0;
 double NVRAM::write_byte_per_cycle = 0;
-bool NVRAM::use_clflush = false;
+bool NVRAM::emulate_writes = false;
+std::atomic<uint64_t> NVRAM::write_busy_until{0};
+thread_local uint64_t NVRAM::write_done_at = 0;
+thread_local uint64_t NVRAM::pending_lines = 0;
+thread_local uint64_t NVRAM::cached_lines[NVRAM::kEmulatedCacheLines];
+NVRAM::FlushKind NVRAM::flush_kind = NVRAM::DetectFlush();
 #endif
 }  // namespace pmwcas
@@ -4,9 +4,16 @@
 #pragma once
 
 #include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <thread>
 
 #ifdef WIN32
 #include <intrin.h>
+#else
+#include <cpuid.h>
+#include <x86intrin.h>
 #endif
 
 #ifdef PMDK
@@ -19,45 +26,155 @@ namespace pmwcas {
 
 struct NVRAM {
 #ifdef PMEM
-  /// How many cycles to delay for an emulated NVRAM write
+  /// The instruction that writes cache lines back when not using PMDK, picked
+  /// once at startup by DetectFlush(). kFlushNone doesn't flush at all, for
+  /// running on DRAM only.
+  enum FlushKind {
+    kFlushNone,
+    kFlushClflush,
+    kFlushClflushopt,
+    kFlushClwb,
+  };
+
+  /// Emulated NVRAM costs, in cycles: per cache line written back, per fence
+  /// that waits for write backs, and per read of a line that isn't cached
   static uint64_t write_delay_cycles;
+  static uint64_t fence_delay_cycles;
+  static uint64_t read_delay_cycles;
+  /// Write back bandwidth of the emulated NVRAM, shared by all threads, 0 for
+  /// unlimited
   static double write_byte_per_cycle;
-  static bool use_clflush;
-
-  static void InitializeClflush() {
-    use_clflush = true;
-    LOG(INFO) << "Will use CLFLUSH";
-  }
-
-  static void InitializeSpin(uint64_t delay_ns, bool emulate_wb) {
-    use_clflush = false;
-    if(delay_ns) {
-      uint64_t start = __rdtsc();
+  static FlushKind flush_kind;
 
+  /// The best flush instruction the CPU has: CLWB, which leaves the line
+  /// cached, then CLFLUSHOPT, then CLFLUSH, which are both invalidating, and
+  /// only CLFLUSH is ordered
+  static FlushKind DetectFlush() {
+    // leaf 7 EBX has CLFLUSHOPT (bit 23) and CLWB (bit 24), leaf 1 EDX has
+    // CLFLUSH (bit 19)
+    unsigned int leaf7_ebx = 0, leaf1_edx = 0;
 #ifdef WIN32
-      Sleep(1000);  // 1 second
+    int regs[4];
+    __cpuidex(regs, 7, 0);
+    leaf7_ebx = regs[1];
+    __cpuid(regs, 1);
+    leaf1_edx = regs[3];
 #else
-      sleep(1);
+    unsigned int eax, ebx, ecx, edx;
+    if(__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx)) leaf7_ebx = ebx;
+    if(__get_cpuid(1, &eax, &ebx, &ecx, &edx)) leaf1_edx = edx;
 #endif
+    if(leaf7_ebx & (1u << 24)) return kFlushClwb;
+    if(leaf7_ebx & (1u << 23)) return kFlushClflushopt;
+    if(leaf1_edx & (1u << 19)) return kFlushClflush;
+    return kFlushNone;
+  }
 
-      uint64_t end = __rdtsc();
-      write_delay_cycles = (double)(end - start) / 1000000000 * delay_ns;
+  static const char* FlushName(FlushKind kind) {
+    switch(kind) {
+    case kFlushClwb: return "CLWB";
+    case kFlushClflushopt: return "CLFLUSHOPT";
+    case kFlushClflush: return "CLFLUSH";
+    default: return "none";
     }
-    LOG(INFO) << "Write delay: " << delay_ns << "ns (" <<
-        write_delay_cycles << " cycles)";
+  }
 
+  /// Flush with [kind] from now on, which the CPU must have
+  static void InitializeFlush(FlushKind kind) {
+    flush_kind = kind;
+    LOG(INFO) << "Will use " << FlushName(kind);
+  }
+
+  static void InitializeClflush() {
+    InitializeFlush(kFlushClflush);
+  }
+
+  /// Emulate NVRAM on DRAM, on top of the flush instruction in use, for
+  /// the EMU backend (with PMDK, the pool does the flushing and only
+  /// [read_ns] applies). Each cost is turned off with 0:
+  /// - [flush_ns] is spent on every cache line written back
+  /// - [fence_ns] on every fence that has write backs to wait for
+  /// - [write_mbps] caps the write back bandwidth of all threads together, a
+  ///   fence also waits until its write backs got through
+  /// - [read_ns] on the first read of a line, and again once the line was
+  ///   evicted from the per-thread emulated cache, or flushed with CLFLUSH or
+  ///   CLFLUSHOPT, which invalidate it
+  static void InitializeEmulation(uint64_t flush_ns, uint64_t fence_ns,
+      uint64_t write_mbps, uint64_t read_ns) {
+    double cycles_per_ns = CyclesPerNs();
+    write_delay_cycles = flush_ns * cycles_per_ns;
+    fence_delay_cycles = fence_ns * cycles_per_ns;
+    read_delay_cycles = read_ns * cycles_per_ns;
+    write_byte_per_cycle = write_mbps ?
+        write_mbps * 1000000.0 / (cycles_per_ns * 1000000000) : 0;
+    emulate_writes = write_delay_cycles || fence_delay_cycles ||
+        write_byte_per_cycle > 0;
+    LOG(INFO) << "Emulation: flush " << flush_ns << "ns fence " << fence_ns <<
+        "ns bandwidth " << write_mbps << "MB/s read " << read_ns << "ns (" <<
+        cycles_per_ns << " cycles per ns)";
+  }
+
+  /// No flush instruction, only a [delay_ns] spin per line written back, and
+  /// if [emulate_wb], a write back bandwidth of one CLFLUSH at a time
+  static void InitializeSpin(uint64_t delay_ns, bool emulate_wb) {
+    flush_kind = kFlushNone;
+    uint64_t write_mbps = 0;
     if(emulate_wb) {
       char test_array[kCacheLineSize];
       unsigned int not_used = 0;
       uint64_t start = __rdtscp(&not_used);
       _mm_clflush(test_array);
       uint64_t end = __rdtscp(&not_used);
-      write_byte_per_cycle = (double)kCacheLineSize / (end - start);
-    } else {
-      write_byte_per_cycle = 0;
+      double ns = std::max<double>(1, (end - start) / CyclesPerNs());
+      write_mbps = std::max<uint64_t>(1, kCacheLineSize * 1000 / ns);
     }
+    InitializeEmulation(delay_ns, 0, write_mbps, 0);
+  }
 
-    LOG(INFO) << "BW emulation: " << write_byte_per_cycle << " bytes per cycle";
+  /// A read of [data, data + bytes) from emulated NVRAM, which costs the read
+  /// delay for every line that isn't in this thread's emulated cache
+  static inline void Touch(uint64_t bytes, const void* data) {
+    if(read_delay_cycles == 0) return;
+    uint64_t line = (uint64_t)data & ~(uint64_t)(kCacheLineSize - 1);
+    uint64_t end = (uint64_t)data + bytes;
+    for(; line < end; line += kCacheLineSize) {
+      uint64_t &tag = cached_lines[(line / kCacheLineSize) % kEmulatedCacheLines];
+      if(tag != line) {
+        tag = line;
+        Spin(read_delay_cycles);
+      }
+    }
+  }
+
+  /// Write back every cache line of [data, data + bytes) with [kind],
+  /// without waiting for it, see Fence()
+  static inline void FlushLines(FlushKind kind, uint64_t bytes,
+      const void* data) {
+    if(kind == kFlushNone && !emulate_writes) return;
+    RAW_CHECK(data, "null data");
+    uint64_t line = (uint64_t)data & ~(uint64_t)(kCacheLineSize - 1);
+    uint64_t end = (uint64_t)data + bytes;
+    for(; line < end; line += kCacheLineSize) {
+      switch(kind) {
+      case kFlushNone: break;
+      case kFlushClwb: Clwb((void*)line); break;
+      case kFlushClflushopt: Clflushopt((void*)line); break;
+      default: _mm_clflush((void*)line); break;
+      }
+      if((kind == kFlushClflush || kind == kFlushClflushopt) &&
+          read_delay_cycles) {
+        uint64_t &tag = cached_lines[(line / kCacheLineSize) % kEmulatedCacheLines];
+        if(tag == line) tag = 0;
+      }
+      if(emulate_writes) EmulateWriteBack();
+    }
+  }
+
+  /// Wait for the write backs FlushLines() started with [kind]
+  static inline void Fence(FlushKind kind) {
+    // CLFLUSH is ordered already
+    if(kind == kFlushClwb || kind == kFlushClflushopt) _mm_sfence();
+    if(emulate_writes) EmulateFence();
   }
 
   static inline void Flush(uint64_t bytes, const void* data) {
@@ -65,34 +182,134 @@ struct NVRAM {
     auto pmdk_allocator = reinterpret_cast<PMDKAllocator*>(Allocator::Get());
     pmdk_allocator->PersistPtr(data, bytes);
 #else
-    if(use_clflush) {
-      RAW_CHECK(data, "null data");
-      uint64_t ncachelines = (bytes + kCacheLineSize - 1) / kCacheLineSize;
-      // Flush each cacheline in the given [data, data + bytes) range
-      for(uint64_t i = 0; i < ncachelines; ++i) {
-        _mm_clflush(&((char*)data)[i * ncachelines]);
-      }
-    } else {
-#if 0
-      // Previously this was calculated outside the [if] block, slowing down
-      // read-only workloads (slower than with clflush).
-      //
-      // Update #2: perhaps the fairest way is comment out this whole else
-      // block so it does nothing when we don't specify delays.
-      if(write_delay_cycles > 0) {
-        unsigned int aux = 0;
-        uint64_t bw_cycles = write_byte_per_cycle > 0 ?
-          bytes / write_byte_per_cycle : 0;
-        uint64_t start = __rdtscp(&aux);
-
-        while (__rdtscp(&aux) - start < write_delay_cycles + bw_cycles) {
-          // SPIN
-        }
+    FlushLines(flush_kind, bytes, data);
+    Fence(flush_kind);
+#endif  // PMDK
+  }
+
+  /// Like Flush, but without waiting for the write back, so that a batch of
+  /// flushes only waits once, in Drain()
+  static inline void FlushAsync(uint64_t bytes, const void* data) {
+#ifdef PMDK
+    auto pmdk_allocator = reinterpret_cast<PMDKAllocator*>(Allocator::Get());
+    pmdk_allocator->FlushPtr(data, bytes);
+#else
+    FlushLines(flush_kind, bytes, data);
+#endif  // PMDK
+  }
+
+  static inline void Drain() {
+#ifdef PMDK
+    auto pmdk_allocator = reinterpret_cast<PMDKAllocator*>(Allocator::Get());
+    pmdk_allocator->Drain();
+#else
+    Fence(flush_kind);
+#endif  // PMDK
+  }
+
+  /// Flushes the words of a batch that only need to be durable together, like
+  /// the target words of one PMwCAS phase: each cache line is flushed once,
+  /// and Drain() waits for all of them at once. Repeats are only skipped for
+  /// the first [kLines] lines, the ones after that are flushed regardless.
+  /// A store to a line after its flush is not covered, so all the words of a
+  /// batch have to be written before the first Add().
+  template <uint32_t kLines>
+  class FlushBatch {
+   public:
+    FlushBatch() : count_(0) {}
+
+    inline void Add(const void* data) {
+      uint64_t line = (uint64_t)data & ~(uint64_t)(kCacheLineSize - 1);
+      for(uint32_t i = 0; i < count_ && i < kLines; ++i) {
+        if(lines_[i] == line) return;
       }
-#endif
+      if(count_ < kLines) lines_[count_] = line;
+      ++count_;
+      FlushAsync(sizeof(uint64_t), data);
     }
-#endif  // PMDK
+
+    inline void Drain() {
+      if(count_ == 0) return;
+      NVRAM::Drain();
+      count_ = 0;
+    }
+
+   private:
+    uint64_t lines_[kLines];
+    uint32_t count_;
+  };
+
+ private:
+  static const uint32_t kEmulatedCacheLines = 8192;
+
+  /// Whether any write back cost is emulated
+  static bool emulate_writes;
+  /// Cycle up to which the emulated write back bandwidth is taken
+  static std::atomic<uint64_t> write_busy_until;
+  /// Cycle at which this thread's write backs since its last fence are done,
+  /// and how many of them there are
+  static thread_local uint64_t write_done_at;
+  static thread_local uint64_t pending_lines;
+  /// Direct-mapped tags of the lines this thread read, for the read delay
+  static thread_local uint64_t cached_lines[kEmulatedCacheLines];
+
+  static double CyclesPerNs() {
+    auto start_time = std::chrono::steady_clock::now();
+    uint64_t start = __rdtsc();
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    uint64_t end = __rdtsc();
+    auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now() - start_time).count();
+    return (double)(end - start) / ns;
+  }
+
+  static inline void Spin(uint64_t cycles) {
+    if(cycles == 0) return;
+    uint64_t start = __rdtsc();
+    while(__rdtsc() - start < cycles) {
+      _mm_pause();
+    }
+  }
+
+  static inline void EmulateWriteBack() {
+    Spin(write_delay_cycles);
+    if(write_byte_per_cycle > 0) {
+      // queue behind everyone else's write backs
+      uint64_t cycles = kCacheLineSize / write_byte_per_cycle;
+      uint64_t now = __rdtsc();
+      uint64_t busy = write_busy_until.load(std::memory_order_relaxed);
+      uint64_t done;
+      do {
+        done = std::max(busy, now) + cycles;
+      } while(!write_busy_until.compare_exchange_weak(busy, done,
+          std::memory_order_relaxed));
+      write_done_at = std::max(write_done_at, done);
+    }
+    ++pending_lines;
+  }
+
+  static inline void EmulateFence() {
+    if(pending_lines == 0) return;
+    pending_lines = 0;
+    Spin(fence_delay_cycles);
+    while(__rdtsc() < write_done_at) {
+      _mm_pause();
+    }
+  }
+
+  // compiled for the instruction only, so that the rest doesn't need it,
+  // which is fine since they are only called if the CPU has it
+#ifdef WIN32
+  static inline void Clwb(void* p) { _mm_clwb(p); }
+  static inline void Clflushopt(void* p) { _mm_clflushopt(p); }
+#else
+  __attribute__((target("clwb"))) static void Clwb(void* p) {
+    _mm_clwb(p);
   }
+  __attribute__((target("clflushopt"))) static void Clflushopt(void* p) {
+    _mm_clflushopt(p);
+  }
+#endif
 #endif  // PMEM
 };
 